@@ -1,786 +1,4588 @@
-#include "tinyc.h"
-
-int main(int argc, char *argv[]) {
-    char *input_arg = NULL;
-    char *folder_to_serve = NULL, *default_route = NULL;
-    char server_ip[255] = "0.0.0.0";
-    #ifndef __linux__
-        char client_ip[8] = ":";
-    #else
-        char client_ip[INET_ADDRSTRLEN] = ":";
-    #endif
-
-    int16_t port = DEFAULT_PORT;
-    int16_t backlog = SERVER_BACKLOG;
-    int16_t max_threads = MAX_THREADS;
-    int8_t show_explorer = TRUE;
-
-    #ifndef __linux__
-        setlocale(LC_ALL, "");
-    #endif
-    // Socket vars declaration
-    SocketType server_socket, client_socket;
-    struct sockaddr_in address;
-    int32_t addrlen = sizeof(address);
-
-    #ifdef _WIN32
-        WSADATA wsaData;
-    #endif
-
-    /* =====================================  */
-    /* ======= Arg parse ===================  */
-    /* =====================================  */
-
-    if(get_arg_value(argc, argv, "--help") != NULL){
-        printf(
-            "::: TinyC lightweight http server (by hwpoison) :::\n"
-            "\nBasic usage: %s --port 8081 --folder /my_web\n"
-            " example: %s --port 3543 --folder simple_web/index.html\n"
-            "\nOptions:\n"
-            "\t--folder <folder_path>: Folder to serve. By default is a relative path due to executable location.\n"
-            "\t--ip: Set server IP. Default: ANY (Local/Network).\n"
-            "\t--port <port_number>: Port number. Default is %d\n"
-            "\t--backlog <number>: Max server listener.\n"
-            "\t--max-threads <number>: Max server threads.\n"
-            "\t--default-redirect <file_path>/: redirect / to default file route. ex: simple_web/index.html\n"
-            "\t--no-logs : No print log (Less I/O bound due to stdout and less memory consumption)).\n"
-            "\t--no-file-explorer: Disable file explorer.\n"
-            ,argv[0], argv[0], DEFAULT_PORT);
-        return 0;
-    }
-
-    // Get args
-    if((input_arg = get_arg_value(argc, argv, "--port")) != NULL)
-        port = atoi(input_arg);
-
-    if((input_arg = get_arg_value(argc, argv, "--backlog")) != NULL)
-        backlog = atoi(input_arg);
-
-    if((input_arg = get_arg_value(argc, argv, "--max-threads")) != NULL)
-        max_threads = atoi(input_arg);
-
-    if((input_arg = get_arg_value(argc, argv, "--ip")) != NULL)
-        strcpy(server_ip, input_arg);
-
-    if((get_arg_value(argc, argv, "--no-logs")) != NULL)
-        no_logs = TRUE;
-
-    if(get_arg_value(argc, argv, "--no-file-explorer") != NULL)
-        show_explorer = FALSE;
-
-    if((input_arg = get_arg_value(argc, argv, "--folder")) != NULL)
-        folder_to_serve = input_arg;
-
-    default_route = get_arg_value(argc, argv, "--default-redirect");
-
-    set_shell_text_color("36"); // lightblue
-    write_log(NULL, "Max threads: %d", max_threads);
-    write_log(NULL, "Backlog: %d", backlog);
-
-    #ifdef MULTITHREAD_ON
-        pthread_t *all_threads = safe_malloc(sizeof(pthread_t)*max_threads);
-        int16_t thread_count = 0;
-        write_log(NULL, "Multithreading enabled.");
-    #endif
-
-    /* =============================================================  */
-    /* ======= Server scket initialization and configuration =======  */
-    /* =============================================================  */
-    write_log(NULL, "Initializing server socket.");
-    // Winsock init
-    #ifdef _WIN32
-        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-            perror("Error with winsock");
-            exit(EXIT_FAILURE);
-        }
-    #endif
-
-    // Create server socket
-    if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("Error to create server socket.");
-        exit(EXIT_FAILURE);
-    }
-
-    // Set up the socket
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = inet_addr(server_ip);
-    address.sin_port = htons(port);
-
-    #ifdef __linux__
-        struct timeval timeout = { .tv_sec = CLIENT_TIMEOUT, .tv_usec = 0};
-    #else
-        int timeout = 1000*CLIENT_TIMEOUT; // ms to sec for win
-    #endif
-
-    // Bind addr and port
-    if (bind(server_socket, (struct sockaddr*)&address, sizeof(address)) < 0) {
-        write_log(NULL, "[x] Error binding the socket to address and port %s:%d.", server_ip, port);
-        socket_error_msg();
-        exit(EXIT_FAILURE);
-    }
-
-    // Start to listen incoming connections
-    if (listen(server_socket, backlog) < 0) {
-        perror("Error to listen connections.");
-        exit(EXIT_FAILURE);
-    }
-    if(!no_logs){
-        set_shell_text_color("32");
-        printf("####  Welcome to tinyC! #### (%s)\n", __TIMESTAMP__);
-        printf("#### Running at %s:%d\n", server_ip, port);
-        set_shell_text_color("0");
-    }
-
-    write_log(NULL, "==> Tinyc server started");
-    write_log(NULL, "> Running server at: %s:%d", server_ip, port);
-    set_shell_text_color("0");
-
-    /* =====================================  */
-    /* ======= Accept connections loop =====  */
-    /* =====================================  */
-    // At this point, the server is running and waiting for upcoming connections
-    for(;;) {
-        #ifdef MULTITHREAD_ON
-            // Check threads limits, if reach the max, waits until all are finished before 
-            // open new one.
-            if(thread_count >= max_threads){
-                write_log("error", "Server too busy...\n");
-                for(int i = 0; i < max_threads - 1; i++){
-                    pthread_join(all_threads[i], NULL);
-                    all_threads[i] = 0;
-                }
-                thread_count = 0;
-                write_log("info", "All threads free up.\n");
-            }
-        #endif
-
-        // Accept client new connection
-        #ifdef __linux__
-            if ((client_socket = accept(server_socket, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-        #else
-            if ((client_socket = accept(server_socket, (struct sockaddr *)&address, &addrlen)) == INVALID_SOCKET) {
-        #endif
-            write_log("error", "Error accepting the connection");
-            continue;
-        }
-
-        // Get client ip address
-        #ifdef __linux__
-            inet_ntop(AF_INET, &(address.sin_addr), client_ip, INET_ADDRSTRLEN);
-        #else
-            strcpy(client_ip, inet_ntoa(address.sin_addr));
-        #endif
-
-        // Set timeout in send and receive data from client_socket
-        if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) == -1 ||
-            setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout)) == -1) {
-            perror("Error to setup socket timeout.");
-            close(client_socket);
-            exit(EXIT_FAILURE);
-        }
-
-        // Prepare to handle the incoming connection
-        write_log("info", "[%d] Incoming connection from %s", client_socket, client_ip);
-
-        connection_params *client_conn = safe_malloc(sizeof(connection_params));
-        client_conn->socket = client_socket;
-        client_conn->default_route = default_route;
-        client_conn->folder_to_serve = folder_to_serve;
-        client_conn->show_explorer = show_explorer;
-
-        #ifdef MULTITHREAD_ON
-            // handle the new connection in a thread apart
-            int new_thread = pthread_create(&all_threads[thread_count], NULL, handle_connection_thread, (void*)client_conn);
-            if(new_thread != 0){
-                write_log("error", "pthread_create failed: '%s'", strerror(new_thread));
-            }
-            pthread_detach(all_threads[thread_count]);
-            thread_count++;
-        #else
-            // handle the connection in a single thread
-            handle_connection(client_conn);
-        #endif
-    }   
-
-    // Close server socket and release memory
-    close_socket(server_socket);
-    #ifdef _WIN32
-        WSACleanup();
-    #endif
-
-    atexit(close_log_file);
-    return 0;
-}
-
-char *get_arg_value(int argc, char **argv, char *target_arg){
-    for(int arg_idx = 0; arg_idx < argc; arg_idx++){
-        if(!strcmp(argv[arg_idx], target_arg)) // <arg> <value> 
-            return argv[arg_idx+1]==NULL?"":argv[arg_idx+1];
-    }
-    return NULL;
-}
-
-void set_shell_text_color(const char* color) {
-    printf("\033[%sm", color);
-}
-
-void init_log_file() {
-    log_file = fopen(LOG_FILE_NAME, "a");
-    if (!log_file) {
-        perror("Can't create log file.");
-        exit(1);
-    }
-}
-
-void close_log_file() {
-    if (log_file) {
-        fclose(log_file);
-        log_file = NULL;
-    }
-}
-
-void write_log(const char* type, const char* msg, ...) {
-    if(!no_logs){
-        if(log_file==NULL)
-            init_log_file();
-    
-        va_list args;
-        char* full_date = get_current_datetime();
-        if (!log_file) return;
-
-        va_start(args, msg);
-        if (type != NULL) {
-            if(!strcmp(type, "error")){
-                fprintf(log_file, "[ERROR][%s] ", full_date);
-            }
-            if(!strcmp(type, "info")){
-                fprintf(log_file, "[INFO][%s] ", full_date);
-            }
-            if(!strcmp(type, "debug")){
-                printf("[DEBUG][%s]", full_date);
-                vprintf(msg, args);
-                printf("\n");
-                fprintf(log_file, "[DEBUG][%s]", full_date);
-            }
-        } else {
-            fprintf(log_file, "[%s] ", full_date);
-        }
-
-        vfprintf(log_file, msg, args);
-        fprintf(log_file, "\n");
-        va_end(args);
-    }
-}
-
-void send_response(SocketType to_socket, const char *response_content) {
-    write_log(NULL, "Sending %d bytes.", strlen(response_content));
-    if(send(to_socket, response_content, strlen(response_content), 0) < 0){
-        write_log(NULL, "Error to sending.\n");
-    }
-}
-
-void send_partial_content(SocketType  socket, FILE *file, const char *content_type, size_t file_size, size_t start, size_t end) {
-    // Seek the file to the specified rangue before send
-    fseek(file, start, SEEK_SET);
-    // Check if the requested range is within the file size
-    if (start > file_size || end > file_size) {
-        write_log("error", "[!] Error: requested range is out of bounds.");
-        send_500_response(socket);
-        return;
-    }
-
-    // Send header with range and content length (for video html stream content)
-    char header[MAX_HEADER_SIZE];
-    snprintf(header, MAX_HEADER_SIZE, "HTTP/1.1 206 Partial Content\r\n"
-                    "Connection: keep-alive\r\n"
-                    "Keep-Alive: timeout=5\r\n"
-                    "Accept-Ranges: bytes\r\n"
-                    "Content-Type: %s; charset=utf-8\r\n"
-                    "Content-Range: bytes " SIZE_T_FORMAT "-" SIZE_T_FORMAT "/" SIZE_T_FORMAT "\r\n"
-                    "Content-Length: " SIZE_T_FORMAT "\r\n\r\n", content_type, start, end, file_size, end - start + 1);
-    send_response(socket, header);
-    send_file_content(socket, file); // then send the file fragment
-    write_log("info", "Response 206 done.");
-}
-
-void send_content(SocketType socket, FILE *file, const char *content_type, size_t content_length) {
-    char header[MAX_HEADER_SIZE];
-    snprintf(header, MAX_HEADER_SIZE, "HTTP/1.1 200 OK\r\n"
-                    "Connection: keep-alive\r\n"
-                    "Keep-Alive: timeout=5\r\n"
-                    "Access-Control-Allow-Origin: *\r\n"
-                    "Accept-Ranges: bytes\r\n"
-                    "Content-Type: %s; charset=utf-8\r\n"
-                    "Content-Length: " SIZE_T_FORMAT "\r\n\r\n", content_type, content_length);
-    send_response(socket, header);
-    send_file_content(socket, file); // then the file content
-    write_log("info", "Response 200 Done.");
-}
-
-void send_302_response(SocketType  socket, char *uri) {
-    char buffer[BUFFER_SIZE];
-    snprintf(buffer, MAX_HEADER_SIZE, HTTP_302_REDIRECTION, uri);
-    send_response(socket, buffer);
-    write_log("info", "302 redirection to %s", uri);
-}
-
-void send_404_response(SocketType  socket) {
-    send_response(socket, HTTP_404_NOT_FOUND);
-    write_log("info", "404 not found.");
-}
-
-void send_200_response(SocketType  socket) {
-    send_response(socket, HTTP_200_OK);
-    write_log("info", "OK");
-}
-
-
-void send_414_response(SocketType socket){
-    send_response(socket, HTTP_414_URL_TOO_LONG);
-    write_log("info", "404 not found.");
-}
-
-void send_500_response(SocketType  socket) {
-    send_response(socket, HTTP_500_INTERNAL_ERROR);
-    write_log("error", "500 server side error.");
-}
-
-int starts_with(const char *str, const char *word) {
-    size_t word_len = strlen(word);
-    return strncmp(str, word, word_len) == 0?TRUE:FALSE;
-}
-
-#ifdef __linux__
-    size_t get_file_length(const char* filename){
-        FILE *file = fopen(filename, "rb");
-        if (file == NULL) {
-            write_log("error", "Error to open the file for get file size : %s", filename);
-            return 0;
-        }
-        fseek(file, 0, SEEK_END);
-        size_t fileLength = ftell(file);
-        fclose(file);
-        return fileLength;
-    }
-#else
-    uint64_t get_file_length(const char* filename) {
-        HANDLE hFile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-        if (hFile == INVALID_HANDLE_VALUE) {
-            write_log("error", "Error to open the file for get file size : %s", filename);
-            return 0;
-        }
-        LARGE_INTEGER fileSize;
-        if (!GetFileSizeEx(hFile, &fileSize)) {
-            CloseHandle(hFile);
-            write_log("error", "Error to get file size : %s", filename);
-            return 0;
-        }
-        CloseHandle(hFile);
-        return (uint64_t)fileSize.QuadPart;
-    }
-#endif
-
-char *cstrdup(char *string){
-   size_t string_len = strlen(string) + 1;
-   char *dup = malloc(string_len);
-   if(dup != NULL){
-        memcpy(dup, string, string_len);
-   } 
-   return dup;
-}
-
-void send_file_content(SocketType to_socket, FILE *file){
-    char buffer[BUFFER_SIZE] = {0};
-    size_t bytesRead;
-    while ((bytesRead = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        if(send(to_socket, buffer, bytesRead, SEND_D_FLAG ) < 0)
-            break;
-    }
-}
-
-void remove_slash_from_start(char* str) {
-    size_t length = strlen(str);
-    if (length > 0 && str[0] == '/') {
-        memmove(str, str + 1, length);
-        str[length - 1] = '\0';
-    }
-}
-
-const char *get_filename_extension(const char *path) {
-    const char *extension = strrchr(path, '.');
-    return extension!=NULL && extension!=path?extension:"";
-}
-
-const char *get_filename_mimetype(const char *path) {
-    const char *extension = get_filename_extension(path);
-    for (int i = 0; mime_types[i].extension != NULL; i++) {
-        if (strcmp(mime_types[i].extension, extension) == 0)
-            return mime_types[i].mime_type;
-    }
-    return "application/octet-stream"; // default mimetype
-}
-
-char* get_current_datetime() {
-    time_t now;
-    struct tm current_date;
-    static char currenttime[30];
-    time(&now);
-    #ifdef __linux__
-        localtime_r(&now, &current_date);
-    #else 
-        localtime_s(&current_date, &now);
-    #endif
-    strftime(currenttime, sizeof(currenttime), "%Y-%m-%d %H:%M:%S", &current_date);
-    return currenttime;
-}
-
-void close_socket(SocketType socket) {
-    #ifdef __linux__
-        close(socket);
-    #else 
-        closesocket(socket);
-    #endif
-    write_log("info", "[%d] Socket closed.", socket);
-}
-
-
-int extract_URI_from_header(char *header_content, char *output_buffer, size_t buffer_size) {
-    char *start, *end;
-    int length;
-    
-    // Initialize output buffer with default value
-    strncpy(output_buffer, "/", buffer_size - 1);
-    output_buffer[buffer_size - 1] = '\0';
-    
-    if ((start = strchr(header_content, ' ')) != NULL &&
-        (end = strchr(start + 1, ' ')) != NULL) {
-        
-        length = (end - start - 1);
-        
-        if (length <= 0 || length >= MAX_PATH_LENGTH || length >= (int)buffer_size) {
-            write_log("error", "URI too long or invalid.");
-            return 1; // output_buffer already contains "/"
-        }
-        
-        strncpy(output_buffer, start + 1, length);
-        output_buffer[length] = '\0';
-        return 0;
-    }
-}
-
-
-void decode_url(char* url) {
-    char *url_p = url;
-    int decoded_char;
-    while (*url_p) {
-        if (*url_p == '%' && isxdigit(*(url_p + 1)) && isxdigit(*(url_p + 2))) {
-            char hex[3] = {url_p[1], url_p[2], '\0'};
-            sscanf(hex, "%x", &decoded_char);
-            memmove(url_p + 1, url_p + 3, strlen(url_p + 2) + 1); 
-            *url_p = decoded_char;
-        }
-        url_p++;
-    }
-}
-
-void *safe_malloc(size_t size) {
-    void* ptr = malloc(size);
-    if (ptr == NULL) {
-        write_log("error", "Error allocating memory.");
-        exit(-1);
-    }
-    return ptr;
-}
-
-/* Returns a list with all files entries from path and write the file count un file_mount */
-char **get_dir_content(const char* path, size_t *file_amount) {
-  char **dir_content = (char**)safe_malloc(EXPLORER_MAX_FILES * sizeof(char*) + 1);
-  char entry_name[EXPLORER_MAX_FILENAME_LENGTH + 2 ];
-  int file_n = 0;
-
-  #ifdef __linux__
-    DIR *dir;
-    struct dirent *entry;
-    dir = opendir(path);
-    struct stat file_stat;
-    if(dir == NULL){
-        write_log("error", "linux: not possible get directory content %s", path);
-        free(dir_content);
-        return NULL;
-    }
-
-    // compose the current dir list
-    while ((entry= readdir(dir)) != NULL){
-        if(strlen(entry->d_name) > EXPLORER_MAX_FILENAME_LENGTH){
-            write_log("error", "File name too long.");
-            continue;
-        }
-
-        if(file_n >= EXPLORER_MAX_FILES){
-            write_log("info", "Maximum of showed files exceded.");
-            break;
-        }
-
-        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
-            continue;
-        
-        snprintf(entry_name, sizeof(entry_name) , "%s/%s", path, entry->d_name);
-
-        if (stat(entry_name, &file_stat) == 0) {
-            if (S_ISDIR(file_stat.st_mode))
-                sprintf(entry_name, "%s/", entry->d_name);
-            else
-                sprintf(entry_name, "%s", entry->d_name);
-        }
-
-        dir_content[file_n] = (char*)safe_malloc(strlen(entry_name) + 1);
-        strcpy(dir_content[file_n], entry_name);
-
-        file_n++;
-    }
-    closedir(dir);
-
-  #else
-    WIN32_FIND_DATA find_data;
-    HANDLE h_find;
-    h_find = FindFirstFile(path, &find_data);
-
-    if (h_find == INVALID_HANDLE_VALUE){
-        write_log("error", "windows: not possible get directory content %s", path);
-        free(dir_content);
-        return NULL;
-    }
-
-    while(FindNextFile(h_find, &find_data)){
-        if(file_n >= EXPLORER_MAX_FILES){
-            write_log("info", "Maximum of files exceded.");
-            break; 
-        }
-
-        if(strlen(find_data.cFileName) > EXPLORER_MAX_FILENAME_LENGTH){
-            write_log("error", "File name too long.");
-            continue;
-        }
-        if (!strcmp(find_data.cFileName, ".") || !strcmp(find_data.cFileName, ".."))
-            continue;
-
-        if(find_data.dwFileAttributes == FILE_ATTRIBUTE_DIRECTORY)
-            sprintf(entry_name, "%s/", find_data.cFileName);
-        else
-            sprintf(entry_name, "%s", find_data.cFileName);
-
-        dir_content[file_n] = (char*)safe_malloc(strlen(entry_name) + 1);
-        strcpy(dir_content[file_n], entry_name);
-        file_n++;
-    }
-  FindClose(h_find);
-#endif
-  *file_amount = file_n;
-  dir_content[file_n+1] = NULL;
-  
-  return dir_content;
-}
-
-void concat_str(char **main_str, const char *to_add) {
-    size_t len_add = strlen(to_add);
-
-    if (*main_str == NULL) {
-        size_t initial_size = len_add + 1 + HTML_EL_SIZE;
-        *main_str = malloc(initial_size);
-        if (!*main_str) {
-            return;
-        }
-        (*main_str)[0] = '\0';
-    } else {
-        size_t len_base = strlen(*main_str);
-        size_t needed   = len_base + len_add + 1;
-
-        char *temp = realloc(*main_str, needed + HTML_EL_SIZE);
-        if (!temp) {
-            return;
-        }
-        *main_str = temp;
-    }
-
-    strcat(*main_str, to_add);
-}
-
-
-void socket_error_msg(){
-    #ifdef __linux__
-        // todo
-        perror("Error caused by:");
-    #else
-        int errCode = WSAGetLastError();
-        write_log("error", "Socket error code %d", errCode);
-    #endif
-}
-
-void handle_connection(connection_params *conn){
-    char file_path[MAX_PATH_LENGTH] = {0};
-    char buffer[BUFFER_SIZE] = {0};
-    int8_t in_folder = FALSE; // Only serve files into specific folder
-    size_t read_bytes, file_size, start_offset, end_offset;
-
-    /* ====================================== */
-    /* =Read-Send loop between client-server= */
-    /* ====================================== */
-    // At this point, a connection with a client is established and the socket is ready to receive and send requests.
-    for(;;){
-        #ifdef __linux__
-            read_bytes = read(conn->socket, buffer, BUFFER_SIZE);
-        #else
-            read_bytes = recv(conn->socket, buffer, BUFFER_SIZE, 0);
-        #endif
-
-        if (read_bytes == 0) {
-            write_log(NULL, "[%d] Connection closed by client.", conn->socket);
-            break;
-        } else if (read_bytes == -1) {
-            socket_error_msg();
-            write_log("error", "[%d] Error reading content from client socket.", conn->socket);
-            break;
-        }
-
-        // Read and extract URI from the recv request
-        if(extract_URI_from_header(buffer, file_path, sizeof(file_path))){
-            send_414_response(conn->socket);
-            break;
-        }
-
-        decode_url(file_path);
-
-        if(strcmp(file_path, "/test")==0){
-            send_200_response(conn->socket);
-            break;
-        }
-
-        write_log(NULL, "Handling route: %s", file_path);
-
-        // Check if uri path == '/' and redirect to default route
-        if(strcmp(file_path, "/") == 0 && conn->default_route != NULL){
-            write_log("info", "Redirecting to %s", conn->default_route);
-            send_302_response(conn->socket, conn->default_route);
-        }
-        
-        remove_slash_from_start(file_path);
-
-        // Check if the path match with default folder
-        if(conn->folder_to_serve != NULL){
-            remove_slash_from_start(conn->folder_to_serve); 
-            in_folder = starts_with(file_path, conn->folder_to_serve);
-        }
-        
-        /* =====================================  */
-        /* =======      File explorer      =====  */
-        /* =====================================  */
-        size_t path_len = strlen(file_path);
-        char current_path[EXPLORER_MAX_FILENAME_LENGTH] = {0};
-
-		if(conn->show_explorer == TRUE &&
-			((path_len > 0 && file_path[path_len - 1] == '/') || strcmp(file_path, "") == 0)){
-				// If folder to serve is specified and path did not match, send a 404
-				if(conn->folder_to_serve!=NULL && !in_folder){
-					send_404_response(conn->socket);
-					break;
-				}
-
-            // get current path
-            #ifdef __linux__
-                sprintf(current_path, "./%s", file_path);
-            #else
-                sprintf(current_path, "./%s/*", file_path);
-            #endif
-
-            // get dir content
-            size_t file_amount;
-            write_log(NULL, "[%d] Explorer opened for '%s'", conn->socket, current_path);
-            char **dir_content = get_dir_content(current_path, &file_amount);
-            if(dir_content==NULL){
-               write_log("error", "Error getting dir content");
-               send_500_response(conn->socket);
-               break;
-            }
-
-            ///////// Create the html view /////////
-            char *file_html_list = NULL;
-            char list_element[EXPLORER_MAX_FILENAME_LENGTH];
-            // Explorer header
-            sprintf(list_element, FILE_EXPLORER_HEADER, file_path, file_amount);
-            concat_str(&file_html_list, list_element);
-
-            // Special entries
-            sprintf(list_element, FILE_EXPLORER_LIST_ELEMENT, "..", "..");
-            concat_str(&file_html_list, list_element);
-
-            // List all files
-            for(int x=0; x < file_amount; x++){
-                sprintf(list_element, FILE_EXPLORER_LIST_ELEMENT, dir_content[x], dir_content[x]);
-                list_element[strlen(list_element)] = '\0';
-                concat_str(&file_html_list, list_element);
-            }
-            // The footer
-            concat_str(&file_html_list, FILE_EXPLORER_FOOTER);
-
-            // send dir
-            send_response(conn->socket, file_html_list);
-
-            free(file_html_list);
-            for (int i = 0; i < file_amount; i++)
-                free(dir_content[i]);
-            free(dir_content); 
-            break;
-        }
-
-        // Open the file
-        write_log(NULL, "Finding for '%s' file..", file_path);
-        FILE *file = fopen(file_path, "rb");
-
-        // If file is not found send a 404
-        if (file == NULL) {
-            write_log("error", "The file '%s' could not be opened/found.", file_path);
-            send_404_response(conn->socket);
-            
-            break;
-
-        // Serve the file
-        } else {
-            file_size = get_file_length(file_path);
-            start_offset = 0, end_offset = file_size -1;
-            write_log(NULL, "File size: "SIZE_T_FORMAT, file_size);
-
-            // Check if the request is has a "range" header and extract range to stream
-            char* range_header = strstr(buffer, "Range: bytes=");
-            if (range_header != NULL) {
-                sscanf(range_header, "Range: bytes="SIZE_T_FORMAT"-"SIZE_T_FORMAT"", &start_offset, &end_offset);
-                write_log(NULL, "Range detected: from "SIZE_T_FORMAT" to " SIZE_T_FORMAT, start_offset, end_offset);
-                send_partial_content(
-                    conn->socket,
-                    file, 
-                    get_filename_mimetype(file_path), 
-                    file_size,
-                    start_offset, 
-                    end_offset);
-            }else{ 
-                send_content(
-                    conn->socket,
-                    file,
-                    get_filename_mimetype(file_path),
-                    file_size);
-            }
-            
-            fclose(file);
-        }
-    }
-    close_socket(conn->socket);
-    free(conn);
-}
-
-#ifdef MULTITHREAD_ON
-    void *handle_connection_thread(void *conn) {
-        connection_params *connection = (connection_params*)conn;
-        handle_connection(connection);
-        pthread_exit(NULL);
-        return NULL;
-    }
-#endif
+#include "tinyc.h"
+
+int main(int argc, char *argv[]) {
+    char *input_arg = NULL;
+    char *folder_to_serve = NULL, *default_route = NULL;
+    char server_ip[255] = "0.0.0.0";
+
+    int16_t port = DEFAULT_PORT;
+    int16_t backlog = SERVER_BACKLOG;
+    int16_t max_threads = MAX_THREADS;
+    #if defined(MULTITHREAD_ON) && !defined(EPOLL_ON)
+        int32_t queue_size = QUEUE_SIZE;
+    #endif
+    int32_t cache_size = CACHE_SIZE_MB;
+    int32_t connection_bandwidth = 0, total_bandwidth = 0; // kb/s
+    #ifdef ZLIB_ON
+        int32_t compress_cache_size = COMPRESS_CACHE_SIZE_MB;
+    #endif
+    int8_t show_explorer = TRUE;
+    int8_t path_index = TRUE;
+
+    #ifndef __linux__
+        setlocale(LC_ALL, "");
+    #else
+        signal(SIGPIPE, SIG_IGN); // sendfile has no MSG_NOSIGNAL, a closed peer must only fail the send
+    #endif
+    // Socket vars declaration
+    SocketType server_socket;
+    struct sockaddr_in address;
+
+    #ifdef _WIN32
+        WSADATA wsaData;
+    #endif
+
+    /* =====================================  */
+    /* ======= Arg parse ===================  */
+    /* =====================================  */
+
+    if(get_arg_value(argc, argv, "--help") != NULL){
+        printf(
+            "::: TinyC lightweight http server (by hwpoison) :::\n"
+            "\nBasic usage: %s --port 8081 --folder /my_web\n"
+            " example: %s --port 3543 --folder simple_web/index.html\n"
+            "\nOptions:\n"
+            "\t--folder <folder_path>: Folder to serve. By default is a relative path due to executable location.\n"
+            "\t--ip: Set server IP. Default: ANY (Local/Network).\n"
+            "\t--port <port_number>: Port number. Default is %d\n"
+            "\t--backlog <number>: Max server listener.\n"
+            "\t--max-threads <number>: Worker threads of the pool (spawned at startup).\n"
+            "\t--queue-size <number>: Max accepted connections waiting for a thread, new ones get a 503 when it is full. Default is %d\n"
+            "\t--max-connections <number>: Open connections above which new ones get a 503 (0 = no limit). Default is 0\n"
+            "\t--max-connections-per-ip <number>: Open connections per client address above which new ones get a 503 (0 = no limit). Default is 0\n"
+            "\t--retry-after <seconds>: Retry-After of the 503 sent to shed connections. Default is %d\n"
+            "\t--mmap-size <megabytes>: Memory mapped by files served from a shared mmap (0 disables it). Default is 0\n"
+            "\t--mmap-max-file-size <kb>: Bigger files are sent from their descriptor instead of mapped. Default is %d\n"
+            "\t--connection-bandwidth <kb/s>: Send rate of each connection for files of 256kb or more (0 = no limit). Default is 0\n"
+            "\t--total-bandwidth <kb/s>: Send rate of the whole server for files of 256kb or more (0 = no limit). Default is 0\n"
+            "\t--cache-size <megabytes>: Memory used to cache small files (0 disables it). Default is %d\n"
+            "\t--compress-cache-size <megabytes>: Memory used to keep files gzipped on the fly, needs a ZLIB=1 build (0 disables it). Default is %d\n"
+            "\t--idle-timeout <seconds>: Time a keep-alive connection may wait for its next request (0 disables it). Default is %d\n"
+            "\t--header-timeout <seconds>: Time a client has to send a whole request header (0 disables it). Default is %d\n"
+            "\t--send-timeout <seconds>: Time a client may go without reading any response byte (0 disables it). Default is %d\n"
+            "\t--mime-file <file_path>: Extra types to load, \"type ext1 ext2\" lines (the /etc/mime.types format).\n"
+            "\t--cache-control <rules>: Cache-Control per extension, ex: \".css=max-age=600;.html=no-cache;*=no-store\" (* = unknown types).\n"
+            "\t--default-redirect <file_path>/: redirect / to default file route. ex: simple_web/index.html\n"
+            "\t--no-logs : No print log (Less I/O bound due to stdout and less memory consumption)).\n"
+            "\t--log-policy <drop|block>: When a thread log buffer is full, drop the record or wait. Default is drop\n"
+            "\t--no-file-explorer: Disable file explorer.\n"
+            "\t--no-path-index: Don't keep the served tree indexed in memory (inotify, Linux), ask the filesystem on every request.\n"
+            "\t--no-metrics: Don't answer /metrics with the Prometheus counters.\n"
+            "\t--workers <number>: Prefork mode (Linux), worker processes with their own listener pinned to a core.\n"
+            "\t--io-uring: Serve with io_uring when the kernel supports it, else epoll (epoll build only).\n"
+            ,argv[0], argv[0], DEFAULT_PORT, QUEUE_SIZE, RETRY_AFTER_SECONDS, MMAP_MAX_FILE_SIZE / 1024, CACHE_SIZE_MB, COMPRESS_CACHE_SIZE_MB,
+            IDLE_TIMEOUT, HEADER_TIMEOUT, SEND_TIMEOUT);
+        return 0;
+    }
+
+    // Get args
+    if((input_arg = get_arg_value(argc, argv, "--port")) != NULL)
+        port = atoi(input_arg);
+
+    if((input_arg = get_arg_value(argc, argv, "--backlog")) != NULL)
+        backlog = atoi(input_arg);
+
+    if((input_arg = get_arg_value(argc, argv, "--max-threads")) != NULL)
+        max_threads = atoi(input_arg);
+
+    #if defined(MULTITHREAD_ON) && !defined(EPOLL_ON)
+        if((input_arg = get_arg_value(argc, argv, "--queue-size")) != NULL)
+            queue_size = atoi(input_arg);
+    #endif
+
+    if((input_arg = get_arg_value(argc, argv, "--cache-size")) != NULL)
+        cache_size = atoi(input_arg);
+
+    #ifdef ZLIB_ON
+        if((input_arg = get_arg_value(argc, argv, "--compress-cache-size")) != NULL)
+            compress_cache_size = atoi(input_arg);
+    #endif
+
+    if((input_arg = get_arg_value(argc, argv, "--max-connections")) != NULL)
+        admission.max_connections = atoi(input_arg);
+
+    if((input_arg = get_arg_value(argc, argv, "--max-connections-per-ip")) != NULL)
+        admission.max_per_ip = atoi(input_arg);
+
+    if((input_arg = get_arg_value(argc, argv, "--retry-after")) != NULL)
+        retry_after = atoi(input_arg);
+
+    if((input_arg = get_arg_value(argc, argv, "--mmap-size")) != NULL)
+        file_maps.budget = (size_t)atoi(input_arg) * 1024 * 1024;
+
+    if((input_arg = get_arg_value(argc, argv, "--mmap-max-file-size")) != NULL)
+        file_maps.max_file_size = (size_t)atoi(input_arg) * 1024;
+
+    if((input_arg = get_arg_value(argc, argv, "--connection-bandwidth")) != NULL)
+        connection_bandwidth = atoi(input_arg);
+
+    if((input_arg = get_arg_value(argc, argv, "--total-bandwidth")) != NULL)
+        total_bandwidth = atoi(input_arg);
+
+    if((input_arg = get_arg_value(argc, argv, "--idle-timeout")) != NULL)
+        deadline_seconds[DEADLINE_IDLE] = atoi(input_arg);
+
+    if((input_arg = get_arg_value(argc, argv, "--header-timeout")) != NULL)
+        deadline_seconds[DEADLINE_HEADER] = atoi(input_arg);
+
+    if((input_arg = get_arg_value(argc, argv, "--send-timeout")) != NULL)
+        deadline_seconds[DEADLINE_SEND] = atoi(input_arg);
+
+    if((get_arg_value(argc, argv, "--no-logs")) != NULL)
+        no_logs = TRUE;
+
+    // The types are indexed before --cache-control looks them up
+    if((input_arg = get_arg_value(argc, argv, "--mime-file")) != NULL){
+        int loaded = load_mime_file(input_arg);
+        if(loaded < 0){
+            write_log("error", "[x] The mime file '%s' could not be read.", input_arg);
+            exit(EXIT_FAILURE);
+        }
+        write_log(NULL, "Loaded %d extensions from '%s'.", loaded, input_arg);
+    }
+    build_mime_index();
+
+    if((input_arg = get_arg_value(argc, argv, "--cache-control")) != NULL)
+        set_cache_control_policy(input_arg);
+
+    if((input_arg = get_arg_value(argc, argv, "--ip")) != NULL)
+        strcpy(server_ip, input_arg);
+
+    #ifdef MULTITHREAD_ON
+        if((input_arg = get_arg_value(argc, argv, "--log-policy")) != NULL)
+            log_block_when_full = strcmp(input_arg, "block") == 0;
+    #endif
+
+    #ifdef IO_URING_ON
+        if(get_arg_value(argc, argv, "--io-uring") != NULL)
+            use_io_uring = TRUE;
+    #endif
+
+    if(get_arg_value(argc, argv, "--no-file-explorer") != NULL)
+        show_explorer = FALSE;
+
+    if(get_arg_value(argc, argv, "--no-path-index") != NULL)
+        path_index = FALSE;
+
+    if(get_arg_value(argc, argv, "--no-metrics") != NULL)
+        metrics_enabled = FALSE;
+
+    if((input_arg = get_arg_value(argc, argv, "--folder")) != NULL){
+        // Compared with the normalized request paths
+        folder_to_serve = input_arg;
+        remove_slash_from_start(folder_to_serve);
+        if(!normalize_path(folder_to_serve)){
+            write_log("error", "The folder to serve must be under the working directory.");
+            exit(EXIT_FAILURE);
+        }
+        size_t folder_length = strlen(folder_to_serve);
+        if(folder_length > 0 && folder_to_serve[folder_length - 1] == '/')
+            folder_to_serve[folder_length - 1] = '\0';
+    }
+
+    default_route = get_arg_value(argc, argv, "--default-redirect");
+
+    #ifdef __linux__
+        // Prefork: the master only supervises, every worker runs the rest of main
+        if((input_arg = get_arg_value(argc, argv, "--workers")) != NULL && atoi(input_arg) > 0)
+            run_workers(atoi(input_arg));
+    #endif
+
+    #ifdef MULTITHREAD_ON
+        if(!no_logs)
+            start_log_writer();
+    #endif
+
+    server_started_at = time(NULL);
+    set_shell_text_color("36"); // lightblue
+    write_log(NULL, "Max threads: %d", max_threads);
+    write_log(NULL, "Backlog: %d", backlog);
+    write_log(NULL, "Timeouts: idle %ds, header %ds, send %ds", deadline_seconds[DEADLINE_IDLE],
+              deadline_seconds[DEADLINE_HEADER], deadline_seconds[DEADLINE_SEND]);
+    init_timer_wheel(&connection_timers);
+    init_buffer_pool(&io_buffers);
+    init_admission();
+    init_shaping((uint64_t)connection_bandwidth * 1024, (uint64_t)total_bandwidth * 1024);
+    init_file_cache();
+    init_memory_cache(&content_cache, "Content", (size_t)cache_size * 1024 * 1024, CACHE_MAX_FILE_SIZE);
+    init_memory_cache(&explorer_cache, "Explorer", (size_t)EXPLORER_CACHE_SIZE_MB * 1024 * 1024, EXPLORER_CACHE_MAX_SIZE);
+    #ifdef ZLIB_ON
+        init_memory_cache(&compressed_cache, "Compressed", (size_t)compress_cache_size * 1024 * 1024, COMPRESS_MAX_FILE_SIZE);
+    #endif
+    #ifdef __linux__
+        if(path_index)
+            init_path_index(folder_to_serve != NULL ? folder_to_serve : "");
+    #else
+        (void)path_index;
+    #endif
+
+    #if defined(MULTITHREAD_ON) && !defined(EPOLL_ON)
+        write_log(NULL, "Multithreading enabled.");
+        init_work_queue(&connection_queue, queue_size);
+        pool_threads = max_threads;
+        start_thread_pool(max_threads);
+        start_timer_thread();
+        #ifdef IDLE_POLLER_ON
+            start_idle_poller();
+        #endif
+    #endif
+
+    /* =============================================================  */
+    /* ======= Server scket initialization and configuration =======  */
+    /* =============================================================  */
+    write_log(NULL, "Initializing server socket.");
+    // Winsock init
+    #ifdef _WIN32
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+            perror("Error with winsock");
+            exit(EXIT_FAILURE);
+        }
+    #endif
+
+    // Create server socket
+    if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+        perror("Error to create server socket.");
+        exit(EXIT_FAILURE);
+    }
+
+    #ifdef __linux__
+        // Restarts (and benchmark runs) must not wait for the TIME_WAIT sockets of the last run
+        int reuse_address = 1;
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse_address, sizeof(reuse_address));
+
+        // Every worker has its own listener, the kernel balances the connections
+        int reuse_port = 1;
+        if (worker_index >= 0 && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse_port, sizeof(reuse_port)) < 0) {
+            perror("Error setting SO_REUSEPORT.");
+            exit(EXIT_FAILURE);
+        }
+    #endif
+
+    // Set up the socket
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr(server_ip);
+    address.sin_port = htons(port);
+
+    // Bind addr and port
+    if (bind(server_socket, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        write_log(NULL, "[x] Error binding the socket to address and port %s:%d.", server_ip, port);
+        socket_error_msg();
+        exit(EXIT_FAILURE);
+    }
+
+    // Start to listen incoming connections
+    if (listen(server_socket, backlog) < 0) {
+        perror("Error to listen connections.");
+        exit(EXIT_FAILURE);
+    }
+    if(!no_logs){
+        set_shell_text_color("32");
+        printf("####  Welcome to tinyC! #### (%s)\n", __TIMESTAMP__);
+        printf("#### Running at %s:%d\n", server_ip, port);
+        set_shell_text_color("0");
+    }
+
+    write_log(NULL, "==> Tinyc server started");
+    write_log(NULL, "> Running server at: %s:%d", server_ip, port);
+    set_shell_text_color("0");
+
+    connection_params server_conf = {0};
+    server_conf.default_route = default_route;
+    server_conf.folder_to_serve = folder_to_serve;
+    server_conf.show_explorer = show_explorer;
+
+    #ifdef EPOLL_ON
+        #ifdef IO_URING_ON
+            if(use_io_uring && uring_setup(server_socket)){
+                write_log(NULL, "io_uring event loop enabled.");
+                run_uring_loop(&server_conf);
+            }else if(use_io_uring){
+                write_log(NULL, "Falling back to epoll.");
+            }
+        #endif
+        // All connections are served by a single non-blocking event loop
+        write_log(NULL, "Epoll event loop enabled.");
+        run_event_loop(server_socket, &server_conf);
+    #else
+    /* =====================================  */
+    /* ======= Accept connections loop =====  */
+    /* =====================================  */
+    SocketType client_socket;
+    int32_t addrlen = sizeof(address);
+    #ifndef __linux__
+        char client_ip[8] = ":";
+    #else
+        char client_ip[INET_ADDRSTRLEN] = ":";
+    #endif
+
+    // Blocking sockets: the kernel bounds a stalled send, and a blocking read
+    // waits at most the idle deadline (the timer wheel is faster, this is a backstop)
+    #ifdef __linux__
+        struct timeval receive_timeout = { .tv_sec = deadline_seconds[DEADLINE_IDLE], .tv_usec = 0};
+        struct timeval send_timeout = { .tv_sec = deadline_seconds[DEADLINE_SEND], .tv_usec = 0};
+    #else
+        int receive_timeout = 1000*deadline_seconds[DEADLINE_IDLE]; // ms to sec for win
+        int send_timeout = 1000*deadline_seconds[DEADLINE_SEND];
+    #endif
+
+    // At this point, the server is running and waiting for upcoming connections
+    for(;;) {
+        // Accept client new connection
+        #ifdef __linux__
+            if ((client_socket = accept(server_socket, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
+        #else
+            if ((client_socket = accept(server_socket, (struct sockaddr *)&address, &addrlen)) == INVALID_SOCKET) {
+        #endif
+            write_log("error", "Error accepting the connection");
+            continue;
+        }
+        #ifdef __linux__
+            publish_worker_stats();
+        #endif
+
+        // Get client ip address
+        #ifdef __linux__
+            inet_ntop(AF_INET, &(address.sin_addr), client_ip, INET_ADDRSTRLEN);
+        #else
+            strcpy(client_ip, inet_ntoa(address.sin_addr));
+        #endif
+
+        // Over a limit: the prerendered 503, and the socket is closed at once
+        int32_t admission_slot;
+        int reason = admit_connection(address.sin_addr.s_addr, &admission_slot);
+        if (reason != ADMITTED) {
+            reject_connection(client_socket, reason);
+            close_socket(client_socket);
+            continue;
+        }
+
+        // Set timeout in send and receive data from client_socket
+        if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&receive_timeout, sizeof(receive_timeout)) == -1 ||
+            setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, (const char *)&send_timeout, sizeof(send_timeout)) == -1) {
+            perror("Error to setup socket timeout.");
+            close(client_socket);
+            exit(EXIT_FAILURE);
+        }
+
+        // Prepare to handle the incoming connection
+        write_log("info", "[%d] Incoming connection from %s", client_socket, client_ip);
+
+        connection_params *client_conn = new_connection(client_socket, &server_conf, admission_slot);
+
+        #ifdef MULTITHREAD_ON
+            // handle the new connection in the thread pool, shed it when the queue is full
+            if (!enqueue_connection(client_conn)) {
+                reject_connection(client_socket, REJECT_QUEUE);
+                close_connection(client_conn);
+            }
+        #else
+            // handle the connection in a single thread
+            handle_connection(client_conn);
+        #endif
+    }   
+    #endif
+
+    // Close server socket and release memory
+    close_socket(server_socket);
+    #ifdef _WIN32
+        WSACleanup();
+    #endif
+
+    atexit(close_log_file);
+    return 0;
+}
+
+char *get_arg_value(int argc, char **argv, char *target_arg){
+    for(int arg_idx = 0; arg_idx < argc; arg_idx++){
+        if(!strcmp(argv[arg_idx], target_arg)) // <arg> <value> 
+            return argv[arg_idx+1]==NULL?"":argv[arg_idx+1];
+    }
+    return NULL;
+}
+
+void set_shell_text_color(const char* color) {
+    printf("\033[%sm", color);
+}
+
+void init_log_file() {
+    log_file = fopen(LOG_FILE_NAME, "a");
+    if (!log_file) {
+        perror("Can't create log file.");
+        exit(1);
+    }
+}
+
+void close_log_file() {
+    if (log_file) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+}
+
+void write_log(const char* type, const char* msg, ...) {
+    if(!no_logs){
+        log_record record;
+        va_list args;
+
+        record.time = time(NULL);
+        record.type = LOG_PLAIN;
+        if (type != NULL) {
+            if(!strcmp(type, "error"))
+                record.type = LOG_ERROR;
+            else if(!strcmp(type, "info"))
+                record.type = LOG_INFO;
+            else if(!strcmp(type, "debug"))
+                record.type = LOG_DEBUG;
+        }
+        va_start(args, msg);
+        vsnprintf(record.message, LOG_MESSAGE_SIZE, msg, args);
+        va_end(args);
+
+        #ifdef MULTITHREAD_ON
+            // Request threads only fill their ring, the log writer does the I/O
+            if(log_writer_running){
+                push_log_record(&record);
+                return;
+            }
+        #endif
+        output_log_record(&record);
+    }
+}
+
+void output_log_record(log_record *record) {
+    char full_date[LOG_DATE_SIZE];
+    struct tm date;
+
+    if(log_file==NULL)
+        init_log_file();
+    get_current_datetime(full_date);
+    if (record->time != time(NULL)) {
+        // record from a previous second
+        #ifdef __linux__
+            localtime_r(&record->time, &date);
+        #else 
+            localtime_s(&date, &record->time);
+        #endif
+        strftime(full_date, sizeof(full_date), "%Y-%m-%d %H:%M:%S", &date);
+    }
+
+    switch(record->type){
+        case LOG_ERROR:
+            fprintf(log_file, "[ERROR][%s] %s\n", full_date, record->message);
+            break;
+        case LOG_INFO:
+            fprintf(log_file, "[INFO][%s] %s\n", full_date, record->message);
+            break;
+        case LOG_DEBUG:
+            printf("[DEBUG][%s]%s\n", full_date, record->message);
+            fprintf(log_file, "[DEBUG][%s]%s\n", full_date, record->message);
+            break;
+        default:
+            fprintf(log_file, "[%s] %s\n", full_date, record->message);
+    }
+}
+
+void sleep_ms(int32_t milliseconds) {
+    #ifdef __linux__
+        struct timespec delay = { milliseconds / 1000, (milliseconds % 1000) * 1000000L };
+        nanosleep(&delay, NULL);
+    #else
+        Sleep(milliseconds);
+    #endif
+}
+
+#ifdef MULTITHREAD_ON
+    void push_log_record(log_record *record) {
+        log_ring *ring = thread_log_ring;
+        if (ring == NULL) {
+            // First record of this thread: register its ring
+            ring = safe_malloc(sizeof(log_ring));
+            ring->head = ring->tail = 0;
+            pthread_mutex_lock(&log_rings_lock);
+            ring->next = log_rings;
+            log_rings = ring;
+            pthread_mutex_unlock(&log_rings_lock);
+            thread_log_ring = ring;
+        }
+
+        size_t head = ring->head;
+        while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+            if (!log_block_when_full) {
+                __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            sleep_ms(1); // wait for the log writer
+        }
+        ring->records[head & (LOG_RING_SIZE - 1)] = *record;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    /* Detached thread with a THREAD_STACK_SIZE stack, returns the pthread_create error */
+    int create_thread(void *(*routine)(void *)) {
+        pthread_t thread;
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+        pthread_attr_setstacksize(&attributes, THREAD_STACK_SIZE);
+        pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+        int error = pthread_create(&thread, &attributes, routine, NULL);
+        pthread_attr_destroy(&attributes);
+        return error;
+    }
+
+    void start_log_writer() {
+        if (log_file == NULL)
+            init_log_file();
+        setvbuf(log_file, NULL, _IOFBF, 1 << 16);
+        int error = create_thread(log_writer_thread);
+        if (error != 0) {
+            write_log("error", "Log writer not started: '%s'", strerror(error));
+            return;
+        }
+        log_writer_running = TRUE;
+    }
+
+    /* Drain every thread ring, write the batch and flush it once */
+    void *log_writer_thread(void *args) {
+        (void)args;
+        log_record dropped_record;
+        uint64_t dropped;
+        for (;;) {
+            size_t written = 0;
+            pthread_mutex_lock(&log_rings_lock);
+            log_ring *ring = log_rings;
+            pthread_mutex_unlock(&log_rings_lock);
+
+            // Rings are never unregistered, so the list can be walked unlocked
+            for (; ring != NULL; ring = ring->next) {
+                size_t tail = ring->tail;
+                size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+                for (; tail != head; tail++, written++)
+                    output_log_record(&ring->records[tail & (LOG_RING_SIZE - 1)]);
+                __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+            }
+
+            if ((dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED)) > 0) {
+                dropped_record.time = time(NULL);
+                dropped_record.type = LOG_ERROR;
+                snprintf(dropped_record.message, LOG_MESSAGE_SIZE, "%llu log records dropped.", (unsigned long long)dropped);
+                output_log_record(&dropped_record);
+                written++;
+            }
+
+            if (written > 0)
+                fflush(log_file);
+            else
+                sleep_ms(LOG_FLUSH_INTERVAL_MS);
+        }
+        return NULL;
+    }
+#endif
+
+/* Queue a complete response. Its status line goes to the header followed by
+   the Date line, the rest is sent from response_content without copying. */
+void send_response(connection_params *conn, const char *response_content, size_t length) {
+    http_response *response = &conn->response;
+    const char *status_end = memchr(response_content, '\n', length);
+    size_t status_length = status_end != NULL ? status_end - response_content - 1 : 0;
+    char date[HTTP_DATE_SIZE];
+
+    if (status_end == NULL || status_length + sizeof("\r\nDate: ") + HTTP_DATE_SIZE > MAX_HEADER_SIZE) {
+        response->body = response_content;
+        response->body_length = length;
+        return;
+    }
+    get_http_date(date);
+    memcpy(response->header, response_content, status_length);
+    response->header_length = status_length;
+    response->header_length += sprintf(response->header + status_length, "\r\nDate: %s", date);
+    response->body = status_end - 1; // "\r\n<fields>..."
+    response->body_length = length - status_length;
+    write_log(NULL, "Sending " SIZE_T_FORMAT " bytes.", response->body_length);
+}
+
+/* 206 answer to a Range request (one range, or a multipart/byteranges body for
+   several), 416 when no range is satisfiable */
+void send_partial_content(connection_params *conn, open_file *file, const MimeType *mime, size_t file_size, byte_range *ranges, int ranges_count) {
+    http_response *response = &conn->response;
+    if (request_not_modified(&conn->request, &file->validators)) {
+        send_304_response(conn, &file->validators);
+        file_cache_release(file);
+        return;
+    }
+    if (ranges_count == 0) {
+        write_log("error", "[!] Error: requested range is out of bounds.");
+        file_cache_release(file);
+        send_416_response(conn, file_size);
+        return;
+    }
+    if (ranges_count > 1) {
+        send_multipart_content(conn, file, mime, file_size, ranges, ranges_count);
+        return;
+    }
+
+    // Send header with range and content length (for video html stream content)
+    size_t start = ranges[0].start, end = ranges[0].end;
+    response->header_length = render_status_line(response->header, "206 Partial Content");
+    response->header_length += snprintf(response->header + response->header_length, MAX_HEADER_SIZE - response->header_length,
+                    "Connection: keep-alive\r\n"
+                    "Keep-Alive: timeout=5\r\n"
+                    "Accept-Ranges: bytes\r\n"
+                    "%s", mime->content_type_field);
+    response->header_length += render_validators(response->header + response->header_length,
+                    MAX_HEADER_SIZE - response->header_length, &file->validators);
+    response->header_length += snprintf(response->header + response->header_length, MAX_HEADER_SIZE - response->header_length,
+                    "Content-Range: bytes " SIZE_T_FORMAT "-" SIZE_T_FORMAT "/" SIZE_T_FORMAT "\r\n"
+                    "Content-Length: " SIZE_T_FORMAT "\r\n\r\n", start, end, file_size, end - start + 1);
+    send_file_content(conn, file, start, end - start + 1); // then send the file fragment
+    write_log("info", "Response 206 queued.");
+}
+
+/* Queue a multipart/byteranges body: every part header (and the closing
+   delimiter) is rendered now, the file fragments are streamed between them
+   by write_response through next_range_part */
+void send_multipart_content(connection_params *conn, open_file *file, const MimeType *mime, size_t file_size, byte_range *ranges, int ranges_count) {
+    http_response *response = &conn->response;
+    char boundary[32];
+    size_t headers_size = (ranges_count + 1) * (MAX_PATH_LENGTH / 2 + 128), used = 0, content_length = 0;
+
+    snprintf(boundary, sizeof(boundary), "tinyc%08x%08x", hash_string(file->validators.etag), (uint32_t)get_time_usec());
+    response->range_headers = safe_malloc(headers_size);
+    for (int i = 0; i < ranges_count; i++) {
+        response->ranges[i] = ranges[i];
+        response->range_header_offsets[i] = used;
+        used += snprintf(response->range_headers + used, headers_size - used,
+                    "%s--%s\r\n"
+                    "%s"
+                    "Content-Range: bytes " SIZE_T_FORMAT "-" SIZE_T_FORMAT "/" SIZE_T_FORMAT "\r\n\r\n",
+                    i == 0 ? "" : "\r\n", boundary, mime->content_type_field, ranges[i].start, ranges[i].end, file_size);
+        content_length += ranges[i].end - ranges[i].start + 1;
+    }
+    response->range_header_offsets[ranges_count] = used;
+    used += snprintf(response->range_headers + used, headers_size - used, "\r\n--%s--\r\n", boundary);
+    response->range_header_offsets[ranges_count + 1] = used;
+    response->ranges_count = ranges_count;
+    content_length += used;
+
+    response->header_length = render_status_line(response->header, "206 Partial Content");
+    response->header_length += snprintf(response->header + response->header_length, MAX_HEADER_SIZE - response->header_length,
+                    "Connection: keep-alive\r\n"
+                    "Keep-Alive: timeout=5\r\n"
+                    "Accept-Ranges: bytes\r\n"
+                    "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary);
+    response->header_length += render_validators(response->header + response->header_length,
+                    MAX_HEADER_SIZE - response->header_length, &file->validators);
+    response->header_length += snprintf(response->header + response->header_length, MAX_HEADER_SIZE - response->header_length,
+                    "Content-Length: " SIZE_T_FORMAT "\r\n\r\n", content_length);
+    response->file = file;
+    next_range_part(response); // first part header and fragment
+    write_log("info", "Response 206 queued (%d ranges).", ranges_count);
+}
+
+/* Queue the next part header and file fragment of a multipart body, returns
+   FALSE once the closing delimiter was queued */
+int next_range_part(http_response *response) {
+    if (response->range_headers == NULL || response->range_index > response->ranges_count)
+        return FALSE;
+    int index = response->range_index++;
+    response->body = response->range_headers + response->range_header_offsets[index];
+    response->body_length = response->range_header_offsets[index + 1] - response->range_header_offsets[index];
+    response->body_sent = 0;
+    if (index < response->ranges_count) {
+        response->file_offset = response->ranges[index].start;
+        response->file_remaining = response->ranges[index].end - response->ranges[index].start + 1;
+        #ifndef __linux__
+            if (response->stream != NULL)
+                fseek(response->stream, response->file_offset, SEEK_SET);
+        #endif
+    }
+    return TRUE;
+}
+
+/* Answer to a HEAD: the header is kept as rendered for the GET, Content-Length
+   included, and nothing after the blank line that ends it is sent. The fields of
+   the static responses run into their body. */
+void omit_response_body(http_response *response) {
+    if (response->shared_header_length > 0 || find_header_end(response->header, response->header_length) > 0)
+        response->body_length = 0;
+    else
+        response->body_length = find_header_end(response->body, response->body_length);
+    if (response->file != NULL) {
+        file_cache_release(response->file);
+        response->file = NULL;
+    }
+    response->file_remaining = 0;
+    if (response->range_headers != NULL) {
+        free(response->range_headers);
+        response->range_headers = NULL; // no more multipart parts
+    }
+}
+
+/* Offset just after the blank line that ends a header, 0 when there is none */
+size_t find_header_end(const char *data, size_t length) {
+    for (size_t i = 3; i < length; i++) {
+        if (data[i] == '\n' && data[i - 1] == '\r' && data[i - 2] == '\n' && data[i - 3] == '\r')
+            return i + 1;
+    }
+    return 0;
+}
+
+/* Parse a "bytes=" Range value against the file size (RFC 7233). Returns the
+   count of satisfiable ranges (0: answer 416) or RANGE_IGNORED when the value
+   is malformed or asks for too many ranges, then the whole file is sent. */
+int parse_range_header(const char *value, size_t file_size, byte_range *ranges) {
+    const char *cursor = value + 6; // after "bytes="
+    unsigned long long first = 0, last = 0;
+    int8_t has_first, has_last;
+    int count = 0;
+    char *number_end;
+
+    for (;;) {
+        while (*cursor == ' ' || *cursor == '\t')
+            cursor++;
+        if ((has_first = *cursor >= '0' && *cursor <= '9')) {
+            first = strtoull(cursor, &number_end, 10);
+            cursor = number_end;
+        }
+        if (*cursor++ != '-')
+            return RANGE_IGNORED;
+        if ((has_last = *cursor >= '0' && *cursor <= '9')) {
+            last = strtoull(cursor, &number_end, 10);
+            cursor = number_end;
+        }
+        if ((!has_first && !has_last) || (has_first && has_last && last < first))
+            return RANGE_IGNORED;
+
+        // Keep the satisfiable ones: suffix "-n" is the last n bytes, "a-" runs to the end
+        if (count == MAX_RANGES)
+            return RANGE_IGNORED;
+        if (!has_first && last > 0 && file_size > 0) {
+            ranges[count].start = last >= file_size ? 0 : file_size - last;
+            ranges[count++].end = file_size - 1;
+        } else if (has_first && first < file_size) {
+            ranges[count].start = first;
+            ranges[count++].end = has_last && last < file_size ? last : file_size - 1;
+        }
+
+        while (*cursor == ' ' || *cursor == '\t')
+            cursor++;
+        if (*cursor == '\0')
+            break;
+        if (*cursor++ != ',')
+            return RANGE_IGNORED;
+    }
+    return coalesce_ranges(ranges, count);
+}
+
+/* Sort the ranges and merge the overlapping or adjacent ones, returns the new count */
+int coalesce_ranges(byte_range *ranges, int count) {
+    byte_range range;
+    int merged = 0;
+    for (int i = 1; i < count; i++) {
+        range = ranges[i];
+        int j = i - 1;
+        for (; j >= 0 && ranges[j].start > range.start; j--)
+            ranges[j + 1] = ranges[j];
+        ranges[j + 1] = range;
+    }
+    for (int i = 1; i < count; i++) {
+        if (ranges[i].start <= ranges[merged].end + 1) {
+            if (ranges[i].end > ranges[merged].end)
+                ranges[merged].end = ranges[i].end;
+        } else {
+            ranges[++merged] = ranges[i];
+        }
+    }
+    return count > 0 ? merged + 1 : 0;
+}
+
+/* Render "HTTP/1.1 <status>" and the Date line, returns its length */
+size_t render_status_line(char *header, const char *status) {
+    char date[HTTP_DATE_SIZE];
+    get_http_date(date);
+    return sprintf(header, "HTTP/1.1 %s\r\nDate: %s\r\n", status, date);
+}
+
+/* Render the 200 header fields after the status line, returns their length. The fixed
+   fields and the prerendered Content-Type of the mime are copied as they are. encoding:
+   NULL for content that never varies, "identity" for compressible content sent as is
+   (only adds Vary) or the Content-Encoding. */
+size_t render_content_header(char *header, const MimeType *mime, size_t content_length, const char *encoding, const content_validators *validators) {
+    char *cursor = header;
+    memcpy(cursor, CONTENT_HEADER_FIELDS, sizeof(CONTENT_HEADER_FIELDS) - 1);
+    cursor += sizeof(CONTENT_HEADER_FIELDS) - 1;
+    memcpy(cursor, mime->content_type_field, mime->content_type_field_length);
+    cursor += mime->content_type_field_length;
+    if (encoding != NULL && strcmp(encoding, "identity") != 0)
+        cursor += sprintf(cursor, "Content-Encoding: %s\r\n", encoding);
+    if (encoding != NULL) {
+        memcpy(cursor, "Vary: Accept-Encoding\r\n", 23);
+        cursor += 23;
+    }
+    cursor += render_validators(cursor, MAX_HEADER_SIZE / 2, validators);
+    cursor += sprintf(cursor, "Content-Length: " SIZE_T_FORMAT "\r\n\r\n", content_length);
+    return cursor - header;
+}
+
+/* Render the ETag, Last-Modified and Cache-Control fields, returns their length */
+size_t render_validators(char *header, size_t size, const content_validators *validators) {
+    if (validators == NULL)
+        return 0;
+    int length = snprintf(header, size, "ETag: %s\r\n"
+                    "Last-Modified: %s\r\n"
+                    "Cache-Control: %s\r\n", validators->etag, validators->last_modified, validators->cache_control);
+    return length < 0 ? 0 : ((size_t)length < size ? (size_t)length : size - 1);
+}
+
+void send_content(connection_params *conn, open_file *file, const MimeType *mime, size_t content_length, const char *encoding, const content_validators *validators) {
+    http_response *response = &conn->response;
+    if (request_not_modified(&conn->request, validators)) {
+        send_304_response(conn, validators);
+        file_cache_release(file);
+        return;
+    }
+    response->header_length = render_status_line(response->header, "200 OK");
+    response->header_length += render_content_header(response->header + response->header_length, mime, content_length, encoding, validators);
+    send_file_content(conn, file, 0, content_length); // then the file content
+    write_log("info", "Response 200 queued.");
+}
+
+/* Serve a cache entry: prebuilt header and file bytes, no filesystem access */
+void send_cached_content(connection_params *conn, cache_entry *entry) {
+    http_response *response = &conn->response;
+    if (request_not_modified(&conn->request, &entry->validators)) {
+        send_304_response(conn, &entry->validators);
+        content_cache_release(entry);
+        return;
+    }
+    response->cached = entry;
+    response->header_length = render_status_line(response->header, "200 OK");
+    response->shared_header = entry->header;
+    response->shared_header_length = entry->header_length;
+    response->body = entry->data;
+    response->body_length = entry->size;
+    write_log("info", "Response 200 queued from cache.");
+}
+
+/* Bodiless answer to a conditional request whose representation is unchanged */
+void send_304_response(connection_params *conn, const content_validators *validators) {
+    http_response *response = &conn->response;
+    response->header_length = render_status_line(response->header, "304 Not Modified");
+    response->header_length += render_validators(response->header + response->header_length,
+                    MAX_HEADER_SIZE - response->header_length, validators);
+    response->header_length += snprintf(response->header + response->header_length, MAX_HEADER_SIZE - response->header_length,
+                    "%s"
+                    "Connection: keep-alive\r\n"
+                    "Keep-Alive: timeout=5\r\n\r\n", validators->varies ? "Vary: Accept-Encoding\r\n" : "");
+    write_log("info", "Response 304 queued.");
+}
+
+void send_416_response(connection_params *conn, size_t file_size) {
+    http_response *response = &conn->response;
+    response->header_length = render_status_line(response->header, "416 Range Not Satisfiable");
+    response->header_length += snprintf(response->header + response->header_length, MAX_HEADER_SIZE - response->header_length,
+                    "Content-Range: bytes */" SIZE_T_FORMAT "\r\n"
+                    "Content-Length: 0\r\n"
+                    "Connection: keep-alive\r\n"
+                    "Keep-Alive: timeout=5\r\n\r\n", file_size);
+    write_log("info", "Response 416 queued.");
+}
+
+void send_302_response(connection_params *conn, char *uri) {
+    http_response *response = &conn->response;
+    response->header_length = render_status_line(response->header, "302 Found");
+    response->header_length += snprintf(response->header + response->header_length,
+                                        MAX_HEADER_SIZE - response->header_length, HTTP_302_REDIRECTION, uri);
+    if(response->header_length >= MAX_HEADER_SIZE)
+        response->header_length = MAX_HEADER_SIZE - 1;
+    response->close_connection = TRUE;
+    write_log("info", "302 redirection to %s", uri);
+}
+
+void send_404_response(connection_params *conn) {
+    send_response(conn, HTTP_404_NOT_FOUND, sizeof(HTTP_404_NOT_FOUND) - 1);
+    write_log("info", "404 not found.");
+}
+
+void send_200_response(connection_params *conn) {
+    send_response(conn, HTTP_200_OK, sizeof(HTTP_200_OK) - 1);
+    conn->response.close_connection = TRUE;
+    write_log("info", "OK");
+}
+
+
+void send_400_response(connection_params *conn){
+    send_response(conn, HTTP_400_BAD_REQUEST, sizeof(HTTP_400_BAD_REQUEST) - 1);
+    conn->response.close_connection = TRUE;
+    write_log("info", "400 bad request.");
+}
+
+void send_414_response(connection_params *conn){
+    send_response(conn, HTTP_414_URL_TOO_LONG, sizeof(HTTP_414_URL_TOO_LONG) - 1);
+    conn->response.close_connection = TRUE;
+    write_log("info", "414 URL too long.");
+}
+
+void send_500_response(connection_params *conn) {
+    send_response(conn, HTTP_500_INTERNAL_ERROR, sizeof(HTTP_500_INTERNAL_ERROR) - 1);
+    conn->response.close_connection = TRUE;
+    write_log("error", "500 server side error.");
+}
+
+/* Unsent memory parts of the response (header, shared header, body), returns their count */
+int collect_response_parts(http_response *response, response_part *parts) {
+    int parts_count = 0;
+    #define ADD_PART(part, part_length, part_sent) \
+        if (part_sent < part_length) { \
+            parts[parts_count].data = part + part_sent; \
+            parts[parts_count].length = part_length - part_sent; \
+            parts[parts_count++].sent = &part_sent; \
+        }
+    ADD_PART(response->header, response->header_length, response->header_sent);
+    ADD_PART(response->shared_header, response->shared_header_length, response->shared_header_sent);
+    ADD_PART(response->body, response->body_length, response->body_sent);
+    #undef ADD_PART
+    return parts_count;
+}
+
+/* Spread sent bytes over the parts, in order */
+void advance_response_parts(response_part *parts, int parts_count, size_t sent) {
+    for (int i = 0; i < parts_count && sent > 0; i++) {
+        size_t part_sent = sent < parts[i].length ? sent : parts[i].length;
+        *parts[i].sent += part_sent;
+        sent -= part_sent;
+    }
+}
+
+/* Writes as much of the pending response as the socket accepts. Returns RESPONSE_PENDING
+   when a non-blocking socket is full, so the caller can resume it once writable again. */
+int write_response(connection_params *conn) {
+    http_response *response = &conn->response;
+    thread_metrics *metrics = get_thread_metrics();
+    ssize_t sent;
+
+    conn->state = CONN_SENDING_HEADER;
+    // Cork while a file follows the header, so the header never travels in its own segment
+    if (response->file != NULL && !response->corked) {
+        set_socket_cork(conn->socket, TRUE);
+        response->corked = TRUE;
+    }
+
+    // Memory parts: header, shared header and body, then the file fragment.
+    // A multipart body repeats both for every range.
+    do {
+        for (;;) {
+            response_part parts[3];
+            int parts_count = collect_response_parts(response, parts);
+            if (parts_count == 0)
+                break;
+            if (response->header_sent == response->header_length && response->shared_header_sent == response->shared_header_length)
+                conn->state = CONN_SENDING_BODY;
+
+        #ifdef __linux__
+            // Gather every part in a single syscall (sendmsg keeps MSG_NOSIGNAL)
+            struct iovec vectors[3];
+            for (int i = 0; i < parts_count; i++) {
+                vectors[i].iov_base = (char*)parts[i].data;
+                vectors[i].iov_len = parts[i].length;
+            }
+            struct msghdr message = { .msg_iov = vectors, .msg_iovlen = parts_count };
+            sent = sendmsg(conn->socket, &message, SEND_D_FLAG);
+        #else
+            parts_count = 1;
+            sent = send(conn->socket, parts[0].data, parts[0].length, SEND_D_FLAG);
+        #endif
+            if (sent < 0) {
+                if (errno == EINTR)
+                    continue;
+                return socket_would_block() ? RESPONSE_PENDING : RESPONSE_ERROR;
+            }
+            advance_response_parts(parts, parts_count, sent);
+            metric_add(metrics->bytes_sent, sent);
+            send_progressed(conn);
+        }
+
+        conn->state = CONN_SENDING_BODY;
+        if (response->file != NULL) {
+        #ifdef __linux__
+            // Zero-copy: the kernel moves the file pages straight into the socket
+            off_t offset = response->file_offset;
+            int file_fd = response->file->fd;
+            size_t length;
+            while (response->file_remaining > 0) {
+                length = response->file_remaining;
+                #ifndef EPOLL_ON
+                    // A blocking sendfile ignores SO_SNDTIMEO while it progresses, chunks let the send deadline see it
+                    if (length > SEND_CHUNK_SIZE)
+                        length = SEND_CHUNK_SIZE;
+                #endif
+                if ((length = shaping_take(conn, length)) == 0)
+                    return throttle_response(conn);
+                prefetch_response(response);
+                sent = sendfile(conn->socket, file_fd, &offset, length);
+                if (sent < (ssize_t)length)
+                    shaping_return(conn, length - (sent > 0 ? sent : 0));
+                if (sent == 0)
+                    break; // file is shorter than announced
+                if (sent < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return socket_would_block() ? RESPONSE_PENDING : RESPONSE_ERROR;
+                }
+                response->file_offset += sent;
+                response->file_remaining -= sent;
+                metric_add(metrics->bytes_sent, sent);
+                send_progressed(conn);
+            }
+        #else
+            char *buffer;
+            size_t bytes_read, to_read;
+            if (response->stream == NULL) {
+                if ((response->stream = fopen(response->file->path, "rb")) == NULL)
+                    return RESPONSE_ERROR;
+                fseek(response->stream, response->file_offset, SEEK_SET);
+            }
+            buffer = buffer_pool_get(&io_buffers); // not on the small thread stacks
+            sent = 0;
+            while (response->file_remaining > 0) {
+                to_read = response->file_remaining < BUFFER_SIZE ? response->file_remaining : BUFFER_SIZE;
+                if ((to_read = shaping_take(conn, to_read)) == 0) {
+                    buffer_pool_put(&io_buffers, buffer);
+                    return throttle_response(conn);
+                }
+                if ((bytes_read = fread(buffer, 1, to_read, response->stream)) == 0)
+                    break; // file is shorter than announced
+                sent = send(conn->socket, buffer, bytes_read, SEND_D_FLAG);
+                if (sent < (ssize_t)to_read)
+                    shaping_return(conn, to_read - (sent > 0 ? sent : 0));
+                if (sent > 0) {
+                    response->file_offset += sent;
+                    response->file_remaining -= sent;
+                    metric_add(metrics->bytes_sent, sent);
+                    send_progressed(conn);
+                }
+                // Rewind the unsent part so it is read again on the next attempt
+                if (sent < (ssize_t)bytes_read)
+                    fseek(response->stream, response->file_offset, SEEK_SET);
+                if (sent < 0)
+                    break;
+            }
+            buffer_pool_put(&io_buffers, buffer);
+            if (sent < 0)
+                return socket_would_block() ? RESPONSE_PENDING : RESPONSE_ERROR;
+        #endif
+        }
+    } while (next_range_part(response));
+    if (response->corked) {
+        set_socket_cork(conn->socket, FALSE); // flush the last segment
+        response->corked = FALSE;
+    }
+    return RESPONSE_DONE;
+}
+
+/* Out of bandwidth tokens: flush what is corked, the rest waits for the next tick */
+int throttle_response(connection_params *conn) {
+    if (conn->response.corked) {
+        set_socket_cork(conn->socket, FALSE);
+        conn->response.corked = FALSE;
+    }
+    metric_add(get_thread_metrics()->throttled, 1);
+    return RESPONSE_THROTTLED;
+}
+
+void release_response(http_response *response) {
+    if (response->owned_body != NULL)
+        free(response->owned_body);
+    if (response->range_headers != NULL)
+        free(response->range_headers);
+    if (response->file != NULL)
+        file_cache_release(response->file);
+    #ifndef __linux__
+        if (response->stream != NULL)
+            fclose(response->stream);
+    #endif
+    if (response->cached != NULL)
+        content_cache_release(response->cached);
+    if (response->mapped != NULL)
+        file_cache_release(response->mapped);
+    memset(response, 0, sizeof(http_response));
+}
+
+int starts_with(const char *str, const char *word) {
+    size_t word_len = strlen(word);
+    return strncmp(str, word, word_len) == 0?TRUE:FALSE;
+}
+
+#ifdef __linux__
+    size_t get_file_length(const char* filename){
+        FILE *file = fopen(filename, "rb");
+        if (file == NULL) {
+            write_log("error", "Error to open the file for get file size : %s", filename);
+            return 0;
+        }
+        fseek(file, 0, SEEK_END);
+        size_t fileLength = ftell(file);
+        fclose(file);
+        return fileLength;
+    }
+#else
+    uint64_t get_file_length(const char* filename) {
+        HANDLE hFile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            write_log("error", "Error to open the file for get file size : %s", filename);
+            return 0;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(hFile, &fileSize)) {
+            CloseHandle(hFile);
+            write_log("error", "Error to get file size : %s", filename);
+            return 0;
+        }
+        CloseHandle(hFile);
+        return (uint64_t)fileSize.QuadPart;
+    }
+#endif
+
+char *cstrdup(char *string){
+   size_t string_len = strlen(string) + 1;
+   char *dup = malloc(string_len);
+   if(dup != NULL){
+        memcpy(dup, string, string_len);
+   } 
+   return dup;
+}
+
+/* Attach a file fragment as response body: its shared mapping for a small
+   file, else streamed from the descriptor by write_response */
+void send_file_content(connection_params *conn, open_file *file, size_t offset, size_t length){
+    http_response *response = &conn->response;
+    if (conn->request.head) {
+        response->file = file; // released by omit_response_body, nothing to map or read ahead
+        return;
+    }
+    const char *map = map_open_file(file);
+    if (map != NULL) {
+        // A memory part: gathered with the header in the same send, no file reads
+        response->body = map + offset;
+        response->body_length = length;
+        response->mapped = file;
+        return;
+    }
+    response->file = file;
+    response->file_offset = offset;
+    response->file_remaining = length;
+    advise_file_read(conn, file, offset, length);
+}
+
+void remove_slash_from_start(char* str) {
+    size_t length = strlen(str);
+    if (length > 0 && str[0] == '/') {
+        memmove(str, str + 1, length);
+        str[length - 1] = '\0';
+    }
+}
+
+const char *get_filename_extension(const char *path) {
+    const char *extension = strrchr(path, '.');
+    return extension!=NULL && extension!=path?extension:"";
+}
+
+MimeType *find_mime_type(const char *path) {
+    return find_mime_extension(get_filename_extension(path));
+}
+
+/* Perfect hash lookup of an extension (".css", any case), NULL if unknown */
+MimeType *find_mime_extension(const char *extension) {
+    char key[MIME_EXTENSION_SIZE];
+    size_t length = strlen(extension);
+    if (length == 0 || length >= sizeof(key) || mime_types_index.size == 0)
+        return NULL;
+    for (size_t i = 0; i <= length; i++)
+        key[i] = extension[i] >= 'A' && extension[i] <= 'Z' ? extension[i] + ('a' - 'A') : extension[i];
+
+    int32_t displacement = mime_types_index.displacements[mime_hash(key, 0) % mime_types_index.size];
+    uint32_t slot = displacement < 0 ? (uint32_t)(-displacement - 1) : mime_hash(key, displacement) % mime_types_index.size;
+    MimeType *mime = mime_types_index.slots[slot];
+    return strcmp(mime->extension, key) == 0 ? mime : NULL;
+}
+
+/* Type of a path, application/octet-stream when its extension is unknown */
+const MimeType *get_filename_mime(const char *path) {
+    MimeType *mime = find_mime_type(path);
+    return mime != NULL ? mime : &default_mime_type;
+}
+
+int8_t get_filename_compressible(const char *path) {
+    return get_filename_mime(path)->compressible;
+}
+
+const char *get_filename_cache_control(const char *path) {
+    const MimeType *mime = get_filename_mime(path);
+    return mime->cache_control != NULL ? mime->cache_control : default_cache_control;
+}
+
+/* FNV-1a of an extension, mixed with the displacement seed */
+uint32_t mime_hash(const char *key, uint32_t seed){
+    uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9u);
+    while (*key)
+        hash = (hash ^ (uint8_t)*key++) * 16777619u;
+    return hash ^ (hash >> 15);
+}
+
+/* Textual types get a charset in their Content-Type */
+int8_t mime_is_text(const char *mime_type) {
+    const char *subtype = strchr(mime_type, '/');
+    size_t length = strlen(mime_type);
+    if (subtype == NULL)
+        return FALSE;
+    return strncmp(mime_type, "text/", 5) == 0 || strcmp(subtype, "/json") == 0 ||
+           strcmp(subtype, "/xml") == 0 || strcmp(subtype, "/javascript") == 0 ||
+           (length > 4 && (strcmp(mime_type + length - 4, "+xml") == 0 || strcmp(mime_type + length - 5, "+json") == 0));
+}
+
+/* Start the types list with the built-in table */
+void init_mime_types() {
+    size_t builtin_count = sizeof(mime_types) / sizeof(mime_types[0]);
+    mime_types_index.capacity = builtin_count * 2;
+    mime_types_index.types = safe_malloc(mime_types_index.capacity * sizeof(MimeType *));
+    for (size_t i = 0; i < builtin_count; i++)
+        mime_types_index.types[mime_types_index.count++] = &mime_types[i];
+}
+
+void render_mime_type_fields(MimeType *mime) {
+    mime->content_type_field_length = snprintf(mime->content_type_field, MIME_FIELD_SIZE, "Content-Type: %s%s\r\n",
+                                               mime->mime_type, mime_is_text(mime->mime_type) ? "; charset=utf-8" : "");
+}
+
+/* Register an extension (with or without its dot), an already known one gets
+   the new type. Returns FALSE if the extension or the type are too long. */
+int add_mime_type(const char *extension, const char *mime_type) {
+    char key[MIME_EXTENSION_SIZE];
+    size_t length = strlen(extension) + (extension[0] != '.');
+    if (length < 2 || length >= sizeof(key) ||
+        strlen(mime_type) + sizeof("Content-Type: ; charset=utf-8\r\n") > MIME_FIELD_SIZE)
+        return FALSE;
+    snprintf(key, sizeof(key), "%s%s", extension[0] != '.' ? "." : "", extension);
+    for (size_t i = 0; key[i]; i++)
+        key[i] = key[i] >= 'A' && key[i] <= 'Z' ? key[i] + ('a' - 'A') : key[i];
+
+    if (mime_types_index.capacity == 0)
+        init_mime_types();
+    for (size_t i = 0; i < mime_types_index.count; i++) {
+        if (strcmp(mime_types_index.types[i]->extension, key) == 0) {
+            mime_types_index.types[i]->mime_type = cstrdup((char *)mime_type);
+            return TRUE;
+        }
+    }
+    if (mime_types_index.count == mime_types_index.capacity) {
+        mime_types_index.capacity *= 2;
+        MimeType **types = realloc(mime_types_index.types, mime_types_index.capacity * sizeof(MimeType *));
+        if (types == NULL)
+            return FALSE;
+        mime_types_index.types = types;
+    }
+    MimeType *mime = safe_malloc(sizeof(MimeType));
+    memset(mime, 0, sizeof(MimeType));
+    mime->extension = cstrdup(key);
+    mime->mime_type = cstrdup((char *)mime_type);
+    mime->compressible = mime_is_text(mime_type);
+    mime_types_index.types[mime_types_index.count++] = mime;
+    return TRUE;
+}
+
+/* Load a --mime-file: "type ext1 ext2..." lines, the /etc/mime.types format.
+   Returns the number of extensions registered, -1 if the file can't be read. */
+int load_mime_file(const char *file_path) {
+    char line[1024];
+    int loaded = 0;
+    FILE *file = fopen(file_path, "r");
+    if (file == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *mime_type = strtok(line, " \t\r\n;"), *extension;
+        if (mime_type == NULL || mime_type[0] == '#')
+            continue;
+        while ((extension = strtok(NULL, " \t\r\n;")) != NULL && extension[0] != '#') {
+            if (add_mime_type(extension, mime_type))
+                loaded++;
+            else
+                write_log("error", "[!] Ignoring the '%s' extension of '%s' in the mime file.", extension, mime_type);
+        }
+    }
+    fclose(file);
+    return loaded;
+}
+
+/* Render the header fields of every type and build the perfect hash: the
+   types are bucketed by a first hash, the biggest buckets are placed first
+   by searching a seed that sends all their types to free slots, then the
+   lone types take the slots left. */
+void build_mime_index() {
+    mime_index *index = &mime_types_index;
+    if (index->capacity == 0)
+        init_mime_types();
+    render_mime_type_fields(&default_mime_type);
+    for (size_t i = 0; i < index->count; i++)
+        render_mime_type_fields(index->types[i]);
+
+    uint32_t count = (uint32_t)index->count;
+    uint32_t *buckets = safe_malloc(count * sizeof(uint32_t));
+    uint32_t *bucket_sizes = safe_malloc(count * 2 * sizeof(uint32_t));
+    uint32_t *bucket_slots = safe_malloc(MIME_EXTENSION_SIZE * sizeof(uint32_t));
+    for (uint32_t size = count; ; size += size / 4 + 1) {
+        uint32_t largest = 0, next_free = 0;
+        int8_t placed = TRUE;
+
+        free(index->slots);
+        free(index->displacements);
+        index->slots = calloc(size, sizeof(MimeType *));
+        index->displacements = calloc(size, sizeof(int32_t));
+        bucket_sizes = realloc(bucket_sizes, size * sizeof(uint32_t));
+        if (index->slots == NULL || index->displacements == NULL || bucket_sizes == NULL) {
+            write_log("error", "[!] No memory for the mime types index.");
+            exit(EXIT_FAILURE);
+        }
+        memset(bucket_sizes, 0, size * sizeof(uint32_t));
+        for (uint32_t i = 0; i < count; i++) {
+            buckets[i] = mime_hash(index->types[i]->extension, 0) % size;
+            if (++bucket_sizes[buckets[i]] > largest)
+                largest = bucket_sizes[buckets[i]];
+        }
+        if (largest > MIME_EXTENSION_SIZE) // far too unlucky, try another size
+            continue;
+
+        for (uint32_t bucket_size = largest; bucket_size > 1 && placed; bucket_size--) {
+            for (uint32_t bucket = 0; bucket < size && placed; bucket++) {
+                if (bucket_sizes[bucket] != bucket_size)
+                    continue;
+                placed = FALSE;
+                for (uint32_t seed = 1; seed < MIME_INDEX_MAX_SEED && !placed; seed++) {
+                    uint32_t found = 0;
+                    for (uint32_t i = 0; i < count; i++) {
+                        if (buckets[i] != bucket)
+                            continue;
+                        uint32_t slot = mime_hash(index->types[i]->extension, seed) % size;
+                        int8_t taken = index->slots[slot] != NULL;
+                        for (uint32_t j = 0; j < found && !taken; j++)
+                            taken = bucket_slots[j] == slot;
+                        if (taken)
+                            break;
+                        bucket_slots[found++] = slot;
+                    }
+                    if (found < bucket_size)
+                        continue;
+                    found = 0;
+                    for (uint32_t i = 0; i < count; i++)
+                        if (buckets[i] == bucket)
+                            index->slots[bucket_slots[found++]] = index->types[i];
+                    index->displacements[bucket] = (int32_t)seed;
+                    placed = TRUE;
+                }
+            }
+        }
+        if (!placed)
+            continue;
+
+        for (uint32_t i = 0; i < count; i++) {
+            if (bucket_sizes[buckets[i]] != 1)
+                continue;
+            while (index->slots[next_free] != NULL)
+                next_free++;
+            index->slots[next_free] = index->types[i];
+            index->displacements[buckets[i]] = -(int32_t)next_free - 1;
+        }
+        // Empty buckets point to any type, the strcmp rejects the extension
+        for (uint32_t i = 0; i < size; i++)
+            if (index->slots[i] == NULL)
+                index->slots[i] = &default_mime_type;
+        index->size = size;
+        break;
+    }
+    free(buckets);
+    free(bucket_sizes);
+    free(bucket_slots);
+    write_log(NULL, "Mime types: " SIZE_T_FORMAT " extensions indexed in %u slots.", index->count, index->size);
+}
+
+/* Apply a --cache-control value: ".css=max-age=600;.html=no-cache;*=no-store".
+   The rules are split in place and kept as the policies. Returns FALSE if an
+   extension is unknown. */
+int set_cache_control_policy(char *rules) {
+    int result = TRUE;
+    char *rule = rules, *next, *value;
+    while (rule != NULL && *rule) {
+        if ((next = strchr(rule, ';')) != NULL)
+            *next++ = '\0';
+        if ((value = strchr(rule, '=')) != NULL) {
+            *value++ = '\0';
+            MimeType *mime = NULL;
+            if (strcmp(rule, "*") == 0)
+                default_cache_control = value;
+            else if ((mime = find_mime_extension(rule)) != NULL)
+                mime->cache_control = value;
+            else {
+                write_log("error", "[!] Unknown extension '%s' in --cache-control.", rule);
+                result = FALSE;
+            }
+        }
+        rule = next;
+    }
+    return result;
+}
+
+/* RFC 7231 date of a timestamp, output must hold HTTP_DATE_SIZE bytes */
+void format_http_date(time_t time, char *output) {
+    struct tm utc_date;
+    #ifdef __linux__
+        gmtime_r(&time, &utc_date);
+    #else
+        gmtime_s(&utc_date, &time);
+    #endif
+    strftime(output, HTTP_DATE_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &utc_date);
+}
+
+/* Parse an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"), returns -1 if malformed */
+time_t parse_http_date(const char *date) {
+    const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char month_name[4];
+    int day, year, hour, minute, second;
+    if (date == NULL || sscanf(date, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT",
+                               &day, month_name, &year, &hour, &minute, &second) != 6)
+        return -1;
+    const char *month_at = strstr(months, month_name);
+    if (month_at == NULL || (month_at - months) % 3 != 0)
+        return -1;
+
+    // days since the epoch of the civil date (no timegm on every platform)
+    int month = (int)(month_at - months) / 3 + 1;
+    int64_t y = month <= 2 ? year - 1 : year;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t year_of_era = y - era * 400;
+    int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    int64_t days = era * 146097 + day_of_era - 719468;
+    return (time_t)(days * 86400 + hour * 3600 + minute * 60 + second);
+}
+
+/* Render the date strings of the current second into the inactive slot and
+   publish it. Only one thread renders, the others keep reading the old slot. */
+void refresh_clock() {
+    time_t now = time(NULL);
+    int32_t index = __atomic_load_n(&clock_index, __ATOMIC_ACQUIRE);
+    struct tm local_date, utc_date;
+
+    if (clock_slots[index].second == now || __atomic_exchange_n(&clock_updating, TRUE, __ATOMIC_ACQUIRE))
+        return;
+
+    clock_slot *slot = &clock_slots[index ^ 1];
+    __atomic_add_fetch(&slot->sequence, 1, __ATOMIC_RELEASE);
+    #ifdef __linux__
+        localtime_r(&now, &local_date);
+        gmtime_r(&now, &utc_date);
+    #else
+        localtime_s(&local_date, &now);
+        gmtime_s(&utc_date, &now);
+    #endif
+    strftime(slot->log_date, LOG_DATE_SIZE, "%Y-%m-%d %H:%M:%S", &local_date);
+    strftime(slot->http_date, HTTP_DATE_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &utc_date);
+    slot->second = now;
+    __atomic_add_fetch(&slot->sequence, 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&clock_index, index ^ 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&clock_updating, FALSE, __ATOMIC_RELEASE);
+}
+
+/* Copy a string of the current clock slot, retrying if it was rewritten meanwhile */
+void read_clock(char *output, size_t offset, size_t size) {
+    clock_slot *slot;
+    uint32_t sequence;
+    refresh_clock();
+    do {
+        slot = &clock_slots[__atomic_load_n(&clock_index, __ATOMIC_ACQUIRE)];
+        sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        memcpy(output, (char*)slot + offset, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((sequence & 1) || sequence != __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED));
+}
+
+/* Local date for the logs, output must hold LOG_DATE_SIZE bytes */
+void get_current_datetime(char *output) {
+    read_clock(output, offsetof(clock_slot, log_date), LOG_DATE_SIZE);
+}
+
+/* RFC 7231 date, output must hold HTTP_DATE_SIZE bytes */
+void get_http_date(char *output) {
+    read_clock(output, offsetof(clock_slot, http_date), HTTP_DATE_SIZE);
+}
+
+void close_socket(SocketType socket) {
+    #ifdef __linux__
+        close(socket);
+    #else 
+        closesocket(socket);
+    #endif
+    write_log("info", "[%d] Socket closed.", socket);
+}
+
+
+int equals_ignore_case(const char *str, const char *other) {
+    while (*str && tolower((unsigned char)*str) == tolower((unsigned char)*other)) {
+        str++;
+        other++;
+    }
+    return *str == *other;
+}
+
+void decode_url(char* url) {
+    char *url_p = url;
+    int decoded_char;
+    while (*url_p) {
+        if (*url_p == '%' && isxdigit(*(url_p + 1)) && isxdigit(*(url_p + 2))) {
+            char hex[3] = {url_p[1], url_p[2], '\0'};
+            sscanf(hex, "%x", &decoded_char);
+            memmove(url_p + 1, url_p + 3, strlen(url_p + 2) + 1); 
+            *url_p = decoded_char;
+        }
+        url_p++;
+    }
+}
+
+void *safe_malloc(size_t size) {
+    void* ptr = malloc(size);
+    if (ptr == NULL) {
+        write_log("error", "Error allocating memory.");
+        exit(-1);
+    }
+    return ptr;
+}
+
+/* Render the explorer page of a directory. Entry types come from d_type, a
+   stat is only needed when the filesystem doesn't report it (or for links).
+   Returns FALSE if the directory can't be read. */
+int render_dir_listing(const char *dir_path, const char *title, string_builder *html) {
+    string_builder entries = {0};
+    char escaped[EXPLORER_MAX_FILENAME_LENGTH * 6 + 2];
+    char entry_name[EXPLORER_MAX_FILENAME_LENGTH + 2];
+    const char *name;
+    size_t file_amount = 0;
+    int8_t is_dir;
+
+  #ifdef __linux__
+    char entry_path[MAX_PATH_LENGTH + EXPLORER_MAX_FILENAME_LENGTH + 2];
+    struct stat file_stat;
+    struct dirent *entry;
+    DIR *dir = opendir(dir_path);
+    if(dir == NULL){
+        write_log("error", "linux: not possible get directory content %s", dir_path);
+        return FALSE;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        name = entry->d_name;
+        is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            snprintf(entry_path, sizeof(entry_path), "%s/%s", dir_path, name);
+            is_dir = stat(entry_path, &file_stat) == 0 && S_ISDIR(file_stat.st_mode);
+        }
+  #else
+    char pattern[MAX_PATH_LENGTH + 3];
+    WIN32_FIND_DATA find_data;
+    snprintf(pattern, sizeof(pattern), "%s/*", dir_path);
+    HANDLE h_find = FindFirstFile(pattern, &find_data);
+    if (h_find == INVALID_HANDLE_VALUE){
+        write_log("error", "windows: not possible get directory content %s", dir_path);
+        return FALSE;
+    }
+    while (FindNextFile(h_find, &find_data)) {
+        name = find_data.cFileName;
+        is_dir = (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+  #endif
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+        if (strlen(name) > EXPLORER_MAX_FILENAME_LENGTH) {
+            write_log("error", "File name too long.");
+            continue;
+        }
+        if (file_amount >= EXPLORER_MAX_FILES) {
+            write_log("info", "Maximum of showed files exceded.");
+            break;
+        }
+        snprintf(entry_name, sizeof(entry_name), is_dir ? "%s/" : "%s", name);
+        escape_html(entry_name, escaped, sizeof(escaped));
+        string_builder_printf(&entries, FILE_EXPLORER_LIST_ELEMENT, escaped, escaped);
+        file_amount++;
+    }
+  #ifdef __linux__
+    closedir(dir);
+  #else
+    FindClose(h_find);
+  #endif
+
+    // Header, special entries, the files and the footer
+    escape_html(title, escaped, sizeof(escaped));
+    string_builder_reserve(html, entries.length + HTML_EL_SIZE);
+    string_builder_printf(html, FILE_EXPLORER_HEADER, escaped, file_amount);
+    string_builder_printf(html, FILE_EXPLORER_LIST_ELEMENT, "..", "..");
+    string_builder_append(html, entries.data, entries.length);
+    string_builder_append(html, FILE_EXPLORER_FOOTER, strlen(FILE_EXPLORER_FOOTER));
+    free(entries.data);
+    return TRUE;
+}
+
+/* Queue the explorer page of a directory, rendered once and kept in the
+   explorer cache until the directory mtime changes */
+void send_dir_listing(connection_params *conn, const char *dir_path, const char *title) {
+    http_response *response = &conn->response;
+    string_builder html = {0};
+    struct stat dir_stat;
+    cache_entry *listing;
+
+    if ((listing = content_cache_get(&explorer_cache, dir_path, ENCODING_IDENTITY)) != NULL) {
+        send_cached_content(conn, listing);
+        return;
+    }
+    if (stat(dir_path, &dir_stat) != 0 || !render_dir_listing(dir_path, title, &html)) {
+        write_log("error", "Error getting dir content");
+        send_500_response(conn);
+        return;
+    }
+
+    char header[MAX_HEADER_SIZE];
+    size_t header_length = render_content_header(header, find_mime_extension(".html"), html.length, NULL, NULL);
+    // A directory changed during this second could change again unnoticed by its mtime
+    if (dir_stat.st_mtime < time(NULL) && content_cache_fits(&explorer_cache, html.length)) {
+        listing = content_cache_insert(&explorer_cache, dir_path, ENCODING_IDENTITY, html.data, html.length, &dir_stat, header, header_length, NULL);
+        send_cached_content(conn, listing);
+        return;
+    }
+    response->header_length = render_status_line(response->header, "200 OK");
+    memcpy(response->header + response->header_length, header, header_length);
+    response->header_length += header_length;
+    response->owned_body = html.data; // released with the response
+    response->body = html.data;
+    response->body_length = html.length;
+    write_log("info", "Response 200 queued.");
+}
+
+/* Make room for extra bytes (and the terminator), doubling the capacity */
+void string_builder_reserve(string_builder *builder, size_t extra) {
+    size_t needed = builder->length + extra + 1;
+    if (needed <= builder->capacity)
+        return;
+    size_t capacity = builder->capacity > 0 ? builder->capacity : HTML_EL_SIZE;
+    while (capacity < needed)
+        capacity *= 2;
+    char *data = realloc(builder->data, capacity);
+    if (data == NULL) {
+        write_log("error", "Error allocating memory.");
+        exit(-1);
+    }
+    builder->data = data;
+    builder->capacity = capacity;
+}
+
+void string_builder_append(string_builder *builder, const char *text, size_t length) {
+    string_builder_reserve(builder, length);
+    memcpy(builder->data + builder->length, text, length);
+    builder->length += length;
+    builder->data[builder->length] = '\0';
+}
+
+void string_builder_printf(string_builder *builder, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length <= 0)
+        return;
+    string_builder_reserve(builder, length);
+    va_start(args, format);
+    vsnprintf(builder->data + builder->length, length + 1, format, args);
+    va_end(args);
+    builder->length += length;
+}
+
+/* Escape the html special characters of text, output must hold 6 bytes per character */
+size_t escape_html(const char *text, char *output, size_t size) {
+    size_t length = 0;
+    for (; *text && length + 7 < size; text++) {
+        switch (*text) {
+            case '&': memcpy(output + length, "&amp;", 5); length += 5; break;
+            case '<': memcpy(output + length, "&lt;", 4); length += 4; break;
+            case '>': memcpy(output + length, "&gt;", 4); length += 4; break;
+            case '"': memcpy(output + length, "&quot;", 6); length += 6; break;
+            case '\'': memcpy(output + length, "&#39;", 5); length += 5; break;
+            default: output[length++] = *text;
+        }
+    }
+    output[length] = '\0';
+    return length;
+}
+
+void socket_error_msg(){
+    #ifdef __linux__
+        // todo
+        perror("Error caused by:");
+    #else
+        int errCode = WSAGetLastError();
+        write_log("error", "Socket error code %d", errCode);
+    #endif
+}
+
+void set_socket_cork(SocketType socket, int8_t enabled){
+    #ifdef __linux__
+        int value = enabled;
+        setsockopt(socket, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+    #endif
+}
+
+int socket_would_block(){
+    #ifdef __linux__
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    #else
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+    #endif
+}
+
+/* Monotonic clock in microseconds */
+uint64_t get_time_usec(){
+    #ifdef __linux__
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    #else
+        LARGE_INTEGER counter, frequency;
+        QueryPerformanceCounter(&counter);
+        QueryPerformanceFrequency(&frequency);
+        return (uint64_t)(counter.QuadPart * 1000000 / frequency.QuadPart);
+    #endif
+}
+
+void atomic_max_u64(uint64_t *target, uint64_t value){
+    uint64_t current = __atomic_load_n(target, __ATOMIC_RELAXED);
+    while (value > current &&
+           !__atomic_compare_exchange_n(target, &current, value, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* FNV-1a */
+uint32_t hash_string(const char *str){
+    uint32_t hash = 2166136261u;
+    while (*str)
+        hash = (hash ^ (uint8_t)*str++) * 16777619u;
+    return hash;
+}
+
+/* Resolve the "." and ".." segments and the repeated slashes of a relative path
+   in place, a trailing slash is kept. Returns FALSE if it climbs above its root. */
+int normalize_path(char *path){
+    char *read = path, *write = path;
+    int8_t trailing_slash = FALSE;
+
+    while (*read) {
+        size_t length = strcspn(read, "/");
+        trailing_slash = read[length] == '/';
+        if (length == 2 && read[0] == '.' && read[1] == '.') {
+            if (write == path)
+                return FALSE;
+            while (write > path && *--write != '/')
+                ;
+        } else if (length > 0 && (length != 1 || read[0] != '.')) {
+            if (write > path)
+                *write++ = '/';
+            memmove(write, read, length);
+            write += length;
+        }
+        read += length + trailing_slash;
+    }
+    if (trailing_slash && write > path)
+        *write++ = '/';
+    *write = '\0';
+    return TRUE;
+}
+
+/* Component wise prefix test of normalized paths, "web2/x" is not in "web" */
+int path_in_folder(const char *path, const char *folder){
+    size_t length = strlen(folder);
+    if (length == 0)
+        return TRUE;
+    return strncmp(path, folder, length) == 0 && (path[length] == '\0' || path[length] == '/');
+}
+
+/* Copy the index entry of a normalized path (trailing slash ignored). The path and
+   next pointers of the copy must not be used. PATH_UNKNOWN when the index is off. */
+int path_index_lookup(const char *path, path_entry *output){
+    #ifdef __linux__
+        char key[MAX_PATH_LENGTH];
+        size_t length = strlen(path);
+        int result = PATH_UNKNOWN;
+
+        if (length >= sizeof(key))
+            return PATH_UNKNOWN;
+        memcpy(key, path, length + 1);
+        if (length > 0 && key[length - 1] == '/')
+            key[length - 1] = '\0';
+        uint32_t hash = hash_string(key);
+
+        rwlock_read_lock(&served_index.lock);
+        if (served_index.enabled) {
+            result = PATH_MISSING;
+            for (path_entry *entry = served_index.buckets[hash & (served_index.buckets_count - 1)]; entry; entry = entry->next) {
+                if (entry->hash == hash && strcmp(entry->path, key) == 0) {
+                    if (output != NULL)
+                        *output = *entry;
+                    result = PATH_FOUND;
+                    break;
+                }
+            }
+        }
+        rwlock_unlock(&served_index.lock);
+        return result;
+    #else
+        (void)path;
+        (void)output;
+        return PATH_UNKNOWN;
+    #endif
+}
+
+#ifdef __linux__
+    /* Index the served root and watch it, the index is left off if anything fails */
+    void init_path_index(const char *root){
+        rwlock_init(&served_index.lock);
+        served_index.root = cstrdup((char *)root);
+        served_index.buckets_count = PATH_INDEX_BUCKETS;
+        served_index.buckets = calloc(served_index.buckets_count, sizeof(path_entry *));
+        served_index.root_watch = -1;
+        served_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (served_index.root == NULL || served_index.buckets == NULL || served_index.inotify_fd < 0) {
+            path_index_disable("inotify not available");
+            return;
+        }
+
+        uint64_t started_at = get_time_usec();
+        served_index.enabled = TRUE;
+        if (!path_index_build()) {
+            path_index_disable("the folder could not be fully indexed");
+            return;
+        }
+        write_log(NULL, "Path index: "SIZE_T_FORMAT" paths under '%s' in %lu ms.", served_index.count,
+                  root[0] ? root : ".", (unsigned long)((get_time_usec() - started_at) / 1000));
+
+        #ifdef MULTITHREAD_ON
+            int error = create_thread(path_index_watcher);
+            if (error != 0) {
+                write_log("error", "Path index watcher not started: '%s'", strerror(error));
+                path_index_disable("no watcher thread");
+                return;
+            }
+        #endif
+    }
+
+    /* (Re)index the whole root (write lock held) */
+    int path_index_build(){
+        struct stat info;
+        const char *root = served_index.root;
+
+        path_index_clear();
+        if (stat(root[0] ? root : ".", &info) != 0 || !S_ISDIR(info.st_mode))
+            return FALSE;
+        return path_index_put(root, &info) && path_index_walk(root, 0);
+    }
+
+    /* Watch a directory and index its content, recursively (write lock held).
+       The watch is added first so nothing created during the scan is missed.
+       FALSE past PATH_INDEX_MAX_DEPTH: an unwalked directory would make its
+       files look missing. */
+    int path_index_walk(const char *dir_path, int depth){
+        char path[MAX_PATH_LENGTH];
+        struct stat info;
+        struct dirent *item;
+        const char *fs_path = dir_path[0] ? dir_path : ".";
+
+        if (depth > PATH_INDEX_MAX_DEPTH) {
+            write_log("error", "Path index: more than %d directory levels at '%s'.", PATH_INDEX_MAX_DEPTH, fs_path);
+            return FALSE;
+        }
+
+        int wd = inotify_add_watch(served_index.inotify_fd, fs_path, PATH_INDEX_EVENTS);
+        if (wd < 0) {
+            write_log("error", "Path index: can't watch '%s': %s", fs_path, strerror(errno));
+            return FALSE;
+        }
+        if (wd >= served_index.watches_capacity) {
+            int32_t capacity = served_index.watches_capacity ? served_index.watches_capacity : 256;
+            while (capacity <= wd)
+                capacity *= 2;
+            char **watches = realloc(served_index.watches, capacity * sizeof(char *));
+            if (watches == NULL)
+                return FALSE;
+            memset(watches + served_index.watches_capacity, 0, (capacity - served_index.watches_capacity) * sizeof(char *));
+            served_index.watches = watches;
+            served_index.watches_capacity = capacity;
+        }
+        if (served_index.watches[wd] != NULL) {
+            // Same directory reached through two paths (symlink), events can't be mapped back
+            if (strcmp(served_index.watches[wd], dir_path) != 0) {
+                write_log("error", "Path index: '%s' and '%s' are the same directory.", served_index.watches[wd], dir_path);
+                return FALSE;
+            }
+        } else if ((served_index.watches[wd] = cstrdup((char *)dir_path)) == NULL) {
+            return FALSE;
+        }
+        if (depth == 0)
+            served_index.root_watch = wd;
+
+        DIR *dir = opendir(fs_path);
+        if (dir == NULL)
+            return TRUE; // unreadable, its content is not served
+        while ((item = readdir(dir)) != NULL) {
+            if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0)
+                continue;
+            if (snprintf(path, sizeof(path), "%s%s%s", dir_path, dir_path[0] ? "/" : "", item->d_name) >= (int)sizeof(path))
+                continue; // too long to be requested
+            if (fstatat(dirfd(dir), item->d_name, &info, 0) != 0)
+                continue; // dangling symlink
+            if (!path_index_put(path, &info) ||
+                (S_ISDIR(info.st_mode) && !path_index_walk(path, depth + 1))) {
+                closedir(dir);
+                return FALSE;
+            }
+        }
+        closedir(dir);
+        return TRUE;
+    }
+
+    /* Insert or refresh a path (write lock held). FALSE once the index is full. */
+    int path_index_put(const char *path, const struct stat *info){
+        uint32_t hash = hash_string(path);
+        path_entry *entry = served_index.buckets[hash & (served_index.buckets_count - 1)];
+
+        while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path) != 0))
+            entry = entry->next;
+        if (entry == NULL) {
+            if (served_index.count >= PATH_INDEX_MAX_ENTRIES) {
+                write_log("error", "Path index: more than %d paths.", PATH_INDEX_MAX_ENTRIES);
+                return FALSE;
+            }
+            // Keep about one entry per bucket
+            if (served_index.count >= served_index.buckets_count) {
+                size_t buckets_count = served_index.buckets_count * 2;
+                path_entry **buckets = calloc(buckets_count, sizeof(path_entry *));
+                if (buckets == NULL)
+                    return FALSE;
+                for (size_t i = 0; i < served_index.buckets_count; i++) {
+                    while ((entry = served_index.buckets[i]) != NULL) {
+                        served_index.buckets[i] = entry->next;
+                        entry->next = buckets[entry->hash & (buckets_count - 1)];
+                        buckets[entry->hash & (buckets_count - 1)] = entry;
+                    }
+                }
+                free(served_index.buckets);
+                served_index.buckets = buckets;
+                served_index.buckets_count = buckets_count;
+            }
+            if ((entry = malloc(sizeof(path_entry))) == NULL || (entry->path = cstrdup((char *)path)) == NULL) {
+                free(entry);
+                return FALSE;
+            }
+            entry->hash = hash;
+            entry->mime = get_filename_mime(path);
+            entry->next = served_index.buckets[hash & (served_index.buckets_count - 1)];
+            served_index.buckets[hash & (served_index.buckets_count - 1)] = entry;
+            served_index.count++;
+        }
+        entry->size = info->st_size;
+        entry->mtime = info->st_mtime;
+        entry->is_dir = S_ISDIR(info->st_mode);
+        return TRUE;
+    }
+
+    /* Drop a path, and everything under it for a directory (write lock held) */
+    void path_index_remove(const char *path, int8_t is_dir){
+        size_t length = strlen(path);
+        size_t first = 0, last = served_index.buckets_count;
+
+        // A file only lives in its own bucket
+        if (!is_dir) {
+            first = hash_string(path) & (served_index.buckets_count - 1);
+            last = first + 1;
+        }
+        for (size_t i = first; i < last; i++) {
+            path_entry **link = &served_index.buckets[i];
+            while (*link != NULL) {
+                path_entry *entry = *link;
+                if (strcmp(entry->path, path) == 0 ||
+                    (is_dir && strncmp(entry->path, path, length) == 0 && entry->path[length] == '/')) {
+                    *link = entry->next;
+                    free(entry->path);
+                    free(entry);
+                    served_index.count--;
+                } else {
+                    link = &entry->next;
+                }
+            }
+        }
+        if (is_dir)
+            path_index_forget_watches(path);
+    }
+
+    /* Stop watching a directory and its subdirectories (write lock held). Events
+       still queued for them are dropped since their descriptors are unknown now. */
+    void path_index_forget_watches(const char *dir_path){
+        for (int32_t wd = 0; wd < served_index.watches_capacity; wd++) {
+            char *watched = served_index.watches[wd];
+            if (watched == NULL || !path_in_folder(watched, dir_path))
+                continue;
+            inotify_rm_watch(served_index.inotify_fd, wd);
+            free(watched);
+            served_index.watches[wd] = NULL;
+        }
+    }
+
+    void path_index_clear(){
+        for (size_t i = 0; i < served_index.buckets_count; i++) {
+            path_entry *entry;
+            while ((entry = served_index.buckets[i]) != NULL) {
+                served_index.buckets[i] = entry->next;
+                free(entry->path);
+                free(entry);
+            }
+        }
+        served_index.count = 0;
+    }
+
+    /* Stop indexing, every request goes back to the filesystem (write lock held) */
+    void path_index_disable(const char *reason){
+        write_log("error", "Path index disabled (%s), serving from the filesystem.", reason);
+        served_index.enabled = FALSE;
+        path_index_clear();
+        if (served_index.inotify_fd >= 0)
+            close(served_index.inotify_fd);
+        served_index.inotify_fd = -1;
+    }
+
+    /* Apply one inotify event to the index (write lock held) */
+    void path_index_apply(struct inotify_event *event){
+        char path[MAX_PATH_LENGTH];
+        struct stat info;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            // Events were lost, start over from a fresh scan
+            write_log("info", "Path index: inotify queue overflow, rebuilding.");
+            path_index_forget_watches("");
+            if (!path_index_build())
+                path_index_disable("the folder could not be fully indexed");
+            return;
+        }
+        if (event->wd < 0 || event->wd >= served_index.watches_capacity || served_index.watches[event->wd] == NULL)
+            return;
+        const char *dir_path = served_index.watches[event->wd];
+
+        if (event->mask & IN_IGNORED) {
+            free(served_index.watches[event->wd]);
+            served_index.watches[event->wd] = NULL;
+            return;
+        }
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+            if (event->wd == served_index.root_watch)
+                path_index_disable("the served folder was moved or deleted");
+            return; // the parent directory reports the other ones
+        }
+        if (event->len == 0 ||
+            snprintf(path, sizeof(path), "%s%s%s", dir_path, dir_path[0] ? "/" : "", event->name) >= (int)sizeof(path))
+            return;
+
+        if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            path_index_remove(path, (event->mask & IN_ISDIR) != 0);
+            return;
+        }
+        if (stat(path, &info) != 0)
+            return; // already gone, its IN_DELETE follows
+        if (!path_index_put(path, &info)) {
+            path_index_disable("too many paths");
+            return;
+        }
+        if (S_ISDIR(info.st_mode) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+            int depth = served_index.root[0] == '\0'; // children of "" have no slash
+            for (const char *c = path + strlen(served_index.root); *c; c++)
+                depth += *c == '/';
+            if (!path_index_walk(path, depth))
+                path_index_disable("a new directory could not be indexed");
+        }
+    }
+
+    /* Apply the pending inotify events, never blocks */
+    void path_index_sync(){
+        char events[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t length;
+
+        while (served_index.inotify_fd >= 0 && (length = read(served_index.inotify_fd, events, sizeof(events))) > 0) {
+            rwlock_write_lock(&served_index.lock);
+            for (char *cursor = events; cursor < events + length && served_index.inotify_fd >= 0; ) {
+                struct inotify_event *event = (struct inotify_event *)cursor;
+                path_index_apply(event);
+                cursor += sizeof(struct inotify_event) + event->len;
+            }
+            rwlock_unlock(&served_index.lock);
+        }
+    }
+
+    #ifdef MULTITHREAD_ON
+        /* Keep the index live while the workers read it */
+        void *path_index_watcher(void *args){
+            (void)args;
+            struct pollfd watched = { .fd = served_index.inotify_fd, .events = POLLIN };
+            while (served_index.inotify_fd >= 0) {
+                if (poll(&watched, 1, -1) > 0)
+                    path_index_sync();
+            }
+            return NULL;
+        }
+    #endif
+#endif
+
+void init_file_cache(){
+    memset(file_cache, 0, sizeof(file_cache));
+    for (int i = 0; i < CACHE_SHARDS; i++)
+        mutex_init(&file_cache[i].lock);
+}
+
+void file_cache_release(open_file *file){
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        #ifdef __linux__
+            if (file->map != NULL) {
+                munmap(file->map, file->info.st_size);
+                __atomic_sub_fetch(&file_maps.bytes, file->info.st_size, __ATOMIC_RELAXED);
+                __atomic_sub_fetch(&file_maps.files, 1, __ATOMIC_RELAXED);
+            }
+            close(file->fd);
+        #endif
+        free(file->path);
+        free(file);
+    }
+}
+
+/* Unlink a handle from its shard (shard lock held) and drop the cache reference.
+   Streams still using it keep the descriptor open until they finish. */
+void file_cache_unlink(file_cache_shard *shard, open_file *file){
+    open_file **link = &shard->buckets[file->hash % FILE_CACHE_BUCKETS];
+    while (*link != file)
+        link = &(*link)->hash_next;
+    *link = file->hash_next;
+
+    if (file->lru_prev) file->lru_prev->lru_next = file->lru_next;
+    else shard->lru_head = file->lru_next;
+    if (file->lru_next) file->lru_next->lru_prev = file->lru_prev;
+    else shard->lru_tail = file->lru_prev;
+
+    shard->count--;
+    file_cache_release(file);
+}
+
+/* Returns a referenced handle of a regular file, or NULL if it can't be opened.
+   Cached handles are reused for FILE_CACHE_TTL seconds, then compared with the
+   file on disk (inode, size, mtime) and reopened if it changed. */
+open_file *file_cache_open(const char *path){
+    uint32_t hash = hash_string(path);
+    file_cache_shard *shard = &file_cache[hash % CACHE_SHARDS];
+    time_t now = time(NULL);
+    struct stat file_stat;
+    open_file *file;
+
+    mutex_lock(&shard->lock);
+    file = shard->buckets[hash % FILE_CACHE_BUCKETS];
+    while (file != NULL && (file->hash != hash || strcmp(file->path, path) != 0))
+        file = file->hash_next;
+
+    if (file != NULL && now - file->validated_at >= FILE_CACHE_TTL) {
+        if (stat(path, &file_stat) != 0 || file_stat.st_ino != file->info.st_ino ||
+            file_stat.st_size != file->info.st_size || file_stat.st_mtime != file->info.st_mtime) {
+            file_cache_unlink(shard, file); // changed on disk
+            file = NULL;
+        } else {
+            file->validated_at = now;
+        }
+    }
+    if (file != NULL) {
+        if (file != shard->lru_head) {
+            file->lru_prev->lru_next = file->lru_next;
+            if (file->lru_next) file->lru_next->lru_prev = file->lru_prev;
+            else shard->lru_tail = file->lru_prev;
+            file->lru_prev = NULL;
+            file->lru_next = shard->lru_head;
+            shard->lru_head->lru_prev = file;
+            shard->lru_head = file;
+        }
+        __atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+        mutex_unlock(&shard->lock);
+        return file;
+    }
+    mutex_unlock(&shard->lock);
+
+    // Miss: open and stat the file once
+    file = safe_malloc(sizeof(open_file));
+    memset(file, 0, sizeof(open_file));
+    #ifdef __linux__
+        if ((file->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+            free(file);
+            return NULL;
+        }
+        if (fstat(file->fd, &file->info) != 0 || !S_ISREG(file->info.st_mode)) {
+            close(file->fd);
+            free(file);
+            return NULL;
+        }
+    #else
+        file->fd = -1;
+        if (stat(path, &file->info) != 0 || !S_ISREG(file->info.st_mode)) {
+            free(file);
+            return NULL;
+        }
+    #endif
+    file->path = cstrdup((char*)path);
+    file->hash = hash;
+    file->mime = get_filename_mime(path);
+    get_file_validators(&file->validators, file);
+    file->validated_at = now;
+    file->refs = 2; // the cache and the caller
+
+    mutex_lock(&shard->lock);
+    open_file *previous = shard->buckets[hash % FILE_CACHE_BUCKETS];
+    while (previous != NULL && (previous->hash != hash || strcmp(previous->path, path) != 0))
+        previous = previous->hash_next;
+    if (previous != NULL)
+        file_cache_unlink(shard, previous);
+    if (shard->count >= FILE_CACHE_MAX_FILES / CACHE_SHARDS)
+        file_cache_unlink(shard, shard->lru_tail);
+    file->hash_next = shard->buckets[hash % FILE_CACHE_BUCKETS];
+    shard->buckets[hash % FILE_CACHE_BUCKETS] = file;
+    file->lru_next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->lru_prev = file;
+    else shard->lru_tail = file;
+    shard->lru_head = file;
+    shard->count++;
+    mutex_unlock(&shard->lock);
+    return file;
+}
+
+/* Shared read only mapping of a small file, made by its first response and
+   unmapped with the handle. NULL when the file is too big, the budget is spent
+   or mmap serving is off: the body is then sent from the descriptor. */
+const char *map_open_file(open_file *file){
+    #ifdef __linux__
+        size_t size = file->info.st_size;
+        char *map = __atomic_load_n(&file->map, __ATOMIC_ACQUIRE);
+        if (map != NULL || file_maps.budget == 0 || size == 0 || size > file_maps.max_file_size)
+            return map;
+        if ((shaping.connection_rate > 0 || shaping.total.rate > 0) && size >= SHAPED_FILE_SIZE)
+            return NULL; // memory parts are not shaped, keep it on sendfile
+        if (__atomic_add_fetch(&file_maps.bytes, size, __ATOMIC_RELAXED) > file_maps.budget) {
+            __atomic_sub_fetch(&file_maps.bytes, size, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        if ((map = mmap(NULL, size, PROT_READ, MAP_SHARED, file->fd, 0)) == MAP_FAILED) {
+            __atomic_sub_fetch(&file_maps.bytes, size, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        char *expected = NULL;
+        if (!__atomic_compare_exchange_n(&file->map, &expected, map, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            munmap(map, size); // another response mapped it first
+            __atomic_sub_fetch(&file_maps.bytes, size, __ATOMIC_RELAXED);
+            return expected;
+        }
+        __atomic_add_fetch(&file_maps.files, 1, __ATOMIC_RELAXED);
+        return map;
+    #else
+        (void)file;
+        return NULL;
+    #endif
+}
+
+/* Plan the readahead of a file body about to be sent. A range starting where a
+   recent one of the file ended continues a sequential stream: its window
+   doubles and the prefetch runs past the range, so the next one is read warm,
+   while the pages it consumed of a huge file are dropped. Any other offset is
+   a seek, prefetched with the smallest window and only up to its range end. */
+void advise_file_read(connection_params *conn, open_file *file, size_t offset, size_t length){
+    #ifdef __linux__
+        http_response *response = &conn->response;
+        size_t file_size = file->info.st_size;
+        file_cache_shard *shard = &file_cache[file->hash % CACHE_SHARDS];
+        read_stream *stream = NULL;
+        size_t drop_from = 0, drop_to = 0;
+        int8_t advise_sequential = FALSE;
+        if (file_size < READAHEAD_MIN_FILE_SIZE || length == 0)
+            return;
+
+        mutex_lock(&shard->lock);
+        for (int i = 0; i < READAHEAD_STREAMS && stream == NULL; i++) {
+            read_stream *candidate = &file->streams[i];
+            if (candidate->window > 0 && offset + READAHEAD_GAP >= candidate->next_offset && offset <= candidate->next_offset + READAHEAD_GAP)
+                stream = candidate;
+        }
+        if (stream != NULL) {
+            if (stream->window < READAHEAD_MAX_WINDOW)
+                stream->window *= 2;
+            if (!file->sequential_advised)
+                advise_sequential = file->sequential_advised = TRUE;
+            // Never drop the pages another response of the file is reading
+            if (file_size >= READAHEAD_DROP_FILE_SIZE && offset > stream->dropped + READAHEAD_DROP_LAG &&
+                __atomic_load_n(&file->refs, __ATOMIC_RELAXED) <= 2) {
+                drop_from = stream->dropped;
+                drop_to = stream->dropped = offset - READAHEAD_DROP_LAG;
+            }
+            response->prefetch_end = file_size;
+            metric_add(get_thread_metrics()->sequential_ranges, 1);
+        } else {
+            stream = &file->streams[file->next_stream];
+            file->next_stream = (file->next_stream + 1) % READAHEAD_STREAMS;
+            stream->window = READAHEAD_MIN_WINDOW;
+            stream->dropped = offset;
+            response->prefetch_end = offset + length;
+        }
+        stream->next_offset = offset + length;
+        response->prefetch_window = stream->window;
+        mutex_unlock(&shard->lock);
+
+        if (advise_sequential)
+            posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL); // larger kernel readahead on the shared fd
+        if (drop_to > drop_from)
+            posix_fadvise(file->fd, drop_from, drop_to - drop_from, POSIX_FADV_DONTNEED);
+        response->prefetched_to = offset;
+        prefetch_response(response);
+    #else
+        (void)conn; (void)file; (void)offset; (void)length;
+    #endif
+}
+
+/* Keep the readahead at least half a window ahead of the bytes being sent.
+   POSIX_FADV_WILLNEED queues the disk reads without waiting for them. */
+void prefetch_response(http_response *response){
+    #ifdef __linux__
+        if (response->prefetch_window == 0 || response->prefetched_to >= response->prefetch_end ||
+            response->prefetched_to > response->file_offset + response->prefetch_window / 2)
+            return;
+        size_t length = response->prefetch_end - response->prefetched_to;
+        if (length > response->prefetch_window)
+            length = response->prefetch_window;
+        posix_fadvise(response->file->fd, response->prefetched_to, length, POSIX_FADV_WILLNEED);
+        response->prefetched_to += length;
+        if (response->prefetch_window < READAHEAD_MAX_WINDOW)
+            response->prefetch_window *= 2;
+    #else
+        (void)response;
+    #endif
+}
+
+/* Read length bytes from offset, returns FALSE on a short read */
+int read_open_file(open_file *file, char *output, size_t offset, size_t length){
+    #ifdef __linux__
+        ssize_t bytes_read;
+        while (length > 0) {
+            bytes_read = pread(file->fd, output, length, offset);
+            if (bytes_read < 0 && errno == EINTR)
+                continue;
+            if (bytes_read <= 0)
+                return FALSE;
+            output += bytes_read;
+            offset += bytes_read;
+            length -= bytes_read;
+        }
+        return TRUE;
+    #else
+        FILE *stream = fopen(file->path, "rb");
+        if (stream == NULL)
+            return FALSE;
+        fseek(stream, offset, SEEK_SET);
+        size_t bytes_read = fread(output, 1, length, stream);
+        fclose(stream);
+        return bytes_read == length;
+    #endif
+}
+
+/* Validators of a file as it is on disk: a strong ETag made of its inode, size
+   and mtime, Last-Modified and the Cache-Control policy of its extension */
+void get_file_validators(content_validators *validators, open_file *file){
+    memset(validators, 0, sizeof(content_validators));
+    snprintf(validators->etag, ETAG_SIZE, "\"%llx-%llx-%llx\"", (unsigned long long)file->info.st_ino,
+             (unsigned long long)file->info.st_size, (unsigned long long)file->info.st_mtime);
+    format_http_date(file->info.st_mtime, validators->last_modified);
+    validators->mtime = file->info.st_mtime;
+    validators->cache_control = file->mime->cache_control != NULL ? file->mime->cache_control : default_cache_control;
+    validators->varies = file->mime->compressible;
+}
+
+/* Weak comparison (RFC 7232) of an ETag with an If-None-Match list */
+int etag_matches(const char *etag_list, const char *etag){
+    const char *item = etag_list;
+    size_t length;
+    if (strncmp(etag, "W/", 2) == 0)
+        etag += 2;
+    length = strlen(etag);
+
+    while (*item) {
+        while (*item == ' ' || *item == ',')
+            item++;
+        if (*item == '*')
+            return TRUE;
+        if (strncmp(item, "W/", 2) == 0)
+            item += 2;
+        if (strncmp(item, etag, length) == 0 && (item[length] == '\0' || item[length] == ',' || item[length] == ' '))
+            return TRUE;
+        if ((item = strchr(item, ',')) == NULL)
+            break;
+    }
+    return FALSE;
+}
+
+/* TRUE when there is no If-Range or it still names the current file: a strong
+   ETag or its exact Last-Modified date. Otherwise the whole file is sent. */
+int if_range_matches(http_request *request, const content_validators *validators){
+    const char *condition = get_request_header(request, "If-Range");
+    if (condition == NULL)
+        return TRUE;
+    if (condition[0] == '"')
+        return strcmp(condition, validators->etag) == 0 && validators->etag[0] == '"';
+    return strcmp(condition, validators->last_modified) == 0;
+}
+
+/* TRUE when a GET/HEAD can be answered with a 304. If-None-Match takes
+   precedence over If-Modified-Since. */
+int request_not_modified(http_request *request, const content_validators *validators){
+    const char *condition;
+    if (validators == NULL || validators->etag[0] == '\0' ||
+        (strcmp(request->method, "GET") != 0 && strcmp(request->method, "HEAD") != 0))
+        return FALSE;
+
+    if ((condition = get_request_header(request, "If-None-Match")) != NULL)
+        return etag_matches(condition, validators->etag);
+    if ((condition = get_request_header(request, "If-Modified-Since")) != NULL) {
+        time_t since = parse_http_date(condition);
+        return since != -1 && validators->mtime <= since;
+    }
+    return FALSE;
+}
+
+void init_memory_cache(memory_cache *cache, const char *name, size_t budget, size_t max_entry_size){
+    memset(cache, 0, sizeof(memory_cache));
+    for (int i = 0; i < CACHE_SHARDS; i++)
+        mutex_init(&cache->shards[i].lock);
+    cache->name = name;
+    cache->metrics_index = memory_caches_count;
+    memory_caches[memory_caches_count++] = cache;
+    cache->shard_budget = budget / CACHE_SHARDS;
+    cache->max_entry_size = max_entry_size;
+    if (cache->shard_budget > 0)
+        write_log(NULL, "%s cache: " SIZE_T_FORMAT " bytes in %d shards.", name, budget, CACHE_SHARDS);
+}
+
+void content_cache_release(cache_entry *entry){
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(entry->path);
+        free(entry->header);
+        free(entry->data);
+        free(entry);
+    }
+}
+
+/* Unlink an entry from its shard (shard lock held) and drop the cache reference */
+void content_cache_unlink(cache_shard *shard, cache_entry *entry){
+    cache_entry **link = &shard->buckets[entry->hash % CACHE_BUCKETS];
+    while (*link != entry)
+        link = &(*link)->hash_next;
+    *link = entry->hash_next;
+
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else shard->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else shard->lru_tail = entry->lru_prev;
+
+    shard->bytes -= entry->size + entry->header_length;
+    content_cache_release(entry);
+}
+
+/* Entry of a path in one encoding: a precompressed sibling (app.js.gz) sent as
+   the gzip variant of app.js is not the file a direct download of it gets */
+cache_entry *content_cache_find(cache_shard *shard, const char *path, int8_t encoding, uint32_t hash){
+    cache_entry *entry = shard->buckets[hash % CACHE_BUCKETS];
+    while (entry != NULL && (entry->hash != hash || entry->encoding != encoding || strcmp(entry->path, path) != 0))
+        entry = entry->hash_next;
+    return entry;
+}
+
+int content_cache_fits(memory_cache *cache, size_t size){
+    return cache->shard_budget > 0 && size <= cache->max_entry_size && size + MAX_HEADER_SIZE <= cache->shard_budget;
+}
+
+/* Returns a referenced entry, or NULL on miss. Entries are checked against the
+   file mtime/size at most once every CACHE_REVALIDATE_SECONDS. */
+cache_entry *content_cache_get(memory_cache *cache, const char *path, int8_t encoding){
+    if (cache->shard_budget == 0)
+        return NULL;
+
+    uint32_t hash = hash_string(path);
+    cache_shard *shard = &cache->shards[hash % CACHE_SHARDS];
+    time_t now = time(NULL);
+    struct stat file_stat;
+
+    mutex_lock(&shard->lock);
+    cache_entry *entry = content_cache_find(shard, path, encoding, hash);
+    if (entry != NULL && now - entry->validated_at >= CACHE_REVALIDATE_SECONDS) {
+        if (stat(path, &file_stat) != 0 || file_stat.st_mtime != entry->mtime ||
+            (size_t)file_stat.st_size != entry->source_size) {
+            content_cache_unlink(shard, entry); // stale
+            entry = NULL;
+        } else {
+            entry->validated_at = now;
+        }
+    }
+    if (entry != NULL) {
+        // move to the LRU head
+        if (entry != shard->lru_head) {
+            entry->lru_prev->lru_next = entry->lru_next;
+            if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+            else shard->lru_tail = entry->lru_prev;
+            entry->lru_prev = NULL;
+            entry->lru_next = shard->lru_head;
+            shard->lru_head->lru_prev = entry;
+            shard->lru_head = entry;
+        }
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+    }
+    mutex_unlock(&shard->lock);
+
+    if (entry != NULL) {
+        metric_add(get_thread_metrics()->cache_hits[cache->metrics_index], 1);
+        write_log(NULL, "%s cache hit for '%s'.", cache->name, path);
+    } else {
+        metric_add(get_thread_metrics()->cache_misses[cache->metrics_index], 1);
+    }
+    return entry;
+}
+
+/* Store data (taking its ownership) with its prebuilt header, evicting the least
+   recently used entries of the shard. Returns a referenced entry. */
+cache_entry *content_cache_insert(memory_cache *cache, const char *path, int8_t encoding, char *data, size_t size, const struct stat *source, const char *header, size_t header_length, const content_validators *validators){
+    cache_entry *entry = safe_malloc(sizeof(cache_entry));
+    memset(entry, 0, sizeof(cache_entry));
+    entry->data = data;
+    entry->path = cstrdup((char*)path);
+    entry->hash = hash_string(path);
+    entry->encoding = encoding;
+    entry->size = size;
+    entry->source_size = source->st_size;
+    entry->mtime = source->st_mtime;
+    if (validators != NULL)
+        entry->validators = *validators;
+    entry->validated_at = time(NULL);
+    entry->header_length = header_length;
+    entry->header = safe_malloc(header_length + 1);
+    memcpy(entry->header, header, header_length + 1);
+    entry->refs = 2; // the cache and the caller
+
+    cache_shard *shard = &cache->shards[entry->hash % CACHE_SHARDS];
+    mutex_lock(&shard->lock);
+    cache_entry *previous = content_cache_find(shard, path, encoding, entry->hash);
+    if (previous != NULL)
+        content_cache_unlink(shard, previous);
+    while (shard->lru_tail != NULL && shard->bytes + size + entry->header_length > cache->shard_budget) {
+        content_cache_unlink(shard, shard->lru_tail);
+        __atomic_add_fetch(&cache->evictions, 1, __ATOMIC_RELAXED);
+    }
+    entry->hash_next = shard->buckets[entry->hash % CACHE_BUCKETS];
+    shard->buckets[entry->hash % CACHE_BUCKETS] = entry;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->lru_prev = entry;
+    else shard->lru_tail = entry;
+    shard->lru_head = entry;
+    shard->bytes += size + entry->header_length;
+    mutex_unlock(&shard->lock);
+
+    write_log(NULL, "Cached '%s' (" SIZE_T_FORMAT " bytes).", path, size);
+    return entry;
+}
+
+/* Load a small file into the cache as the variant (ENCODING_*) of path its
+   bytes are. Returns a referenced entry, or NULL if the file does not fit. */
+cache_entry *content_cache_put(memory_cache *cache, const char *path, int8_t variant, open_file *file, const MimeType *mime, const char *encoding, const content_validators *validators){
+    char header[MAX_HEADER_SIZE];
+    size_t size = file->info.st_size;
+
+    if (!content_cache_fits(cache, size))
+        return NULL;
+
+    char *data = safe_malloc(size > 0 ? size : 1);
+    if (!read_open_file(file, data, 0, size)) {
+        write_log("error", "Error reading '%s' into the cache.", path);
+        free(data);
+        return NULL;
+    }
+    size_t header_length = render_content_header(header, mime, size, encoding, validators);
+    return content_cache_insert(cache, path, variant, data, size, &file->info, header, header_length, validators);
+}
+
+/* Parse Accept-Encoding into ENCODING_* flags, ignoring codings with q=0 */
+int8_t get_accepted_encodings(const char *accept_encoding) {
+    int8_t encodings = 0;
+    const char *token = accept_encoding;
+    if (accept_encoding == NULL)
+        return 0;
+
+    while (*token) {
+        while (*token == ' ' || *token == ',')
+            token++;
+        size_t length = strcspn(token, ",; ");
+        const char *params = token + length;
+        const char *next = strchr(params, ',');
+        const char *q = strstr(params, "q=");
+        int8_t rejected = q != NULL && (next == NULL || q < next) && strtod(q + 2, NULL) <= 0;
+
+        if (!rejected && length == 4 && strncmp(token, "gzip", 4) == 0)
+            encodings |= ENCODING_GZIP;
+        else if (!rejected && length == 2 && strncmp(token, "br", 2) == 0)
+            encodings |= ENCODING_BR;
+        if (next == NULL)
+            break;
+        token = next + 1;
+    }
+    return encodings;
+}
+
+#ifdef ZLIB_ON
+    /* Returns a malloc'd gzip stream of data, or NULL if it doesn't get smaller */
+    char *gzip_compress(const char *data, size_t size, size_t *compressed_size) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return NULL;
+
+        size_t bound = deflateBound(&stream, size);
+        char *output = safe_malloc(bound);
+        stream.next_in = (Bytef*)data;
+        stream.avail_in = size;
+        stream.next_out = (Bytef*)output;
+        stream.avail_out = bound;
+        int result = deflate(&stream, Z_FINISH);
+        *compressed_size = stream.total_out;
+        deflateEnd(&stream);
+
+        if (result != Z_STREAM_END || *compressed_size >= size) {
+            free(output);
+            return NULL;
+        }
+        return output;
+    }
+#endif
+
+/* Serve a compressed variant of a compressible file: a precompressed sibling
+   (path.br, path.gz) if present, else a gzip made on the fly and kept in the
+   compressed cache. Returns FALSE when the file must be sent as is. */
+int send_encoded_content(connection_params *conn, const char *path, int8_t encodings) {
+    const struct { int8_t flag; const char *extension; const char *name; } sidecars[] = {
+        { ENCODING_BR, ".br", "br" },
+        { ENCODING_GZIP, ".gz", "gzip" }
+    };
+    char sidecar_path[MAX_PATH_LENGTH + 4];
+    content_validators validators;
+    cache_entry *cached;
+    open_file *file;
+
+    for (int i = 0; i < 2; i++) {
+        if (!(encodings & sidecars[i].flag))
+            continue;
+        snprintf(sidecar_path, sizeof(sidecar_path), "%s%s", path, sidecars[i].extension);
+        if (path_index_lookup(sidecar_path, NULL) == PATH_MISSING)
+            continue;
+        if ((cached = content_cache_get(&content_cache, sidecar_path, sidecars[i].flag)) != NULL) {
+            send_cached_content(conn, cached);
+            return TRUE;
+        }
+        if ((file = file_cache_open(sidecar_path)) == NULL)
+            continue;
+        write_log(NULL, "Serving precompressed '%s'.", sidecar_path);
+        const MimeType *mime = get_filename_mime(path);
+        validators = file->validators; // the sidecar is versioned on its own, cached like the original
+        validators.cache_control = get_filename_cache_control(path);
+        validators.varies = TRUE;
+        if ((cached = content_cache_put(&content_cache, sidecar_path, sidecars[i].flag, file, mime, sidecars[i].name, &validators)) != NULL) {
+            file_cache_release(file);
+            send_cached_content(conn, cached);
+        } else {
+            send_content(conn, file, mime, file->info.st_size, sidecars[i].name, &validators);
+        }
+        return TRUE;
+    }
+
+    #ifdef ZLIB_ON
+        if (!(encodings & ENCODING_GZIP))
+            return FALSE;
+        if ((cached = content_cache_get(&compressed_cache, path, ENCODING_GZIP)) != NULL) {
+            send_cached_content(conn, cached);
+            return TRUE;
+        }
+        if ((file = file_cache_open(path)) == NULL)
+            return FALSE;
+        if (__atomic_load_n(&file->gzip_useless, __ATOMIC_RELAXED)) {
+            file_cache_release(file); // not compressed again until the file changes
+            return FALSE;
+        }
+
+        size_t size = file->info.st_size, compressed_size;
+        char *data, *compressed = NULL;
+        if (size > 0 && size <= COMPRESS_MAX_FILE_SIZE && compressed_cache.shard_budget > 0) {
+            data = safe_malloc(size);
+            if (read_open_file(file, data, 0, size))
+                compressed = gzip_compress(data, size, &compressed_size);
+            free(data);
+        }
+        if (compressed == NULL || !content_cache_fits(&compressed_cache, compressed_size)) {
+            __atomic_store_n(&file->gzip_useless, TRUE, __ATOMIC_RELAXED);
+            free(compressed);
+            file_cache_release(file);
+            return FALSE;
+        }
+
+        // weak ETag: the gzip bytes depend on the zlib build, not only on the file
+        char header[MAX_HEADER_SIZE];
+        validators = file->validators;
+        snprintf(validators.etag, ETAG_SIZE, "W/%.*s-gzip\"", (int)strlen(file->validators.etag) - 1, file->validators.etag);
+        validators.varies = TRUE;
+        size_t header_length = render_content_header(header, file->mime, compressed_size, "gzip", &validators);
+        write_log(NULL, "Compressed '%s' from " SIZE_T_FORMAT " to " SIZE_T_FORMAT " bytes.", path, size, compressed_size);
+        cached = content_cache_insert(&compressed_cache, path, ENCODING_GZIP, compressed, compressed_size, &file->info, header, header_length, &validators);
+        file_cache_release(file);
+        send_cached_content(conn, cached);
+        return TRUE;
+    #else
+        return FALSE;
+    #endif
+}
+
+/* Incremental request parser: looks for the end of the header from where the
+   previous call stopped, then parses the request line and headers in place.
+   Pipelined requests stay in the buffer after request->length. */
+int parse_request(connection_params *conn){
+    http_request *request = &conn->request;
+    char *buffer = conn->buffer;
+    size_t header_end = 0, i;
+
+    if (!conn->header_parsed) {
+        // Skip empty lines between requests
+        while (conn->buffer_scanned == 0 && conn->buffer_used > 0 &&
+               (buffer[0] == '\r' || buffer[0] == '\n')) {
+            memmove(buffer, buffer + 1, --conn->buffer_used);
+        }
+
+        for (i = conn->buffer_scanned; i < conn->buffer_used; i++) {
+            if (buffer[i] != '\n')
+                continue;
+            if ((i >= 1 && buffer[i - 1] == '\n') || (i >= 2 && buffer[i - 1] == '\r' && buffer[i - 2] == '\n')) {
+                header_end = i + 1;
+                break;
+            }
+        }
+        if (header_end == 0) {
+            conn->buffer_scanned = conn->buffer_used;
+            return REQUEST_INCOMPLETE;
+        }
+
+        // Request line: <method> <uri> HTTP/1.<minor>
+        memset(request, 0, sizeof(http_request));
+        char *line = buffer, *line_end, *value;
+        char *end = buffer + header_end;
+        line_end = memchr(line, '\n', end - line);
+        *line_end = '\0';
+        if (line_end > line && line_end[-1] == '\r')
+            line_end[-1] = '\0';
+
+        request->method = line;
+        if ((request->uri = strchr(line, ' ')) == NULL)
+            return REQUEST_INVALID;
+        *request->uri++ = '\0';
+        request->head = strcmp(request->method, "HEAD") == 0;
+        if ((value = strchr(request->uri, ' ')) == NULL || strncmp(value + 1, "HTTP/1.", 7) != 0)
+            return REQUEST_INVALID;
+        *value = '\0';
+        request->version_minor = value[8] == '0' ? 0 : 1;
+        request->keep_alive = request->version_minor >= 1;
+
+        // Headers: <name>:<spaces><value>
+        size_t content_length = 0;
+        for (line = line_end + 1; line < end; line = line_end + 1) {
+            line_end = memchr(line, '\n', end - line);
+            *line_end = '\0';
+            if (line_end > line && line_end[-1] == '\r')
+                line_end[-1] = '\0';
+            if (*line == '\0')
+                break; // end of header
+            if ((value = strchr(line, ':')) == NULL)
+                return REQUEST_INVALID;
+            *value++ = '\0';
+            while (*value == ' ' || *value == '\t')
+                value++;
+
+            if (equals_ignore_case(line, "Connection")) {
+                if (equals_ignore_case(value, "close"))
+                    request->keep_alive = FALSE;
+                else if (equals_ignore_case(value, "keep-alive"))
+                    request->keep_alive = TRUE;
+            } else if (equals_ignore_case(line, "Content-Length")) {
+                content_length = strtoul(value, NULL, 10);
+            }
+            if (request->headers_count < MAX_REQUEST_HEADERS) {
+                request->headers[request->headers_count].name = line;
+                request->headers[request->headers_count].value = value;
+                request->headers_count++;
+            }
+        }
+
+        if (content_length > BUFFER_SIZE - 1 - header_end)
+            return REQUEST_INVALID; // bodies are not served, only skipped
+        request->length = header_end + content_length;
+        conn->header_parsed = TRUE;
+    }
+
+    // Wait for the body so the next pipelined request starts after it
+    return conn->buffer_used >= request->length ? REQUEST_READY : REQUEST_INCOMPLETE;
+}
+
+const char *get_request_header(http_request *request, const char *name){
+    for (int i = 0; i < request->headers_count; i++) {
+        if (equals_ignore_case(request->headers[i].name, name))
+            return request->headers[i].value;
+    }
+    return NULL;
+}
+
+void init_token_bucket(token_bucket *bucket, uint64_t rate){
+    bucket->rate = rate;
+    bucket->burst = rate * SHAPING_BURST_MS / 1000;
+    if (bucket->burst < SHAPING_MIN_BURST)
+        bucket->burst = SHAPING_MIN_BURST;
+    bucket->tokens = bucket->burst;
+    bucket->refilled_at = get_time_usec();
+}
+
+/* Refill the bucket for the time elapsed and take up to wanted bytes from it,
+   nothing when less than SHAPING_MIN_SEND of them is left */
+size_t token_bucket_take(token_bucket *bucket, size_t wanted, uint64_t now){
+    if (bucket->rate == 0)
+        return wanted;
+    if (now > bucket->refilled_at) {
+        uint64_t elapsed = now - bucket->refilled_at;
+        uint64_t refill = (elapsed < 1000000 ? elapsed : 1000000) * bucket->rate / 1000000; // a full bucket past a second
+        if (refill > 0) {
+            bucket->tokens += refill;
+            if (bucket->tokens >= bucket->burst) {
+                bucket->tokens = bucket->burst;
+                bucket->refilled_at = now;
+            } else {
+                bucket->refilled_at += (refill * 1000000 + bucket->rate - 1) / bucket->rate; // keep the fraction of a token
+            }
+        }
+    }
+    if (bucket->tokens < wanted && bucket->tokens < SHAPING_MIN_SEND)
+        return 0; // no tiny sends, wait for a few ticks of tokens
+    if (wanted > bucket->tokens)
+        wanted = bucket->tokens;
+    bucket->tokens -= wanted;
+    return wanted;
+}
+
+/* Give back tokens taken but not sent */
+void token_bucket_give(token_bucket *bucket, size_t unused){
+    if (bucket->rate == 0)
+        return;
+    bucket->tokens += unused;
+    if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+}
+
+void init_shaping(uint64_t connection_rate, uint64_t total_rate){
+    shaping.connection_rate = connection_rate;
+    init_token_bucket(&shaping.total, total_rate);
+    mutex_init(&shaping.lock);
+    if (connection_rate > 0 || total_rate > 0)
+        write_log(NULL, "Bandwidth: %llu kb/s per connection, %llu kb/s in total (0 = no limit).",
+                  (unsigned long long)(connection_rate / 1024), (unsigned long long)(total_rate / 1024));
+}
+
+/* File bytes the connection may send now, at most wanted. 0 when one of the
+   buckets is empty: the response then yields until the next tick. */
+size_t shaping_take(connection_params *conn, size_t wanted){
+    if ((shaping.connection_rate == 0 && shaping.total.rate == 0) || (size_t)conn->response.file->info.st_size < SHAPED_FILE_SIZE)
+        return wanted;
+    uint64_t now = get_time_usec();
+    size_t granted = token_bucket_take(&conn->bandwidth, wanted, now);
+    if (granted > 0 && shaping.total.rate > 0) {
+        mutex_lock(&shaping.lock);
+        size_t total_granted = token_bucket_take(&shaping.total, granted, now);
+        mutex_unlock(&shaping.lock);
+        token_bucket_give(&conn->bandwidth, granted - total_granted);
+        granted = total_granted;
+    }
+    return granted;
+}
+
+void shaping_return(connection_params *conn, size_t unused){
+    if (unused == 0 || (shaping.connection_rate == 0 && shaping.total.rate == 0) || (size_t)conn->response.file->info.st_size < SHAPED_FILE_SIZE)
+        return;
+    token_bucket_give(&conn->bandwidth, unused);
+    if (shaping.total.rate > 0) {
+        mutex_lock(&shaping.lock);
+        token_bucket_give(&shaping.total, unused);
+        mutex_unlock(&shaping.lock);
+    }
+}
+
+void init_admission(){
+    const char *body = "Server busy, retry later.\n";
+    admission.busy_response_length = snprintf(admission.busy_response, sizeof(admission.busy_response),
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Retry-After: %d\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: "SIZE_T_FORMAT"\r\n"
+        "Connection: close\r\n\r\n%s", retry_after, strlen(body), body);
+    if (admission.max_per_ip > 0) {
+        admission.per_ip = safe_malloc(ADMISSION_IP_SLOTS * sizeof(uint32_t));
+        memset(admission.per_ip, 0, ADMISSION_IP_SLOTS * sizeof(uint32_t));
+    }
+    if (admission.max_connections > 0 || admission.max_per_ip > 0)
+        write_log(NULL, "Admission: %u connections, %u per address (0 = no limit).", admission.max_connections, admission.max_per_ip);
+}
+
+/* Count a new connection against the limits. Returns ADMITTED, with the per
+   address slot to release on close, or the reason of the rejection. */
+int admit_connection(uint32_t address, int32_t *slot){
+    *slot = -1;
+    if (__atomic_add_fetch(&admission.connections, 1, __ATOMIC_RELAXED) > admission.max_connections && admission.max_connections > 0) {
+        __atomic_sub_fetch(&admission.connections, 1, __ATOMIC_RELAXED);
+        return REJECT_CONNECTIONS;
+    }
+    if (admission.per_ip != NULL) {
+        int32_t index = (uint32_t)(address * 2654435761u) >> 16; // ADMISSION_IP_SLOTS = 2^16
+        if (__atomic_add_fetch(&admission.per_ip[index], 1, __ATOMIC_RELAXED) > admission.max_per_ip) {
+            __atomic_sub_fetch(&admission.per_ip[index], 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&admission.connections, 1, __ATOMIC_RELAXED);
+            return REJECT_PER_IP;
+        }
+        *slot = index;
+    }
+    return ADMITTED;
+}
+
+void release_admission(int32_t slot){
+    __atomic_sub_fetch(&admission.connections, 1, __ATOMIC_RELAXED);
+    if (slot >= 0)
+        __atomic_sub_fetch(&admission.per_ip[slot], 1, __ATOMIC_RELAXED);
+}
+
+/* Send the prerendered 503 to a shed connection, the caller closes it. The
+   request already received is read first, so the close is not a reset that
+   could discard the 503 on the client side. */
+void reject_connection(SocketType socket, int reason){
+    metric_add(get_thread_metrics()->rejected[reason], 1);
+    write_log("info", "[%d] Over the %s limit, 503 sent.", socket, REJECT_NAMES[reason]);
+    send(socket, admission.busy_response, admission.busy_response_length, SEND_D_FLAG);
+    #ifdef __linux__
+        char discard[1024];
+        for (int i = 0; i < REJECT_DRAIN_READS && recv(socket, discard, sizeof(discard), MSG_DONTWAIT) > 0; i++);
+        shutdown(socket, SHUT_WR);
+    #endif
+}
+
+void init_buffer_pool(buffer_pool *pool){
+    memset(pool, 0, sizeof(buffer_pool));
+    mutex_init(&pool->lock);
+}
+
+/* A BUFFER_SIZE buffer, reused when one is free. Its content is not cleared. */
+char *buffer_pool_get(buffer_pool *pool){
+    char *buffer;
+    mutex_lock(&pool->lock);
+    if ((buffer = pool->free_list) != NULL) {
+        pool->free_list = *(char **)buffer;
+        pool->free_count--;
+    }
+    pool->in_use++;
+    mutex_unlock(&pool->lock);
+    return buffer != NULL ? buffer : safe_malloc(BUFFER_SIZE);
+}
+
+/* Keep the buffer for the next checkout, up to BUFFER_POOL_MAX_FREE of them */
+void buffer_pool_put(buffer_pool *pool, char *buffer){
+    mutex_lock(&pool->lock);
+    pool->in_use--;
+    if (pool->free_count < BUFFER_POOL_MAX_FREE) {
+        *(char **)buffer = pool->free_list;
+        pool->free_list = buffer;
+        pool->free_count++;
+        buffer = NULL;
+    }
+    mutex_unlock(&pool->lock);
+    free(buffer);
+}
+
+/* An idle connection (nothing buffered) waits for its next request without a buffer */
+void release_connection_buffer(connection_params *conn){
+    if (conn->buffer != NULL && conn->buffer_used == 0) {
+        buffer_pool_put(&io_buffers, conn->buffer);
+        conn->buffer = NULL;
+    }
+}
+
+/* Drop the served request from the buffer, keeping pipelined data after it */
+void finish_request(connection_params *conn){
+    size_t leftover = conn->buffer_used - conn->request.length;
+    if (leftover > 0)
+        memmove(conn->buffer, conn->buffer + conn->request.length, leftover);
+    conn->buffer_used = leftover;
+    conn->buffer_scanned = 0;
+    conn->header_parsed = FALSE;
+    conn->request_started_at = 0;
+    memset(&conn->request, 0, sizeof(http_request));
+    release_response(&conn->response);
+    conn->state = CONN_READING_REQUEST;
+}
+
+connection_params *new_connection(SocketType socket, connection_params *server_conf, int32_t admission_slot){
+    connection_params *conn = safe_malloc(sizeof(connection_params));
+    memset(conn, 0, sizeof(connection_params));
+    conn->socket = socket;
+    conn->admission_slot = admission_slot;
+    init_token_bucket(&conn->bandwidth, shaping.connection_rate);
+    metric_add(get_thread_metrics()->connections_opened, 1);
+    conn->default_route = server_conf->default_route;
+    conn->folder_to_serve = server_conf->folder_to_serve;
+    conn->show_explorer = server_conf->show_explorer;
+    conn->state = CONN_READING_REQUEST;
+    conn->buffer = NULL; // checked out of io_buffers on the first read
+    return conn;
+}
+
+void close_connection(connection_params *conn){
+    watch_connection(conn, DEADLINE_NONE); // never shut down a reused socket
+    release_admission(conn->admission_slot);
+    metric_add(get_thread_metrics()->connections_closed, 1);
+    release_response(&conn->response);
+    close_socket(conn->socket);
+    if (conn->buffer != NULL)
+        buffer_pool_put(&io_buffers, conn->buffer);
+    free(conn);
+}
+
+void init_timer_wheel(timer_wheel *wheel){
+    memset(wheel, 0, sizeof(timer_wheel));
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+            wheel->slots[level][slot].prev = wheel->slots[level][slot].next = &wheel->slots[level][slot];
+    }
+    wheel->started_at = get_time_usec();
+    mutex_init(&wheel->lock);
+}
+
+/* Current tick of the wheel clock */
+uint64_t timer_wheel_clock(timer_wheel *wheel){
+    return (get_time_usec() - wheel->started_at) / (TIMER_TICK_MS * 1000);
+}
+
+/* Link the entry to the slot of its expiry: level 0 for the next 64 ticks,
+   then the level whose span covers the distance. Expects expires >= now. */
+void timer_wheel_insert(timer_wheel *wheel, timer_entry *entry){
+    uint64_t range = (uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+    uint64_t delta = entry->expires - wheel->now;
+    int level = 0;
+
+    if (delta >= range) {
+        entry->expires = wheel->now + range - 1;
+        delta = range - 1;
+    }
+    while (delta >> (TIMER_WHEEL_BITS * (level + 1)))
+        level++;
+    timer_entry *head = &wheel->slots[level][(entry->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+void timer_wheel_unlink(timer_entry *entry){
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+/* Process every tick up to the given one: the upper level slots reached are
+   cascaded to the levels below, then the level 0 slot of the tick expires */
+void timer_wheel_advance(timer_wheel *wheel, uint64_t tick){
+    timer_entry *head, *entry;
+    if (wheel->count == 0 && tick > wheel->now)
+        wheel->now = tick; // nothing to expire on the way
+    while (wheel->now < tick) {
+        uint64_t now = ++wheel->now;
+        for (int level = 1; level < TIMER_WHEEL_LEVELS && (now & (((uint64_t)1 << (TIMER_WHEEL_BITS * level)) - 1)) == 0; level++) {
+            head = &wheel->slots[level][(now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+            while ((entry = head->next) != head) {
+                timer_wheel_unlink(entry);
+                timer_wheel_insert(wheel, entry);
+            }
+        }
+        head = &wheel->slots[0][now & TIMER_WHEEL_MASK];
+        while ((entry = head->next) != head) {
+            timer_wheel_unlink(entry);
+            wheel->count--;
+            if (entry->kind == DEADLINE_THROTTLE) {
+                // resumed once the lock is released
+                entry->kind = DEADLINE_NONE;
+                entry->next = wheel->resumed;
+                wheel->resumed = entry;
+            } else {
+                expire_connection(entry);
+            }
+        }
+    }
+}
+
+/* Expire the connection deadlines passed since the last call */
+void expire_connection_timers(){
+    mutex_lock(&connection_timers.lock);
+    timer_wheel_advance(&connection_timers, timer_wheel_clock(&connection_timers));
+    timer_entry *resumed = connection_timers.resumed;
+    connection_timers.resumed = NULL;
+    mutex_unlock(&connection_timers.lock);
+
+    while (resumed != NULL) {
+        timer_entry *entry = resumed;
+        resumed = entry->next;
+        entry->next = NULL;
+        resume_connection((connection_params *)((char *)entry - offsetof(connection_params, timer)));
+    }
+}
+
+/* A deadline passed: shut the socket down, the thread or loop owning the
+   connection then reads the end of the stream (or fails its send) and closes it */
+void expire_connection(timer_entry *entry){
+    connection_params *conn = (connection_params *)((char *)entry - offsetof(connection_params, timer));
+    write_log(NULL, "[%d] No progress before the %s timeout, closing.", conn->socket, DEADLINE_NAMES[entry->kind]);
+    metric_add(get_thread_metrics()->timeouts[entry->kind], 1);
+    __atomic_store_n(&entry->kind, DEADLINE_NONE, __ATOMIC_RELAXED);
+    shutdown(conn->socket, SHUT_RDWR);
+}
+
+/* Arm the deadline of the connection state in place of the previous one. Idle
+   and header deadlines count from their first wait, a send deadline restarts on
+   every call. The single thread build has no wheel: the deadline is only
+   stored and checked by connection_expired. */
+void watch_connection(connection_params *conn, int8_t kind){
+    if (deadline_seconds[kind] <= 0)
+        kind = DEADLINE_NONE;
+    if (kind != DEADLINE_SEND && __atomic_load_n(&conn->timer.kind, __ATOMIC_RELAXED) == kind)
+        return;
+    set_connection_timer(conn, kind, (uint64_t)deadline_seconds[kind] * 1000 / TIMER_TICK_MS);
+}
+
+/* Park a throttled response until the next tick, it holds no thread meanwhile */
+void throttle_connection(connection_params *conn){
+    set_connection_timer(conn, DEADLINE_THROTTLE, 1);
+}
+
+/* Arm the timer of the connection in ticks from now, in place of the previous one */
+void set_connection_timer(connection_params *conn, int8_t kind, uint64_t ticks){
+    timer_entry *timer = &conn->timer;
+    uint64_t expires = timer_wheel_clock(&connection_timers) + ticks;
+    mutex_lock(&connection_timers.lock);
+    #ifdef MULTITHREAD_ON
+        if (timer->kind != DEADLINE_NONE) {
+            timer_wheel_unlink(timer);
+            connection_timers.count--;
+        }
+        if (kind != DEADLINE_NONE) {
+            timer->expires = expires > connection_timers.now ? expires : connection_timers.now + 1;
+            timer_wheel_insert(&connection_timers, timer);
+            connection_timers.count++;
+        }
+    #else
+        timer->expires = expires;
+    #endif
+    __atomic_store_n(&timer->kind, kind, __ATOMIC_RELAXED);
+    mutex_unlock(&connection_timers.lock);
+}
+
+/* A throttled connection got new bandwidth: hand it back to its event loop,
+   or to a pool thread with its send deadline armed again */
+void resume_connection(connection_params *conn){
+    #ifdef EPOLL_ON
+        #ifdef IO_URING_ON
+            if (use_io_uring) {
+                uring_advance(conn);
+                return;
+            }
+        #endif
+        if (!drive_connection(conn))
+            close_connection(conn);
+    #elif defined(MULTITHREAD_ON)
+        watch_connection(conn, DEADLINE_SEND);
+        backlog_connection(&resumed_backlog, conn); // queued by the timer thread after this pass, or on a later tick
+    #else
+        (void)conn; // no timer wheel, a single thread waits for its tokens
+    #endif
+}
+
+int connection_expired(connection_params *conn){
+    return conn->timer.kind != DEADLINE_NONE && timer_wheel_clock(&connection_timers) >= conn->timer.expires;
+}
+
+/* Response bytes handed to the socket so far */
+size_t response_progress(http_response *response){
+    return response->header_sent + response->shared_header_sent + response->body_sent + response->file_offset;
+}
+
+/* Counters of the calling thread, registered on first use */
+thread_metrics *get_thread_metrics(){
+    #ifdef MULTITHREAD_ON
+        thread_metrics *metrics = thread_metrics_slot;
+        if (metrics == NULL) {
+            metrics = safe_malloc(sizeof(thread_metrics));
+            memset(metrics, 0, sizeof(thread_metrics));
+            pthread_mutex_lock(&metrics_list_lock);
+            metrics->next = metrics_list;
+            __atomic_store_n(&metrics_list, metrics, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&metrics_list_lock);
+            thread_metrics_slot = metrics;
+        }
+        return metrics;
+    #else
+        metrics_list = &main_thread_metrics;
+        return &main_thread_metrics;
+    #endif
+}
+
+/* Sum the counters of every thread. The slots are never freed and every field
+   before next is an uint64_t counter. */
+void collect_metrics(thread_metrics *total){
+    memset(total, 0, sizeof(thread_metrics));
+    for (thread_metrics *metrics = __atomic_load_n(&metrics_list, __ATOMIC_ACQUIRE); metrics != NULL; metrics = metrics->next) {
+        uint64_t *source = (uint64_t *)metrics, *target = (uint64_t *)total;
+        for (size_t i = 0; i < offsetof(thread_metrics, next) / sizeof(uint64_t); i++)
+            target[i] += __atomic_load_n(&source[i], __ATOMIC_RELAXED);
+    }
+}
+
+/* Count a sent response by status code and observe its latency */
+void record_response_metrics(connection_params *conn){
+    thread_metrics *metrics = get_thread_metrics();
+    http_response *response = &conn->response;
+    int status = response->header_length > 12 ? atoi(response->header + 9) : 0; // "HTTP/1.1 200"
+    int index = 0, bucket = 0;
+
+    while (index < METRICS_STATUS_CODES_COUNT - 1 && METRICS_STATUS_CODES[index] != status)
+        index++;
+    metric_add(metrics->responses[index], 1);
+    if (conn->request_started_at == 0)
+        return;
+    uint64_t latency = get_time_usec() - conn->request_started_at;
+    while (bucket < METRICS_LATENCY_BUCKETS - 1 && latency > METRICS_LATENCY_BOUNDS[bucket])
+        bucket++;
+    metric_add(metrics->latency_buckets[bucket], 1);
+    metric_add(metrics->latency_sum_usec, latency);
+}
+
+/* Prometheus text exposition of this process */
+void send_metrics_response(connection_params *conn){
+    http_response *response = &conn->response;
+    string_builder text = {0};
+    thread_metrics total;
+    uint64_t cumulative = 0;
+
+    collect_metrics(&total);
+    string_builder_printf(&text,
+        "# HELP tinyc_requests_total Requests received.\n"
+        "# TYPE tinyc_requests_total counter\n"
+        "tinyc_requests_total %llu\n"
+        "# HELP tinyc_responses_total Responses sent by status code.\n"
+        "# TYPE tinyc_responses_total counter\n", (unsigned long long)total.requests);
+    for (int i = 0; i < METRICS_STATUS_CODES_COUNT; i++) {
+        if (i < METRICS_STATUS_CODES_COUNT - 1)
+            string_builder_printf(&text, "tinyc_responses_total{code=\"%d\"} %llu\n", METRICS_STATUS_CODES[i], (unsigned long long)total.responses[i]);
+        else
+            string_builder_printf(&text, "tinyc_responses_total{code=\"other\"} %llu\n", (unsigned long long)total.responses[i]);
+    }
+    string_builder_printf(&text,
+        "# HELP tinyc_sent_bytes_total Bytes written to the sockets.\n"
+        "# TYPE tinyc_sent_bytes_total counter\n"
+        "tinyc_sent_bytes_total %llu\n"
+        "# HELP tinyc_connections_total Accepted connections.\n"
+        "# TYPE tinyc_connections_total counter\n"
+        "tinyc_connections_total %llu\n"
+        "# HELP tinyc_connections_active Open connections.\n"
+        "# TYPE tinyc_connections_active gauge\n"
+        "tinyc_connections_active %lld\n"
+        "# HELP tinyc_request_duration_seconds Time from a complete request to its last byte sent.\n"
+        "# TYPE tinyc_request_duration_seconds histogram\n",
+        (unsigned long long)total.bytes_sent, (unsigned long long)total.connections_opened,
+        (long long)(total.connections_opened - total.connections_closed));
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+        cumulative += total.latency_buckets[i];
+        if (i < METRICS_LATENCY_BUCKETS - 1)
+            string_builder_printf(&text, "tinyc_request_duration_seconds_bucket{le=\"%g\"} %llu\n",
+                                  METRICS_LATENCY_BOUNDS[i] / 1e6, (unsigned long long)cumulative);
+        else
+            string_builder_printf(&text, "tinyc_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+    }
+    string_builder_printf(&text,
+        "tinyc_request_duration_seconds_sum %.6f\n"
+        "tinyc_request_duration_seconds_count %llu\n",
+        total.latency_sum_usec / 1e6, (unsigned long long)cumulative);
+
+    string_builder_printf(&text,
+        "# HELP tinyc_timeouts_total Connections closed by a deadline.\n"
+        "# TYPE tinyc_timeouts_total counter\n");
+    for (int i = DEADLINE_IDLE; i <= DEADLINE_SEND; i++)
+        string_builder_printf(&text, "tinyc_timeouts_total{deadline=\"%s\"} %llu\n", DEADLINE_NAMES[i], (unsigned long long)total.timeouts[i]);
+
+    string_builder_printf(&text,
+        "# HELP tinyc_mapped_bytes Bytes of the files served from a shared mmap.\n"
+        "# TYPE tinyc_mapped_bytes gauge\n"
+        "tinyc_mapped_bytes %llu\n"
+        "# HELP tinyc_mapped_files Files served from a shared mmap.\n"
+        "# TYPE tinyc_mapped_files gauge\n"
+        "tinyc_mapped_files %llu\n",
+        (unsigned long long)__atomic_load_n(&file_maps.bytes, __ATOMIC_RELAXED), (unsigned long long)__atomic_load_n(&file_maps.files, __ATOMIC_RELAXED));
+
+    string_builder_printf(&text,
+        "# HELP tinyc_sequential_ranges_total File bodies continuing where a recent one of the same file ended.\n"
+        "# TYPE tinyc_sequential_ranges_total counter\n"
+        "tinyc_sequential_ranges_total %llu\n", (unsigned long long)total.sequential_ranges);
+
+    string_builder_printf(&text,
+        "# HELP tinyc_throttled_total File sends postponed to the next tick by the bandwidth limits.\n"
+        "# TYPE tinyc_throttled_total counter\n"
+        "tinyc_throttled_total %llu\n", (unsigned long long)total.throttled);
+
+    string_builder_printf(&text,
+        "# HELP tinyc_rejected_connections_total Connections shed with a 503 by admission control.\n"
+        "# TYPE tinyc_rejected_connections_total counter\n");
+    for (int i = 0; i < REJECT_REASONS; i++)
+        string_builder_printf(&text, "tinyc_rejected_connections_total{reason=\"%s\"} %llu\n", REJECT_NAMES[i], (unsigned long long)total.rejected[i]);
+
+    string_builder_printf(&text,
+        "# HELP tinyc_cache_hits_total Memory cache lookups that hit.\n"
+        "# TYPE tinyc_cache_hits_total counter\n");
+    for (int i = 0; i < memory_caches_count; i++)
+        string_builder_printf(&text, "tinyc_cache_hits_total{cache=\"%s\"} %llu\n", memory_caches[i]->name, (unsigned long long)total.cache_hits[i]);
+    string_builder_printf(&text,
+        "# HELP tinyc_cache_misses_total Memory cache lookups that missed.\n"
+        "# TYPE tinyc_cache_misses_total counter\n");
+    for (int i = 0; i < memory_caches_count; i++)
+        string_builder_printf(&text, "tinyc_cache_misses_total{cache=\"%s\"} %llu\n", memory_caches[i]->name, (unsigned long long)total.cache_misses[i]);
+    string_builder_printf(&text,
+        "# HELP tinyc_cache_evictions_total Memory cache entries evicted.\n"
+        "# TYPE tinyc_cache_evictions_total counter\n");
+    for (int i = 0; i < memory_caches_count; i++)
+        string_builder_printf(&text, "tinyc_cache_evictions_total{cache=\"%s\"} %llu\n", memory_caches[i]->name,
+                              (unsigned long long)__atomic_load_n(&memory_caches[i]->evictions, __ATOMIC_RELAXED));
+    string_builder_printf(&text,
+        "# HELP tinyc_cache_bytes Bytes held by the memory caches.\n"
+        "# TYPE tinyc_cache_bytes gauge\n");
+    for (int i = 0; i < memory_caches_count; i++) {
+        size_t bytes = 0;
+        for (int j = 0; j < CACHE_SHARDS; j++)
+            bytes += __atomic_load_n(&memory_caches[i]->shards[j].bytes, __ATOMIC_RELAXED);
+        string_builder_printf(&text, "tinyc_cache_bytes{cache=\"%s\"} " SIZE_T_FORMAT "\n", memory_caches[i]->name, bytes);
+    }
+
+    mutex_lock(&io_buffers.lock);
+    size_t buffers_in_use = io_buffers.in_use, buffers_free = io_buffers.free_count;
+    mutex_unlock(&io_buffers.lock);
+    string_builder_printf(&text,
+        "# HELP tinyc_io_buffers Request buffers checked out by connections, and kept free for reuse.\n"
+        "# TYPE tinyc_io_buffers gauge\n"
+        "tinyc_io_buffers{state=\"in_use\"} " SIZE_T_FORMAT "\n"
+        "tinyc_io_buffers{state=\"free\"} " SIZE_T_FORMAT "\n", buffers_in_use, buffers_free);
+
+    #if defined(MULTITHREAD_ON) && !defined(EPOLL_ON)
+        string_builder_printf(&text,
+            "# HELP tinyc_pool_threads Worker threads of the pool.\n"
+            "# TYPE tinyc_pool_threads gauge\n"
+            "tinyc_pool_threads %d\n"
+            "# HELP tinyc_pool_busy_threads Worker threads serving a connection.\n"
+            "# TYPE tinyc_pool_busy_threads gauge\n"
+            "tinyc_pool_busy_threads %llu\n"
+            "# HELP tinyc_queue_depth Accepted connections waiting for a thread.\n"
+            "# TYPE tinyc_queue_depth gauge\n"
+            "tinyc_queue_depth %llu\n"
+            "# HELP tinyc_queue_max_depth Deepest the accept queue has been.\n"
+            "# TYPE tinyc_queue_max_depth gauge\n"
+            "tinyc_queue_max_depth %llu\n"
+            "# HELP tinyc_queue_wait_seconds_total Time connections waited for a thread.\n"
+            "# TYPE tinyc_queue_wait_seconds_total counter\n"
+            "tinyc_queue_wait_seconds_total %.6f\n"
+            "# HELP tinyc_queue_max_wait_seconds Longest a connection has waited for a thread.\n"
+            "# TYPE tinyc_queue_max_wait_seconds gauge\n"
+            "tinyc_queue_max_wait_seconds %.6f\n"
+            "# HELP tinyc_queue_dequeued_total Connections handed to a thread.\n"
+            "# TYPE tinyc_queue_dequeued_total counter\n"
+            "tinyc_queue_dequeued_total %llu\n",
+            pool_threads, (unsigned long long)total.busy,
+            (unsigned long long)__atomic_load_n(&pool_stats.queue_depth, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&pool_stats.max_queue_depth, __ATOMIC_RELAXED),
+            __atomic_load_n(&pool_stats.total_wait_usec, __ATOMIC_RELAXED) / 1e6,
+            __atomic_load_n(&pool_stats.max_wait_usec, __ATOMIC_RELAXED) / 1e6,
+            (unsigned long long)__atomic_load_n(&pool_stats.dequeued, __ATOMIC_RELAXED));
+    #endif
+    #ifdef __linux__
+        string_builder_printf(&text,
+            "# HELP tinyc_path_index_entries Paths of the served tree held in memory.\n"
+            "# TYPE tinyc_path_index_entries gauge\n"
+            "tinyc_path_index_entries " SIZE_T_FORMAT "\n"
+            "# HELP tinyc_worker Prefork worker answering the scrape (-1 without --workers).\n"
+            "# TYPE tinyc_worker gauge\n"
+            "tinyc_worker %d\n",
+            __atomic_load_n(&served_index.count, __ATOMIC_RELAXED), worker_index);
+    #endif
+    string_builder_printf(&text,
+        "# HELP tinyc_start_time_seconds Start time of the process since the epoch.\n"
+        "# TYPE tinyc_start_time_seconds gauge\n"
+        "tinyc_start_time_seconds %lld\n", (long long)server_started_at);
+
+    response->header_length = render_status_line(response->header, "200 OK");
+    response->header_length += sprintf(response->header + response->header_length,
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Cache-Control: no-store\r\n"
+        "Content-Length: " SIZE_T_FORMAT "\r\n\r\n", text.length);
+    response->owned_body = text.data; // released with the response
+    response->body = text.data;
+    response->body_length = text.length;
+}
+
+#ifdef __linux__
+    /* Copy the process totals into its --workers slot for the master, at most
+       once per second */
+    void publish_worker_stats(){
+        thread_metrics total;
+        time_t now = time(NULL);
+        if (worker_index < 0 || now == worker_stats_published_at)
+            return;
+        worker_stats_published_at = now;
+        collect_metrics(&total);
+        __atomic_store_n(&server_stats->connections, total.connections_opened, __ATOMIC_RELAXED);
+        __atomic_store_n(&server_stats->requests, total.requests, __ATOMIC_RELAXED);
+        __atomic_store_n(&server_stats->bytes_sent, total.bytes_sent, __ATOMIC_RELAXED);
+    }
+#endif
+
+/* Queue the response of the parsed request */
+void handle_request(connection_params *conn){
+    char file_path[MAX_PATH_LENGTH] = {0};
+    http_request *request = &conn->request;
+    int8_t in_folder = TRUE; // Only serve files into specific folder
+    path_entry indexed;
+    size_t file_size;
+    byte_range ranges[MAX_RANGES];
+    int ranges_count = RANGE_IGNORED;
+
+    release_response(&conn->response);
+    conn->state = CONN_SENDING_HEADER;
+
+    // Extract URI from the request
+    size_t uri_length = strlen(request->uri);
+    if(uri_length == 0 || uri_length >= MAX_PATH_LENGTH){
+        write_log("error", "URI too long or invalid.");
+        send_414_response(conn);
+        return;
+    }
+    memcpy(file_path, request->uri, uri_length + 1);
+
+    decode_url(file_path);
+
+    if(strcmp(file_path, "/test")==0){
+        send_200_response(conn);
+        return;
+    }
+
+    if(metrics_enabled && strcmp(file_path, "/metrics")==0){
+        send_metrics_response(conn);
+        return;
+    }
+
+    write_log(NULL, "Handling route: %s", file_path);
+
+    // Check if uri path == '/' and redirect to default route
+    if(strcmp(file_path, "/") == 0 && conn->default_route != NULL){
+        write_log("info", "Redirecting to %s", conn->default_route);
+        send_302_response(conn, conn->default_route);
+        return;
+    }
+    
+    remove_slash_from_start(file_path);
+
+    // Resolve the dot segments, nothing above the working directory is reachable
+    if(!normalize_path(file_path)){
+        write_log("error", "Path '%s' escapes the served folder.", request->uri);
+        send_404_response(conn);
+        return;
+    }
+
+    #if defined(__linux__) && !defined(MULTITHREAD_ON)
+        path_index_sync(); // no watcher thread
+    #endif
+
+    // The index only holds the served folder, a lookup answers both questions
+    int path_state = path_index_lookup(file_path, &indexed);
+    if(path_state == PATH_UNKNOWN && conn->folder_to_serve != NULL)
+        in_folder = path_in_folder(file_path, conn->folder_to_serve);
+    if(path_state == PATH_MISSING || !in_folder){
+        write_log("error", "The path '%s' is not served.", file_path);
+        send_404_response(conn);
+        return;
+    }
+
+    /* =====================================  */
+    /* =======      File explorer      =====  */
+    /* =====================================  */
+    size_t path_len = strlen(file_path);
+    char current_path[EXPLORER_MAX_FILENAME_LENGTH] = {0};
+
+    if(conn->show_explorer == TRUE &&
+        ((path_len > 0 && file_path[path_len - 1] == '/') || strcmp(file_path, "") == 0)){
+        // get current path
+        snprintf(current_path, sizeof(current_path), "./%s", file_path);
+        write_log(NULL, "[%d] Explorer opened for '%s'", conn->socket, current_path);
+        send_dir_listing(conn, current_path, file_path);
+        return;
+    }
+
+    if(path_state == PATH_FOUND && indexed.is_dir){
+        send_404_response(conn);
+        return;
+    }
+
+    // Check if the request is has a "range" header
+    const char* range_header = get_request_header(request, "Range");
+    if (range_header != NULL && strncmp(range_header, "bytes=", 6) != 0)
+        range_header = NULL;
+
+    // Compressed variants for the clients that accept them
+    int8_t encodings = get_accepted_encodings(get_request_header(request, "Accept-Encoding"));
+    if (range_header == NULL && encodings != 0 && get_filename_compressible(file_path) &&
+        send_encoded_content(conn, file_path, encodings))
+        return;
+
+    // Small hot files are served from memory
+    cache_entry *cached = NULL;
+    if (range_header == NULL && (cached = content_cache_get(&content_cache, file_path, ENCODING_IDENTITY)) != NULL) {
+        send_cached_content(conn, cached);
+        return;
+    }
+
+    // Open the file (shared handle with cached metadata)
+    write_log(NULL, "Finding for '%s' file..", file_path);
+    open_file *file = file_cache_open(file_path);
+
+    // If file is not found send a 404
+    if (file == NULL) {
+        write_log("error", "The file '%s' could not be opened/found.", file_path);
+        send_404_response(conn);
+        return;
+    }
+
+    // Serve the file
+    file_size = file->info.st_size;
+    write_log(NULL, "File size: "SIZE_T_FORMAT, file_size);
+
+    // Extract ranges to stream, unless If-Range says the client copy is outdated
+    if (range_header != NULL && if_range_matches(request, &file->validators))
+        ranges_count = parse_range_header(range_header, file_size, ranges);
+    if (ranges_count != RANGE_IGNORED) {
+        write_log(NULL, "Range detected: %d satisfiable range(s).", ranges_count);
+        send_partial_content(
+            conn,
+            file, 
+            file->mime, 
+            file_size,
+            ranges, 
+            ranges_count);
+    }else if((cached = content_cache_put(&content_cache, file_path, ENCODING_IDENTITY, file, file->mime,
+                                         file->mime->compressible ? "identity" : NULL, &file->validators)) != NULL){
+        file_cache_release(file);
+        send_cached_content(conn, cached);
+    }else{ 
+        send_content(
+            conn,
+            file,
+            file->mime,
+            file_size,
+            file->mime->compressible ? "identity" : NULL,
+            &file->validators);
+    }
+}
+
+/* Parse the buffered request and queue its response (or the 400/414 error).
+   Returns FALSE when the request is incomplete and more data must be read. */
+int prepare_response(connection_params *conn){
+    int parsed = parse_request(conn);
+    if(parsed != REQUEST_INCOMPLETE || conn->buffer_used >= BUFFER_SIZE - 1)
+        conn->request_started_at = get_time_usec();
+    if(parsed == REQUEST_INCOMPLETE && conn->buffer_used >= BUFFER_SIZE - 1){
+        write_log("error", "[%d] Request header too large.", conn->socket);
+        release_response(&conn->response);
+        send_414_response(conn);
+    } else if(parsed == REQUEST_INCOMPLETE){
+        return FALSE;
+    } else if(parsed == REQUEST_INVALID){
+        release_response(&conn->response);
+        send_400_response(conn);
+    } else {
+        handle_request(conn);
+        if(conn->request.head)
+            omit_response_body(&conn->response);
+        if(!conn->request.keep_alive)
+            conn->response.close_connection = TRUE;
+    }
+    metric_add(get_thread_metrics()->requests, 1);
+    return TRUE;
+}
+
+/* Advance the connection state machine: parse every buffered request, reading
+   more data when needed, and write its response. Returns TRUE when the socket
+   would block (non-blocking mode) and FALSE when the connection must be closed. */
+int drive_connection(connection_params *conn){
+    ssize_t read_bytes;
+    for(;;){
+        if(conn->state == CONN_READING_REQUEST){
+            if(prepare_response(conn)){
+                #ifdef EPOLL_ON
+                    watch_connection(conn, DEADLINE_NONE); // the send deadline is armed when a write would block
+                #else
+                    watch_connection(conn, DEADLINE_SEND); // restarted by write_response on every progress
+                #endif
+            } else {
+                watch_connection(conn, conn->buffer_used == 0 ? DEADLINE_IDLE : DEADLINE_HEADER);
+                if(conn->buffer == NULL)
+                    conn->buffer = buffer_pool_get(&io_buffers);
+                // With the idle poller an idle connection never blocks its thread
+                read_bytes = recv(conn->socket, conn->buffer + conn->buffer_used, BUFFER_SIZE - 1 - conn->buffer_used,
+                                  conn->buffer_used == 0 ? IDLE_RECV_FLAGS : 0);
+                if(read_bytes == 0){
+                    write_log(NULL, "[%d] Connection closed by client.", conn->socket);
+                    return FALSE;
+                } else if(read_bytes < 0){
+                    if(errno == EINTR)
+                        continue;
+                    if(socket_would_block()){
+                        release_connection_buffer(conn); // not kept while idle
+                        return TRUE; // wait for more data
+                    }
+                    socket_error_msg();
+                    write_log("error", "[%d] Error reading content from client socket.", conn->socket);
+                    return FALSE;
+                }
+                conn->buffer_used += read_bytes;
+                #ifndef MULTITHREAD_ON
+                    // No timer thread: a client trickling its header is caught on its next byte
+                    if(connection_expired(conn)){
+                        write_log(NULL, "[%d] No progress before the %s timeout, closing.", conn->socket, DEADLINE_NAMES[conn->timer.kind]);
+                        metric_add(get_thread_metrics()->timeouts[conn->timer.kind], 1);
+                        return FALSE;
+                    }
+                #endif
+                continue;
+            }
+        }
+
+        switch(write_response(conn)){
+            case RESPONSE_PENDING:
+                // resumed on the next EPOLLOUT edge, the send deadline only restarts on progress
+                if(conn->timer.kind != DEADLINE_SEND || response_progress(&conn->response) != conn->send_progress){
+                    conn->send_progress = response_progress(&conn->response);
+                    watch_connection(conn, DEADLINE_SEND);
+                }
+                return TRUE;
+            case RESPONSE_ERROR:
+                write_log("error", "[%d] Error sending response.", conn->socket);
+                return FALSE;
+            case RESPONSE_THROTTLED:
+                #ifdef MULTITHREAD_ON
+                    throttle_connection(conn); // last touch: the wheel may resume it on another thread right away
+                    return CONNECTION_THROTTLED;
+                #else
+                    sleep_ms(TIMER_TICK_MS); // a single thread has nothing to yield to
+                    continue;
+                #endif
+        }
+        record_response_metrics(conn);
+        if(conn->response.close_connection)
+            return FALSE;
+        finish_request(conn);
+    }
+}
+
+/* Blocking read-send loop, used by the single thread and multithread modes */
+void handle_connection(connection_params *conn){
+    /* ====================================== */
+    /* =Read-Send loop between client-server= */
+    /* ====================================== */
+    // At this point, a connection with a client is established and the socket is ready to receive and send requests.
+    // A blocking socket only would block when the receive/send timeout expires.
+    int driven = drive_connection(conn);
+    if(driven == CONNECTION_THROTTLED)
+        return; // resumed by the timer wheel on the next tick
+    #ifdef IDLE_POLLER_ON
+        if(driven && park_connection(conn))
+            return; // idle keep-alive connection, handed back to a thread once readable
+    #endif
+    close_connection(conn);
+}
+
+#ifdef __linux__
+    /* Fork the workers and supervise them: a dead worker is restarted in its
+       slot and the counters of every worker are logged periodically. Only
+       returns in the workers. */
+    void run_workers(int16_t workers){
+        int status;
+        pid_t pid;
+        time_t last_stats = time(NULL);
+
+        worker_stats = mmap(NULL, sizeof(process_stats) * workers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(worker_stats == MAP_FAILED){
+            perror("Error mapping the workers stats.");
+            exit(EXIT_FAILURE);
+        }
+        memset(worker_stats, 0, sizeof(process_stats) * workers);
+        master_pid = getpid();
+        signal(SIGTERM, master_signal_handler);
+        signal(SIGINT, master_signal_handler);
+        signal(SIGCHLD, master_signal_handler); // only wakes the master up
+        write_log(NULL, "Prefork mode: %d workers.", workers);
+
+        for(int16_t i = 0; i < workers; i++)
+            if(spawn_worker(i) == 0)
+                return;
+
+        while(!master_stopping){
+            while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+                int16_t index = 0;
+                while(index < workers && worker_stats[index].pid != pid)
+                    index++;
+                if(index == workers)
+                    continue;
+                if(WIFSIGNALED(status))
+                    write_log("error", "Worker %d (pid %d) killed by signal %d.", index, pid, WTERMSIG(status));
+                else
+                    write_log("error", "Worker %d (pid %d) exited with status %d.", index, pid, WEXITSTATUS(status));
+                worker_stats[index].pid = 0;
+                if(master_stopping)
+                    break;
+                // Do not spin when a worker can't even start (port taken, etc)
+                if(time(NULL) - worker_stats[index].started_at < WORKER_RESTART_DELAY)
+                    sleep(WORKER_RESTART_DELAY);
+                worker_stats[index].restarts++;
+                if(spawn_worker(index) == 0)
+                    return;
+            }
+            if(time(NULL) - last_stats >= WORKER_STATS_INTERVAL){
+                log_workers_stats(workers);
+                last_stats = time(NULL);
+            }
+            sleep(1); // interrupted by SIGCHLD
+        }
+
+        // Stop: forward the signal and wait for every worker
+        for(int16_t i = 0; i < workers; i++)
+            if(worker_stats[i].pid > 0)
+                kill(worker_stats[i].pid, SIGTERM);
+        while(wait(NULL) > 0 || errno == EINTR);
+        log_workers_stats(workers);
+        write_log(NULL, "Master stopped.");
+        close_log_file();
+        exit(EXIT_SUCCESS);
+    }
+
+    /* Fork the worker of a slot. Returns 0 in the worker, its pid (or -1) in the master. */
+    pid_t spawn_worker(int16_t index){
+        // Nothing buffered may be inherited, or it would be written twice
+        fflush(stdout);
+        if(log_file != NULL)
+            fflush(log_file);
+
+        pid_t pid = fork();
+        if(pid < 0){
+            write_log("error", "fork failed: '%s'", strerror(errno));
+            return pid;
+        }
+        if(pid == 0){
+            signal(SIGTERM, SIG_DFL);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGCHLD, SIG_DFL);
+            prctl(PR_SET_PDEATHSIG, SIGTERM); // never outlive the master
+            if(getppid() != master_pid)
+                exit(EXIT_FAILURE);
+            worker_index = index;
+            server_stats = &worker_stats[index];
+            pin_to_cpu(index);
+            return 0;
+        }
+        worker_stats[index].pid = pid;
+        worker_stats[index].started_at = time(NULL);
+        write_log(NULL, "Worker %d started (pid %d).", index, pid);
+        return pid;
+    }
+
+    /* Pin the process to the index-th cpu it is allowed to run on */
+    void pin_to_cpu(int16_t index){
+        cpu_set_t allowed, pinned;
+        int cpus, cpu = -1;
+        if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || (cpus = CPU_COUNT(&allowed)) == 0)
+            return;
+        for(int target = index % cpus; target >= 0; target--)
+            while(!CPU_ISSET(++cpu, &allowed));
+        CPU_ZERO(&pinned);
+        CPU_SET(cpu, &pinned);
+        if(sched_setaffinity(0, sizeof(pinned), &pinned) != 0)
+            write_log("error", "Worker %d can't be pinned to cpu %d.", index, cpu);
+        else
+            write_log(NULL, "Worker %d pinned to cpu %d.", index, cpu);
+    }
+
+    void master_signal_handler(int signal_number){
+        if(signal_number != SIGCHLD)
+            master_stopping = TRUE;
+    }
+
+    void log_workers_stats(int16_t workers){
+        uint64_t restarts = 0, connections = 0, requests = 0, bytes_sent = 0;
+        int16_t alive = 0;
+        for(int16_t i = 0; i < workers; i++){
+            alive += worker_stats[i].pid > 0;
+            restarts += worker_stats[i].restarts;
+            connections += __atomic_load_n(&worker_stats[i].connections, __ATOMIC_RELAXED);
+            requests += __atomic_load_n(&worker_stats[i].requests, __ATOMIC_RELAXED);
+            bytes_sent += __atomic_load_n(&worker_stats[i].bytes_sent, __ATOMIC_RELAXED);
+        }
+        write_log(NULL, "Workers: %d/%d alive, restarts: %llu, connections: %llu, requests: %llu, sent: %llu bytes.",
+                  alive, workers, (unsigned long long)restarts, (unsigned long long)connections,
+                  (unsigned long long)requests, (unsigned long long)bytes_sent);
+    }
+#endif
+
+#ifdef EPOLL_ON
+    void set_socket_nonblocking(SocketType socket){
+        int flags = fcntl(socket, F_GETFL, 0);
+        fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    /* Edge-triggered event loop: every socket is non-blocking and each connection
+       keeps its progress in its state machine, so one thread serves all of them. */
+    void run_event_loop(SocketType server_socket, connection_params *server_conf){
+        struct epoll_event event, events[EPOLL_MAX_EVENTS];
+        struct sockaddr_in address;
+        socklen_t addrlen;
+        char client_ip[INET_ADDRSTRLEN];
+        SocketType client_socket;
+        int epoll_fd, events_count;
+
+        if((epoll_fd = epoll_create1(0)) < 0){
+            perror("Error creating epoll instance.");
+            exit(EXIT_FAILURE);
+        }
+
+        set_socket_nonblocking(server_socket);
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = NULL; // the listener has no connection
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event) < 0){
+            perror("Error registering server socket.");
+            exit(EXIT_FAILURE);
+        }
+
+        for(;;){
+            // Wake up on every tick while deadlines are armed, and every second
+            // in --workers mode to publish the counters
+            int wait_ms = connection_timers.count > 0 ? TIMER_TICK_MS : (worker_index >= 0 ? 1000 : -1);
+            if((events_count = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, wait_ms)) < 0){
+                if(errno == EINTR)
+                    continue;
+                perror("Error waiting for events.");
+                exit(EXIT_FAILURE);
+            }
+            publish_worker_stats();
+
+            for(int i = 0; i < events_count; i++){
+                connection_params *conn = events[i].data.ptr;
+
+                // Accept every pending connection
+                if(conn == NULL){
+                    for(;;){
+                        addrlen = sizeof(address);
+                        client_socket = accept4(server_socket, (struct sockaddr *)&address, &addrlen, SOCK_NONBLOCK);
+                        if(client_socket < 0){
+                            if(!socket_would_block() && errno != EINTR)
+                                write_log("error", "Error accepting the connection");
+                            if(errno == EINTR)
+                                continue;
+                            break;
+                        }
+                        inet_ntop(AF_INET, &(address.sin_addr), client_ip, INET_ADDRSTRLEN);
+                        write_log("info", "[%d] Incoming connection from %s", client_socket, client_ip);
+
+                        int32_t admission_slot;
+                        int reason = admit_connection(address.sin_addr.s_addr, &admission_slot);
+                        if(reason != ADMITTED){
+                            reject_connection(client_socket, reason);
+                            close_socket(client_socket);
+                            continue;
+                        }
+                        conn = new_connection(client_socket, server_conf, admission_slot);
+                        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                        event.data.ptr = conn;
+                        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) < 0){
+                            write_log("error", "[%d] Error registering client socket.", client_socket);
+                            close_connection(conn);
+                        }
+                    }
+                    continue;
+                }
+
+                if(events[i].events & EPOLLERR){
+                    close_connection(conn);
+                    continue;
+                }
+                if(!drive_connection(conn))
+                    close_connection(conn); // closing the socket also removes it from epoll
+            }
+            expire_connection_timers(); // the expired sockets are shut down, closed on their next event
+        }
+    }
+#endif
+
+#ifdef IO_URING_ON
+    /* Create the ring and check that the running kernel has everything the
+       backend uses. Returns FALSE to fall back to the epoll loop. */
+    int uring_setup(SocketType server_socket){
+        struct io_uring_params params;
+        struct iovec vectors[URING_BUFFERS];
+        memset(&params, 0, sizeof(params));
+        memset(&uring, 0, sizeof(uring));
+        uring.listener = server_socket;
+
+        if((uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) < 0){
+            write_log("error", "io_uring is not available (%s).", strerror(errno));
+            return FALSE;
+        }
+        // Sockets must be polled by the ring itself and completions never dropped
+        if(!(params.features & IORING_FEAT_FAST_POLL) || !(params.features & IORING_FEAT_NODROP)){
+            write_log("error", "io_uring of this kernel is too old.");
+            close(uring.fd);
+            return FALSE;
+        }
+
+        const uint8_t needed_ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG,
+                                       IORING_OP_SEND, IORING_OP_READ, IORING_OP_READ_FIXED,
+                                       IORING_OP_TIMEOUT, IORING_OP_POLL_ADD };
+        size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+        struct io_uring_probe *probe = safe_malloc(probe_size);
+        memset(probe, 0, probe_size);
+        int supported = syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+        for(size_t i = 0; supported && i < sizeof(needed_ops); i++)
+            supported = needed_ops[i] <= probe->last_op && (probe->ops[needed_ops[i]].flags & IO_URING_OP_SUPPORTED);
+        free(probe);
+        if(!supported){
+            write_log("error", "io_uring of this kernel lacks some operations.");
+            close(uring.fd);
+            return FALSE;
+        }
+
+        // Map the submission ring, its entries and the completion ring
+        size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        char *sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+        char *cq_ring = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+        void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+        if(sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED){
+            write_log("error", "Error mapping the io_uring rings.");
+            if(sq_ring != MAP_FAILED) munmap(sq_ring, sq_size);
+            if(cq_ring != MAP_FAILED) munmap(cq_ring, cq_size);
+            if(sqes != MAP_FAILED) munmap(sqes, sqes_size);
+            close(uring.fd);
+            return FALSE;
+        }
+        uring.sq_head = (uint32_t*)(sq_ring + params.sq_off.head);
+        uring.sq_tail = (uint32_t*)(sq_ring + params.sq_off.tail);
+        uring.sq_mask = (uint32_t*)(sq_ring + params.sq_off.ring_mask);
+        uring.sq_array = (uint32_t*)(sq_ring + params.sq_off.array);
+        uring.sq_entries = params.sq_entries;
+        uring.sqes = sqes;
+        uring.cq_head = (uint32_t*)(cq_ring + params.cq_off.head);
+        uring.cq_tail = (uint32_t*)(cq_ring + params.cq_off.tail);
+        uring.cq_mask = (uint32_t*)(cq_ring + params.cq_off.ring_mask);
+        uring.cqes = (struct io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+
+        // Registered listener and chunk buffers skip the per operation lookups, both optional
+        uring.fixed_listener = syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_FILES, &server_socket, 1) == 0;
+        uring.buffers = safe_malloc((size_t)URING_BUFFERS * URING_CHUNK_SIZE);
+        for(int i = 0; i < URING_BUFFERS; i++){
+            vectors[i].iov_base = uring.buffers + (size_t)i * URING_CHUNK_SIZE;
+            vectors[i].iov_len = URING_CHUNK_SIZE;
+            uring.free_buffers[i] = i;
+        }
+        if(syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, vectors, URING_BUFFERS) == 0){
+            uring.free_buffers_count = URING_BUFFERS;
+        }else{
+            free(uring.buffers);
+            uring.buffers = NULL;
+        }
+        uring.multishot_accept = TRUE; // downgraded by the first accept if unsupported
+        write_log(NULL, "io_uring: %u entries, registered buffers: %s, registered listener: %s.", uring.sq_entries,
+                  uring.buffers != NULL ? "yes" : "no", uring.fixed_listener ? "yes" : "no");
+        return TRUE;
+    }
+
+    /* Next submission entry, cleared and tagged. There is always room for a
+       linked pair, so a chain is never split between two submissions. */
+    struct io_uring_sqe *uring_get_sqe(uint64_t user_data){
+        if(uring.sq_local_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= uring.sq_entries - 1)
+            uring_enter(0);
+        uint32_t index = uring.sq_local_tail++ & *uring.sq_mask;
+        struct io_uring_sqe *sqe = &uring.sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->user_data = user_data;
+        uring.sq_array[index] = index;
+        return sqe;
+    }
+
+    /* Submit the prepared entries and wait for completions in one syscall */
+    int uring_enter(uint32_t wait_completions){
+        uint32_t to_submit = uring.sq_local_tail - uring.sq_submitted;
+        __atomic_store_n(uring.sq_tail, uring.sq_local_tail, __ATOMIC_RELEASE);
+        int submitted = syscall(__NR_io_uring_enter, uring.fd, to_submit, wait_completions,
+                                wait_completions > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(submitted > 0)
+            uring.sq_submitted += submitted;
+        return submitted;
+    }
+
+    /* Arm the accept of the listener, multishot keeps it armed */
+    void uring_accept(){
+        struct io_uring_sqe *sqe = uring_get_sqe(URING_OP_ACCEPT);
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = uring.fixed_listener ? 0 : uring.listener;
+        if(uring.fixed_listener)
+            sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        if(uring.multishot_accept)
+            sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+    }
+
+    /* Wake the loop up on the next timer wheel tick */
+    void uring_tick(){
+        struct io_uring_sqe *sqe = uring_get_sqe(URING_OP_TIMEOUT);
+        uring.tick.tv_sec = 0;
+        uring.tick.tv_nsec = TIMER_TICK_MS * 1000000LL;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (uint64_t)(uintptr_t)&uring.tick;
+        sqe->len = 1;
+        uring.tick_pending = TRUE;
+    }
+
+    /* Wait until an idle connection is readable */
+    void uring_poll(connection_params *conn){
+        struct io_uring_sqe *sqe = uring_get_sqe((uint64_t)(uintptr_t)conn | URING_OP_POLL);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = conn->socket;
+        sqe->poll_events = POLLIN | POLLRDHUP;
+        conn->uring->inflight++;
+    }
+
+    void uring_recv(connection_params *conn){
+        if(conn->buffer == NULL)
+            conn->buffer = buffer_pool_get(&io_buffers);
+        struct io_uring_sqe *sqe = uring_get_sqe((uint64_t)(uintptr_t)conn | URING_OP_RECV);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->socket;
+        sqe->addr = (uint64_t)(uintptr_t)(conn->buffer + conn->buffer_used);
+        sqe->len = BUFFER_SIZE - 1 - conn->buffer_used;
+        conn->uring->inflight++;
+    }
+
+    /* Send the memory parts gathered in a single sendmsg, corked with MSG_MORE
+       when the file follows */
+    void uring_send_parts(connection_params *conn){
+        uring_connection *state = conn->uring;
+        for(int i = 0; i < state->parts_count; i++){
+            state->vectors[i].iov_base = (char*)state->parts[i].data;
+            state->vectors[i].iov_len = state->parts[i].length;
+        }
+        memset(&state->message, 0, sizeof(struct msghdr));
+        state->message.msg_iov = state->vectors;
+        state->message.msg_iovlen = state->parts_count;
+
+        struct io_uring_sqe *sqe = uring_get_sqe((uint64_t)(uintptr_t)conn | URING_OP_SENDMSG);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->socket;
+        sqe->addr = (uint64_t)(uintptr_t)&state->message;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | (conn->response.file_remaining > 0 ? MSG_MORE : 0);
+        state->inflight++;
+        watch_connection(conn, DEADLINE_SEND); // submitted after every progress
+    }
+
+    /* Read the next file chunk and send it, linked so both go in the same
+       submission. The read runs in the kernel workers when the file is cold,
+       the loop keeps serving the other connections meanwhile. */
+    int uring_send_file(connection_params *conn){
+        uring_connection *state = conn->uring;
+        http_response *response = &conn->response;
+        size_t length = shaping_take(conn, response->file_remaining < URING_CHUNK_SIZE ? response->file_remaining : URING_CHUNK_SIZE);
+        if(length == 0){
+            uring_release_chunk(state); // not held while throttled
+            metric_add(get_thread_metrics()->throttled, 1);
+            return FALSE;
+        }
+        if(state->chunk == NULL){
+            if(uring.free_buffers_count > 0){
+                state->chunk_index = uring.free_buffers[--uring.free_buffers_count];
+                state->chunk = uring.buffers + (size_t)state->chunk_index * URING_CHUNK_SIZE;
+            }else{
+                state->chunk_index = -1;
+                state->chunk = safe_malloc(URING_CHUNK_SIZE);
+            }
+        }
+        state->chunk_length = length;
+        state->chunk_sent = 0;
+        prefetch_response(response);
+
+        struct io_uring_sqe *sqe = uring_get_sqe((uint64_t)(uintptr_t)conn | URING_OP_READ);
+        sqe->opcode = state->chunk_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->buf_index = state->chunk_index >= 0 ? state->chunk_index : 0;
+        sqe->fd = response->file->fd;
+        sqe->addr = (uint64_t)(uintptr_t)state->chunk;
+        sqe->len = state->chunk_length;
+        sqe->off = response->file_offset;
+        sqe->flags |= IOSQE_IO_LINK;
+        state->read_pending = TRUE;
+        state->inflight++;
+        uring_send_chunk(conn);
+        return TRUE;
+    }
+
+    /* Send the unsent part of the chunk */
+    void uring_send_chunk(connection_params *conn){
+        uring_connection *state = conn->uring;
+        size_t length = state->chunk_length - state->chunk_sent;
+        struct io_uring_sqe *sqe = uring_get_sqe((uint64_t)(uintptr_t)conn | URING_OP_SEND);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->socket;
+        sqe->addr = (uint64_t)(uintptr_t)(state->chunk + state->chunk_sent);
+        sqe->len = length;
+        sqe->msg_flags = MSG_NOSIGNAL | (conn->response.file_remaining > length ? MSG_MORE : 0);
+        state->inflight++;
+        watch_connection(conn, DEADLINE_SEND);
+    }
+
+    void uring_release_chunk(uring_connection *state){
+        if(state->chunk == NULL)
+            return;
+        if(state->chunk_index >= 0)
+            uring.free_buffers[uring.free_buffers_count++] = state->chunk_index;
+        else
+            free(state->chunk);
+        state->chunk = NULL;
+    }
+
+    /* Same state machine as drive_connection, but every blocking step is
+       queued as an operation and resumed by uring_complete */
+    void uring_advance(connection_params *conn){
+        uring_connection *state = conn->uring;
+        http_response *response = &conn->response;
+        for(;;){
+            if(conn->state == CONN_READING_REQUEST){
+                if(!prepare_response(conn)){
+                    watch_connection(conn, conn->buffer_used == 0 ? DEADLINE_IDLE : DEADLINE_HEADER);
+                    if(conn->buffer_used == 0){
+                        release_connection_buffer(conn);
+                        uring_poll(conn); // the buffer is checked out once the request arrives
+                    }else{
+                        uring_recv(conn);
+                    }
+                    return;
+                }
+                watch_connection(conn, DEADLINE_NONE);
+                conn->state = CONN_SENDING_HEADER;
+            }
+            if((state->parts_count = collect_response_parts(response, state->parts)) > 0){
+                uring_send_parts(conn);
+                return;
+            }
+            conn->state = CONN_SENDING_BODY;
+            if(response->file != NULL && response->file_remaining > 0){
+                if(!uring_send_file(conn))
+                    throttle_connection(conn); // uring_advance again on the next tick
+                return;
+            }
+            if(next_range_part(response))
+                continue;
+            uring_release_chunk(state);
+            record_response_metrics(conn);
+            if(response->close_connection){
+                uring_close(conn);
+                return;
+            }
+            finish_request(conn);
+        }
+    }
+
+    /* Apply the result of a connection operation and queue the next one */
+    void uring_complete(connection_params *conn, int op, int32_t result){
+        uring_connection *state = conn->uring;
+        http_response *response = &conn->response;
+        state->inflight--;
+
+        switch(op){
+            case URING_OP_POLL:
+                uring_recv(conn); // readable, closed or shut down: the recv tells
+                return;
+            case URING_OP_RECV:
+                if(result == -EINTR || result == -EAGAIN){
+                    uring_recv(conn);
+                    return;
+                }
+                if(result <= 0){
+                    write_log(NULL, "[%d] Connection closed by client.", conn->socket);
+                    uring_close(conn);
+                    return;
+                }
+                conn->buffer_used += result;
+                break;
+            case URING_OP_SENDMSG:
+                if(result == -EINTR || result == -EAGAIN){
+                    uring_send_parts(conn);
+                    return;
+                }
+                if(result < 0){
+                    write_log("error", "[%d] Error sending response.", conn->socket);
+                    uring_close(conn);
+                    return;
+                }
+                advance_response_parts(state->parts, state->parts_count, result);
+                metric_add(get_thread_metrics()->bytes_sent, result);
+                break;
+            case URING_OP_READ:
+            case URING_OP_SEND:
+                if(op == URING_OP_READ)
+                    state->read_result = result;
+                else
+                    state->send_result = result;
+                if(state->inflight > 0)
+                    return; // the other half of the pair
+                if(state->read_pending){
+                    state->read_pending = FALSE;
+                    if(state->read_result <= 0){
+                        write_log("error", "[%d] Error reading '%s'.", conn->socket, response->file->path);
+                        uring_close(conn);
+                        return;
+                    }
+                    state->chunk_length = state->read_result; // a short read cancels the linked send
+                }
+                if(state->send_result == -ECANCELED || state->send_result == -EINTR || state->send_result == -EAGAIN){
+                    uring_send_chunk(conn);
+                    return;
+                }
+                if(state->send_result <= 0){
+                    write_log("error", "[%d] Error sending response.", conn->socket);
+                    uring_close(conn);
+                    return;
+                }
+                state->chunk_sent += state->send_result;
+                metric_add(get_thread_metrics()->bytes_sent, state->send_result);
+                response->file_offset += state->send_result;
+                response->file_remaining -= state->send_result;
+                if(state->chunk_sent < state->chunk_length){
+                    uring_send_chunk(conn);
+                    return;
+                }
+                break;
+        }
+        uring_advance(conn);
+    }
+
+    /* Only called when nothing of the connection is in flight */
+    void uring_close(connection_params *conn){
+        uring_release_chunk(conn->uring);
+        free(conn->uring);
+        close_connection(conn);
+    }
+
+    /* io_uring event loop on the listener given to uring_setup: accepts, request
+       reads, file reads and sends are prepared as submission entries, and the whole
+       batch is submitted with the wait for the next completions in a single syscall. */
+    void run_uring_loop(connection_params *server_conf){
+        struct io_uring_cqe cqe;
+        struct sockaddr_in address;
+        socklen_t addrlen;
+        char client_ip[INET_ADDRSTRLEN];
+        connection_params *conn;
+
+        uring_accept();
+        for(;;){
+            if(connection_timers.count > 0 && !uring.tick_pending)
+                uring_tick();
+            if(uring_enter(1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY){
+                perror("Error waiting for io_uring completions.");
+                exit(EXIT_FAILURE);
+            }
+            publish_worker_stats();
+
+            uint32_t head = *uring.cq_head;
+            while(head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)){
+                cqe = uring.cqes[head & *uring.cq_mask];
+                __atomic_store_n(uring.cq_head, ++head, __ATOMIC_RELEASE);
+                conn = (connection_params*)(uintptr_t)(cqe.user_data & ~(uint64_t)URING_OP_MASK);
+
+                if(cqe.user_data == URING_OP_TIMEOUT){
+                    uring.tick_pending = FALSE;
+                    continue;
+                }
+                if((cqe.user_data & URING_OP_MASK) != URING_OP_ACCEPT){
+                    uring_complete(conn, cqe.user_data & URING_OP_MASK, cqe.res);
+                    continue;
+                }
+
+                // Accepted connection (or accept error)
+                if(cqe.res == -EINVAL && uring.multishot_accept){
+                    write_log(NULL, "io_uring: no multishot accept, one accept per entry.");
+                    uring.multishot_accept = FALSE;
+                }else if(cqe.res < 0){
+                    write_log("error", "Error accepting the connection");
+                }else{
+                    address.sin_addr.s_addr = 0;
+                    if(!no_logs || admission.per_ip != NULL){
+                        addrlen = sizeof(address);
+                        getpeername(cqe.res, (struct sockaddr *)&address, &addrlen);
+                    }
+                    if(!no_logs){
+                        inet_ntop(AF_INET, &(address.sin_addr), client_ip, INET_ADDRSTRLEN);
+                        write_log("info", "[%d] Incoming connection from %s", cqe.res, client_ip);
+                    }
+                    int32_t admission_slot;
+                    int reason = admit_connection(address.sin_addr.s_addr, &admission_slot);
+                    if(reason != ADMITTED){
+                        reject_connection(cqe.res, reason);
+                        close_socket(cqe.res);
+                    }else{
+                        conn = new_connection(cqe.res, server_conf, admission_slot);
+                        conn->uring = safe_malloc(sizeof(uring_connection));
+                        memset(conn->uring, 0, sizeof(uring_connection));
+                        uring_advance(conn);
+                    }
+                }
+                if(!(cqe.flags & IORING_CQE_F_MORE))
+                    uring_accept(); // rearm
+            }
+            expire_connection_timers(); // the shut down sockets fail their pending operations
+        }
+    }
+#endif
+
+#ifdef MULTITHREAD_ON
+    void init_work_queue(work_queue *queue, size_t size) {
+        size_t capacity = 2;
+        while (capacity < size)
+            capacity <<= 1;
+        queue->cells = safe_malloc(sizeof(work_queue_cell) * capacity);
+        for (size_t i = 0; i < capacity; i++)
+            queue->cells[i].sequence = i;
+        queue->mask = capacity - 1;
+        queue->enqueue_pos = 0;
+        queue->dequeue_pos = 0;
+        sem_init(&queue->items, 0, 0);
+        sem_init(&queue->spaces, 0, capacity);
+        write_log(NULL, "Connection queue size: " SIZE_T_FORMAT, capacity);
+    }
+
+    /* Returns FALSE if the queue is full */
+    int work_queue_push(work_queue *queue, connection_params *conn) {
+        work_queue_cell *cell;
+        size_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        for (;;) {
+            cell = &queue->cells[pos & queue->mask];
+            size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, TRUE,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    break;
+            } else if (diff < 0) {
+                return FALSE;
+            } else {
+                pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+            }
+        }
+        cell->conn = conn;
+        __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+        return TRUE;
+    }
+
+    /* Returns NULL if the queue is empty */
+    connection_params *work_queue_pop(work_queue *queue) {
+        work_queue_cell *cell;
+        size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        for (;;) {
+            cell = &queue->cells[pos & queue->mask];
+            size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, TRUE,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    break;
+            } else if (diff < 0) {
+                return NULL;
+            } else {
+                pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+            }
+        }
+        connection_params *conn = cell->conn;
+        __atomic_store_n(&cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+        return conn;
+    }
+
+    /* Queue the connection for a thread. Never waits: FALSE when the queue is
+       full, then a new connection is shed and a known one backlogged. */
+    int enqueue_connection(connection_params *conn) {
+        if (sem_trywait(&connection_queue.spaces) != 0)
+            return FALSE;
+        conn->queued_at = get_time_usec();
+        work_queue_push(&connection_queue, conn);
+        uint64_t depth = __atomic_add_fetch(&pool_stats.queue_depth, 1, __ATOMIC_RELAXED);
+        atomic_max_u64(&pool_stats.max_queue_depth, depth);
+        sem_post(&connection_queue.items);
+        return TRUE;
+    }
+
+    void backlog_connection(connection_backlog *backlog, connection_params *conn) {
+        conn->backlog_next = NULL;
+        if (backlog->tail != NULL)
+            backlog->tail->backlog_next = conn;
+        else
+            backlog->head = conn;
+        backlog->tail = conn;
+    }
+
+    /* Queue the backlogged connections in order, as long as there is room.
+       Returns FALSE when some are left for the next turn. */
+    int flush_backlog(connection_backlog *backlog) {
+        connection_params *conn;
+        while ((conn = backlog->head) != NULL) {
+            connection_params *next = conn->backlog_next; // conn belongs to a thread once queued
+            if (!enqueue_connection(conn)) {
+                write_log("error", "Server too busy, connection queue is full.");
+                return FALSE;
+            }
+            if ((backlog->head = next) == NULL)
+                backlog->tail = NULL;
+        }
+        return TRUE;
+    }
+
+    void start_thread_pool(int16_t threads) {
+        for (int i = 0; i < threads; i++) {
+            int error = create_thread(connection_worker_thread);
+            if (error != 0) {
+                write_log("error", "pthread_create failed: '%s'", strerror(error));
+                exit(EXIT_FAILURE);
+            }
+        }
+        write_log(NULL, "Thread pool started with %d workers (%d kb stacks).", threads, THREAD_STACK_SIZE / 1024);
+    }
+
+    #ifndef EPOLL_ON
+        void start_timer_thread() {
+            int error = create_thread(timer_thread);
+            if (error != 0) {
+                write_log("error", "pthread_create failed: '%s'", strerror(error));
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        /* Expire the connection deadlines on every tick of the wheel */
+        void *timer_thread(void *args) {
+            (void)args;
+            for (;;) {
+                sleep_ms(TIMER_TICK_MS);
+                expire_connection_timers();
+                flush_backlog(&resumed_backlog);
+            }
+            return NULL;
+        }
+    #endif
+
+    void *connection_worker_thread(void *args) {
+        (void)args;
+        connection_params *conn;
+        uint64_t wait_usec;
+        for (;;) {
+            if (sem_wait(&connection_queue.items) != 0)
+                continue;
+            if ((conn = work_queue_pop(&connection_queue)) == NULL)
+                continue;
+            sem_post(&connection_queue.spaces);
+
+            wait_usec = get_time_usec() - conn->queued_at;
+            uint64_t depth = __atomic_sub_fetch(&pool_stats.queue_depth, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&pool_stats.dequeued, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&pool_stats.total_wait_usec, wait_usec, __ATOMIC_RELAXED);
+            atomic_max_u64(&pool_stats.max_wait_usec, wait_usec);
+            write_log(NULL, "[%d] Waited %llu us in queue (depth %llu).",
+                      conn->socket, (unsigned long long)wait_usec, (unsigned long long)depth);
+
+            thread_metrics *metrics = get_thread_metrics();
+            __atomic_store_n(&metrics->busy, 1, __ATOMIC_RELAXED);
+            handle_connection(conn);
+            __atomic_store_n(&metrics->busy, 0, __ATOMIC_RELAXED);
+        }
+        return NULL;
+    }
+#endif
+
+#ifdef IDLE_POLLER_ON
+    void start_idle_poller() {
+        if ((idle_epoll_fd = epoll_create1(0)) < 0) {
+            perror("Error creating the idle poller.");
+            exit(EXIT_FAILURE);
+        }
+        int error = create_thread(idle_poller_thread);
+        if (error != 0) {
+            write_log("error", "pthread_create failed: '%s'", strerror(error));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Queue the parked connections again once they are readable: a new request,
+       the client closing or the idle deadline shutting the socket down */
+    void *idle_poller_thread(void *args) {
+        (void)args;
+        struct epoll_event events[EPOLL_MAX_EVENTS];
+        connection_backlog backlog = { NULL, NULL }; // already admitted, never shed
+        for (;;) {
+            // A full queue is retried every tick, the other parked connections keep waking meanwhile
+            int events_count = epoll_wait(idle_epoll_fd, events, EPOLL_MAX_EVENTS, backlog.head != NULL ? TIMER_TICK_MS : -1);
+            for (int i = 0; i < events_count; i++)
+                backlog_connection(&backlog, events[i].data.ptr);
+            flush_backlog(&backlog);
+        }
+        return NULL;
+    }
+
+    /* Wait for the next request of a keep-alive connection without a thread.
+       Returns FALSE when the connection must be closed instead. */
+    int park_connection(connection_params *conn) {
+        struct epoll_event event;
+        if (conn->buffer_used > 0)
+            return FALSE; // a half read request timed out (SO_RCVTIMEO)
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.ptr = conn;
+        int operation = conn->parked ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        conn->parked = TRUE; // the poller may hand the connection to a thread before epoll_ctl returns
+        if (epoll_ctl(idle_epoll_fd, operation, conn->socket, &event) < 0) {
+            write_log("error", "[%d] Error parking the connection.", conn->socket);
+            return FALSE;
+        }
+        return TRUE;
+    }
+#endif
@@ -1,8 +1,13 @@
 #ifndef TINYC_H
 #define TINYC_H
 
+#ifdef __linux__
+    #define _GNU_SOURCE // accept4, localtime_r, etc
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -12,6 +17,16 @@
 // Set multithread mode
 #ifdef MULTITHREAD_ON
     #include <pthread.h>
+    #include <semaphore.h>
+#endif
+
+// Thread pool on Linux: idle keep-alive connections wait in an epoll set instead of a thread
+#if defined(MULTITHREAD_ON) && !defined(EPOLL_ON) && defined(__linux__)
+    #define IDLE_POLLER_ON
+    #include <sys/epoll.h>
+    #define IDLE_RECV_FLAGS MSG_DONTWAIT // an idle connection is parked instead of waited for
+#else
+    #define IDLE_RECV_FLAGS 0
 #endif
 
 #ifdef __linux__
@@ -22,6 +37,18 @@
     #include <dirent.h>
     #include <sys/stat.h>
     #include <ctype.h>
+    #include <fcntl.h>
+    #include <errno.h>
+    #include <sys/sendfile.h>
+    #include <sys/uio.h>
+    #include <netinet/tcp.h>
+    #include <signal.h>
+    #include <sched.h>
+    #include <sys/wait.h>
+    #include <sys/mman.h>
+    #include <sys/prctl.h>
+    #include <sys/inotify.h>
+    #include <poll.h>
     typedef int32_t SocketType;
 
     #define SIZE_T_FORMAT "%zu"
@@ -30,6 +57,7 @@
     
     #include <winsock2.h>
     #include <windows.h>
+    #include <sys/stat.h>
     #include <locale.h>
     #include <wchar.h>
 
@@ -37,112 +65,1098 @@
 
     #define SIZE_T_FORMAT "%Illu"
     #define SEND_D_FLAG 0
+    #define SHUT_RDWR SD_BOTH
+#endif
+
+// On the fly gzip compression
+#ifdef ZLIB_ON
+    #include <zlib.h>
+#endif
+
+// Set epoll event loop mode
+#ifdef EPOLL_ON
+    #ifndef __linux__
+        #error "The epoll engine is only available on Linux."
+    #endif
+    #include <sys/epoll.h>
+
+    // io_uring backend (--io-uring), through the raw syscalls so liburing is not needed
+    #if defined(__has_include)
+        #if __has_include(<linux/io_uring.h>)
+            #define IO_URING_ON
+            #include <linux/io_uring.h>
+            #include <sys/syscall.h>
+            #ifndef IORING_ACCEPT_MULTISHOT // older headers, detected at runtime anyway
+                #define IORING_ACCEPT_MULTISHOT (1U << 0)
+            #endif
+        #endif
+    #endif
 #endif
 
 #define TRUE  1
 #define FALSE 0
 
+// Locks are only needed when several threads share the caches
+#ifdef MULTITHREAD_ON
+    typedef pthread_mutex_t mutex_type;
+    #define mutex_init(mutex) pthread_mutex_init(mutex, NULL)
+    #define mutex_lock(mutex) pthread_mutex_lock(mutex)
+    #define mutex_unlock(mutex) pthread_mutex_unlock(mutex)
+    typedef pthread_rwlock_t rwlock_type;
+    #define rwlock_init(lock) pthread_rwlock_init(lock, NULL)
+    #define rwlock_read_lock(lock) pthread_rwlock_rdlock(lock)
+    #define rwlock_write_lock(lock) pthread_rwlock_wrlock(lock)
+    #define rwlock_unlock(lock) pthread_rwlock_unlock(lock)
+#else
+    typedef int8_t mutex_type;
+    #define mutex_init(mutex) ((void)(mutex))
+    #define mutex_lock(mutex) ((void)(mutex))
+    #define mutex_unlock(mutex) ((void)(mutex))
+    typedef int8_t rwlock_type;
+    #define rwlock_init(lock) ((void)(lock))
+    #define rwlock_read_lock(lock) ((void)(lock))
+    #define rwlock_write_lock(lock) ((void)(lock))
+    #define rwlock_unlock(lock) ((void)(lock))
+#endif
 
 
 #define MAX_HEADER_SIZE 1024
 #define BUFFER_SIZE 40000       // 40kb
 #define MAX_PATH_LENGTH 400
 #define MAX_THREADS 250
-#define MAX_MIME_TYPES 30
+#define QUEUE_SIZE 1024         // pending connections waiting for a worker (power of 2)
 #define DEFAULT_PORT 8081       // server default server
 #define SERVER_BACKLOG 250      // server max listen connections
-#define CLIENT_TIMEOUT 5
-#define EXPLORER_MAX_FILES 2048 // max amount of files that explorer print
+#define IDLE_TIMEOUT 5          // seconds a keep-alive connection may wait for its next request
+#define HEADER_TIMEOUT 10       // seconds to receive a whole request header
+#define SEND_TIMEOUT 10         // seconds the client may take without reading any response byte
+#define TIMER_TICK_MS 100       // timer wheel resolution
+#define SEND_CHUNK_SIZE 262144  // file bytes per blocking sendfile call
+#define BUFFER_POOL_MAX_FREE 256 // free request buffers kept for reuse (10mb), the rest go back to malloc
+#define THREAD_STACK_SIZE 131072 // 128kb thread stacks instead of the 8mb default
+#define ADMISSION_IP_SLOTS 65536 // per address connection counters (hashed, addresses sharing a slot share its limit)
+#define RETRY_AFTER_SECONDS 1   // Retry-After of the 503 sent to shed connections
+#define REJECT_DRAIN_READS 4    // reads of the request already sent before a rejected socket is closed
+#define SHAPING_BURST_MS 200    // bandwidth a token bucket may save up, in milliseconds of its rate
+#define SHAPING_MIN_BURST 16384 // smallest bucket capacity, whatever the rate
+#define SHAPING_MIN_SEND 8192   // smallest shaped send, below it the response waits for more tokens
+#define SHAPED_FILE_SIZE 262144 // smaller files (pages, scripts, images) are never throttled
+#define READAHEAD_MIN_FILE_SIZE 1048576 // smaller files are left to the kernel readahead
+#define READAHEAD_MIN_WINDOW 524288  // first prefetch of a seek
+#define READAHEAD_MAX_WINDOW 16777216 // a sequential stream doubles its window up to it
+#define READAHEAD_GAP 65536     // distance to the end of the last range still counted as sequential
+#define READAHEAD_STREAMS 4     // sequential streams tracked per open file
+#define READAHEAD_DROP_FILE_SIZE 268435456 // consumed pages of bigger files are dropped from the page cache
+#define READAHEAD_DROP_LAG 16777216 // kept behind a stream for the players that step back a little
+#define MMAP_MAX_FILE_SIZE 1048576 // bigger files are never mapped (1mb)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6      // 64 slots per level, 4 levels cover 19 days of ticks
+#define EXPLORER_MAX_FILES 65536 // max amount of files that explorer print
 #define EXPLORER_MAX_FILENAME_LENGTH 500
+#define EXPLORER_CACHE_SIZE_MB 16 // rendered listings kept in memory
+#define EXPLORER_CACHE_MAX_SIZE 1048576 // bigger listings are rendered on every request (1mb)
 #define HTML_EL_SIZE 1024
+#define EPOLL_MAX_EVENTS 1024   // events handled per epoll_wait call
+#define MAX_REQUEST_HEADERS 32
+#define CACHE_SIZE_MB 32        // content cache default budget
+#define CACHE_MAX_FILE_SIZE 1048576 // bigger files are never cached (1mb)
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 256       // hash buckets per shard
+#define COMPRESS_CACHE_SIZE_MB 16 // on the fly compressed variants default budget
+#define COMPRESS_MAX_FILE_SIZE 4194304 // bigger files are never compressed on the fly (4mb)
+#define CACHE_REVALIDATE_SECONDS 1 // stat cached files at most once per second
+#define FILE_CACHE_MAX_FILES 1024 // open file handles kept by the file cache
+#define FILE_CACHE_BUCKETS 64   // hash buckets per shard
+#define FILE_CACHE_TTL 2        // seconds before a handle is checked against the disk
+#define URING_ENTRIES 1024      // io_uring submission queue size
+#define URING_CHUNK_SIZE 65536  // file bytes read per io_uring operation
+#define URING_BUFFERS 64        // registered chunk buffers shared by the connections
+#define MAX_RANGES 16           // more ranges in a request and the whole file is sent
+#define ETAG_SIZE 64            // W/"<inode>-<size>-<mtime>-<encoding>"
+#define MIME_FIELD_SIZE 128     // "Content-Type: <type>; charset=utf-8\r\n"
+#define MIME_EXTENSION_SIZE 16  // longer extensions are never matched
+#define MIME_INDEX_MAX_SEED 1048576 // displacements tried per bucket before the table grows
+#define PATH_INDEX_MAX_ENTRIES 262144 // bigger trees are served straight from the filesystem
+#define PATH_INDEX_MAX_DEPTH 32 // symlinked directories can loop
+#define PATH_INDEX_BUCKETS 4096 // initial buckets, doubled with the entries (power of 2)
+
+// Prefork mode (--workers)
+#define WORKER_RESTART_DELAY 1  // seconds, a worker that dies sooner is restarted after this delay
+#define WORKER_STATS_INTERVAL 10 // seconds between two stats logs of the master
+
+// Counters of a server process, in shared memory for the --workers workers
+typedef struct {
+    int32_t pid;
+    time_t started_at;
+    uint64_t restarts;
+    uint64_t connections;
+    uint64_t requests;
+    uint64_t bytes_sent;
+} process_stats;
+
+process_stats local_stats;
+process_stats *server_stats = &local_stats;
+
+#ifdef __linux__
+    process_stats *worker_stats = NULL; // one slot per worker, shared with the master
+    int16_t worker_index = -1;          // -1 in the master or without --workers
+    pid_t master_pid = 0;
+    volatile sig_atomic_t master_stopping = FALSE;
+    time_t worker_stats_published_at = 0;
+#endif
+
+// Clock: date strings rendered once per second, double buffered so readers
+// never see a half written string
+#define LOG_DATE_SIZE 20        // 2024-01-31 23:59:59
+#define HTTP_DATE_SIZE 30       // Wed, 31 Jan 2024 23:59:59 GMT
+
+typedef struct {
+    uint32_t sequence;          // odd while the slot is being written
+    time_t second;
+    char log_date[LOG_DATE_SIZE];
+    char http_date[HTTP_DATE_SIZE];
+} clock_slot;
+
+clock_slot clock_slots[2];
+int32_t clock_index = 0;
+int32_t clock_updating = FALSE;
 
 // log file
 #define LOG_FILE_NAME "tinyc.log"
+#define LOG_MESSAGE_SIZE 200    // longer messages are truncated
+#define LOG_RING_SIZE 128       // records per thread ring (power of 2)
+#define LOG_FLUSH_INTERVAL_MS 50 // log writer sleep when every ring is empty
 int8_t no_logs = FALSE;
 FILE *log_file = NULL;
 
+// Log record types
+#define LOG_PLAIN 0
+#define LOG_ERROR 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+typedef struct {
+    time_t time;
+    int8_t type;
+    char message[LOG_MESSAGE_SIZE];
+} log_record;
+
+#ifdef MULTITHREAD_ON
+    // Per thread single producer ring, consumed by the log writer thread
+    typedef struct log_ring {
+        log_record records[LOG_RING_SIZE];
+        size_t head;            // written by the owner thread
+        size_t tail;            // written by the log writer
+        struct log_ring *next;
+    } log_ring;
+
+    log_ring *log_rings = NULL;
+    pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+    __thread log_ring *thread_log_ring = NULL;
+    int8_t log_writer_running = FALSE;
+    int8_t log_block_when_full = FALSE; // else drop records
+    uint64_t log_dropped = 0;
+#endif
+
 typedef struct {
-    const char *extension;
+    const char *extension;      // lowercase, with its dot
     const char *mime_type;
+    int8_t compressible;
+    const char *cache_control;  // Cache-Control of the 200 responses, NULL = default
+    char content_type_field[MIME_FIELD_SIZE]; // rendered by build_mime_index
+    size_t content_type_field_length;
 } MimeType;
 
+// Perfect hash of the known extensions (hash and displace), built at startup so
+// the --mime-file types land in it too. A lookup is two hashes and one strcmp.
+typedef struct {
+    MimeType **types;           // built-in table first, then the --mime-file ones
+    size_t count;
+    size_t capacity;
+    MimeType **slots;           // exactly one type per slot
+    int32_t *displacements;     // per bucket: seed of its types, or -slot-1 for a lone type
+    uint32_t size;              // slots and buckets
+} mime_index;
+
+mime_index mime_types_index;
+MimeType default_mime_type = { "", "application/octet-stream", FALSE, NULL, "", 0 }; // unknown extensions
+const char *default_cache_control = "no-cache"; // unknown extensions and --cache-control "*"
+
+// Validators of a representation, rendered into its 200 and 304 headers
+typedef struct {
+    char etag[ETAG_SIZE];
+    char last_modified[HTTP_DATE_SIZE];
+    time_t mtime;
+    const char *cache_control;
+    int8_t varies;              // Vary: Accept-Encoding
+} content_validators;
+
+// Sequential read stream of a file: ranges following each other end to end
+typedef struct {
+    uint64_t next_offset;       // where the next range of the stream starts
+    uint64_t dropped;           // page cache dropped up to here (huge files)
+    uint32_t window;            // prefetch window, 0 when the slot is free
+} read_stream;
+
+// mmap serving: small files are mapped once and shared by all their responses,
+// the mapping lives as long as the file cache handle (a changed file gets a new one)
 typedef struct {
+    size_t budget;              // --mmap-size, 0 disables mmap serving
+    size_t max_file_size;       // --mmap-max-file-size
+    size_t bytes;               // mapped now
+    size_t files;
+} file_mappings;
+
+file_mappings file_maps = { 0, MMAP_MAX_FILE_SIZE, 0, 0 };
+
+// File cache: open descriptor, metadata and mimetype of a served file
+typedef struct open_file {
+    char *path;
+    uint32_t hash;
+    int32_t fd;                 // shared by every stream of the file (linux)
+    struct stat info;
+    const MimeType *mime;
+    content_validators validators; // computed once per open
+    time_t validated_at;
+    int32_t refs;               // the cache itself holds one reference
+    read_stream streams[READAHEAD_STREAMS]; // under the lock of the cache shard
+    int8_t next_stream;         // slot reused by the next seek
+    int8_t sequential_advised;  // POSIX_FADV_SEQUENTIAL already set on fd
+    char *map;                  // whole file shared mapping, NULL until a response maps it
+    int8_t gzip_useless;        // its on the fly gzip was no smaller or didn't fit the compressed cache
+    struct open_file *hash_next;
+    struct open_file *lru_prev;
+    struct open_file *lru_next;
+} open_file;
+
+typedef struct {
+    mutex_type lock;
+    open_file *buckets[FILE_CACHE_BUCKETS];
+    open_file *lru_head;      // most recently used
+    open_file *lru_tail;
+    size_t count;
+} file_cache_shard;
+
+file_cache_shard file_cache[CACHE_SHARDS];
+
+// Content encodings accepted by the client
+#define ENCODING_GZIP 1
+#define ENCODING_BR 2
+#define ENCODING_IDENTITY 0     // cache variant of the bytes as they are on disk
+
+// Content cache: file bytes plus its rendered 200 header
+typedef struct cache_entry {
+    char *path;
+    uint32_t hash;
+    int8_t encoding;            // with path, the key: ENCODING_* of the cached bytes
+    char *header;
+    size_t header_length;
+    char *data;
+    size_t size;
+    size_t source_size;         // size of the file on disk, for revalidation
+    time_t mtime;
+    content_validators validators;
+    time_t validated_at;
+    int32_t refs;               // the cache itself holds one reference
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+} cache_entry;
+
+typedef struct {
+    mutex_type lock;
+    cache_entry *buckets[CACHE_BUCKETS];
+    cache_entry *lru_head;      // most recently used
+    cache_entry *lru_tail;
+    size_t bytes;
+} cache_shard;
+
+typedef struct {
+    const char *name;
+    cache_shard shards[CACHE_SHARDS];
+    size_t shard_budget;        // 0 = cache disabled
+    size_t max_entry_size;
+    int8_t metrics_index;       // slot of its hits and misses in thread_metrics
+    uint64_t evictions;
+} memory_cache;
+
+memory_cache content_cache;     // small files as they are on disk
+memory_cache compressed_cache;  // compressed on the fly variants
+memory_cache explorer_cache;    // rendered directory listings
+
+#define CACHE_KINDS 3
+memory_cache *memory_caches[CACHE_KINDS];
+int8_t memory_caches_count = 0;
+
+// Deadline kinds of a connection, only the one of its current state is armed
+#define DEADLINE_NONE 0
+#define DEADLINE_IDLE 1         // keep-alive connection waiting for a request
+#define DEADLINE_HEADER 2       // request started but its header is not complete
+#define DEADLINE_SEND 3         // response not read by the client, restarted on every progress
+#define DEADLINE_THROTTLE 4     // not a timeout: a throttled response resumes on the next tick
+#define DEADLINE_KINDS 5
+
+const char *DEADLINE_NAMES[DEADLINE_KINDS] = { "none", "idle", "header", "send", "throttle" };
+int32_t deadline_seconds[DEADLINE_KINDS] = { 0, IDLE_TIMEOUT, HEADER_TIMEOUT, SEND_TIMEOUT, 0 }; // 0 disables it
+
+// Bandwidth shaping: a token bucket per connection and one for the whole
+// server, only drawn by file bodies of at least SHAPED_FILE_SIZE
+typedef struct {
+    uint64_t rate;              // bytes per second, 0 = no limit
+    uint64_t burst;             // capacity
+    uint64_t tokens;
+    uint64_t refilled_at;       // usec
+} token_bucket;
+
+typedef struct {
+    uint64_t connection_rate;   // --connection-bandwidth
+    token_bucket total;         // --total-bandwidth
+    mutex_type lock;            // of total
+} bandwidth_shaping;
+
+bandwidth_shaping shaping;
+
+// Admission control: connections over a limit get a prerendered 503 and are
+// closed at once, instead of waiting in the backlog or the queue
+#define ADMITTED -1
+#define REJECT_CONNECTIONS 0    // --max-connections open connections
+#define REJECT_PER_IP 1         // --max-connections-per-ip from the same address
+#define REJECT_QUEUE 2          // the thread pool queue (--queue-size) is full
+#define REJECT_REASONS 3
+
+const char *REJECT_NAMES[REJECT_REASONS] = { "connections", "per_ip", "queue" };
+
+typedef struct {
+    uint32_t max_connections;   // 0 = no limit
+    uint32_t max_per_ip;        // 0 = no limit
+    uint32_t connections;       // admitted and not closed yet
+    uint32_t *per_ip;           // ADMISSION_IP_SLOTS counters, NULL without a per address limit
+    char busy_response[256];    // prerendered 503
+    size_t busy_response_length;
+} admission_control;
+
+admission_control admission;
+int16_t retry_after = RETRY_AFTER_SECONDS;
+
+// Metrics (/metrics): every thread owns its counters, they are only summed when
+// scraped so the hot path never shares a cache line with another thread
+#define METRICS_STATUS_CODES_COUNT 11   // the last slot counts the other codes
+#define METRICS_LATENCY_BUCKETS 15      // the last bucket is +Inf
+
+const int16_t METRICS_STATUS_CODES[METRICS_STATUS_CODES_COUNT - 1] = { 200, 206, 302, 304, 400, 404, 414, 416, 500, 503 };
+const uint64_t METRICS_LATENCY_BOUNDS[METRICS_LATENCY_BUCKETS - 1] = { // usec
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000 };
+
+typedef struct thread_metrics {
+    uint64_t requests;
+    uint64_t responses[METRICS_STATUS_CODES_COUNT];
+    uint64_t bytes_sent;
+    uint64_t connections_opened;
+    uint64_t connections_closed;
+    uint64_t cache_hits[CACHE_KINDS];
+    uint64_t cache_misses[CACHE_KINDS];
+    uint64_t latency_buckets[METRICS_LATENCY_BUCKETS];
+    uint64_t latency_sum_usec;
+    uint64_t timeouts[DEADLINE_KINDS]; // by deadline kind, expired by the timer wheel
+    uint64_t rejected[REJECT_REASONS];  // connections shed with a 503
+    uint64_t throttled;         // file sends postponed by the bandwidth limits
+    uint64_t sequential_ranges; // file bodies continuing a sequential stream
+    uint64_t busy;              // 1 while a pool thread serves a connection
+    struct thread_metrics *next;
+    char padding[64];           // keeps the next thread slot off this cache line
+} thread_metrics;
+
+// Counters have a single writer: a plain add, stored relaxed for the scraper
+#define metric_add(field, value) __atomic_store_n(&(field), (field) + (value), __ATOMIC_RELAXED)
+
+thread_metrics *metrics_list = NULL;
+int8_t metrics_enabled = TRUE;
+int16_t pool_threads = 0;
+time_t server_started_at = 0;
+#ifdef MULTITHREAD_ON
+    pthread_mutex_t metrics_list_lock = PTHREAD_MUTEX_INITIALIZER;
+    __thread thread_metrics *thread_metrics_slot = NULL;
+#else
+    thread_metrics main_thread_metrics;
+#endif
+
+// Path index: metadata of every path under the served root, kept live by inotify
+typedef struct path_entry {
+    char *path;                 // relative to the working directory, no trailing slash
+    uint32_t hash;
+    size_t size;
+    time_t mtime;
+    const MimeType *mime;
+    int8_t is_dir;
+    struct path_entry *next;
+} path_entry;
+
+// path_index_lookup results
+#define PATH_UNKNOWN 0          // index disabled, ask the filesystem
+#define PATH_MISSING 1
+#define PATH_FOUND 2
+
+#ifdef __linux__
+    typedef struct {
+        rwlock_type lock;
+        path_entry **buckets;
+        size_t buckets_count;
+        size_t count;
+        char *root;             // "" for the working directory
+        int8_t enabled;
+        int inotify_fd;
+        char **watches;         // watch descriptor -> watched directory
+        int32_t watches_capacity;
+        int32_t root_watch;
+    } path_index;
+
+    #define PATH_INDEX_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | \
+                               IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+    path_index served_index = { .inotify_fd = -1 };
+#endif
+
+// Growable string, appends are amortized O(1)
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} string_builder;
+
+// Parsed request, all the strings point into the connection buffer
+typedef struct {
+    const char *name;
+    const char *value;
+} http_header;
+
+typedef struct {
+    char *method;
+    char *uri;
+    int8_t version_minor;       // HTTP/1.x
+    int8_t keep_alive;
+    int8_t head;                // HEAD: the response is sent without its body
+    http_header headers[MAX_REQUEST_HEADERS];
+    int16_t headers_count;
+    size_t length;              // header + body bytes used in the buffer
+} http_request;
+
+// parse_request results
+#define REQUEST_INCOMPLETE 0
+#define REQUEST_READY 1
+#define REQUEST_INVALID 2
+
+// Connection state machine
+typedef enum {
+    CONN_READING_REQUEST,
+    CONN_SENDING_HEADER,
+    CONN_SENDING_BODY
+} connection_state;
+
+// write_response results
+#define RESPONSE_DONE 0
+#define RESPONSE_PENDING 1  // socket would block, try again when writable
+#define RESPONSE_ERROR 2
+#define RESPONSE_THROTTLED 3 // a bandwidth limit is reached, try again on the next tick
+
+// drive_connection result besides TRUE/FALSE: the timer wheel resumes the connection
+#define CONNECTION_THROTTLED 2
+
+// Byte range of a file, both ends included
+typedef struct {
+    size_t start;
+    size_t end;
+} byte_range;
+
+// parse_range_header result when the Range header must be ignored
+#define RANGE_IGNORED -1
+
+// Unsent memory part of a response, see collect_response_parts
+typedef struct {
+    const char *data;
+    size_t length;
+    size_t *sent;
+} response_part;
+
+// Pending response of a connection: header, shared header, memory body, then file body
+typedef struct {
+    char header[MAX_HEADER_SIZE];
+    size_t header_length;
+    size_t header_sent;
+    const char *shared_header;  // prebuilt header fields sent after header
+    size_t shared_header_length;
+    size_t shared_header_sent;
+    const char *body;
+    char *owned_body;           // released with the response
+    size_t body_length;
+    size_t body_sent;
+    open_file *file;          // released with the response
+    #ifndef __linux__
+        FILE *stream;           // per response stream, the fd is only shared on linux
+    #endif
+    cache_entry *cached;        // released with the response
+    open_file *mapped;          // released with the response, body points into its mapping
+    size_t file_offset;
+    size_t file_remaining;
+    byte_range ranges[MAX_RANGES]; // multipart/byteranges parts
+    int8_t ranges_count;
+    int8_t range_index;         // next part to queue
+    char *range_headers;        // owned: the part headers, then the closing delimiter
+    size_t range_header_offsets[MAX_RANGES + 2];
+    int8_t close_connection;    // close the connection once sent
+    int8_t corked;              // TCP_CORK set while the header and file are written
+    size_t prefetched_to;       // file offset up to which the readahead was asked
+    size_t prefetch_end;        // the range end, or the file end for a sequential stream
+    uint32_t prefetch_window;   // next readahead length, 0 without readahead
+} http_response;
+
+#ifdef IO_URING_ON
+    // Operations of a connection, tagged in the low bits of the user_data pointer
+    #define URING_OP_ACCEPT 0
+    #define URING_OP_RECV 1
+    #define URING_OP_SENDMSG 2      // memory parts of the response
+    #define URING_OP_READ 3         // file chunk, linked to its send
+    #define URING_OP_SEND 4         // file chunk
+    #define URING_OP_TIMEOUT 5      // timer wheel tick
+    #define URING_OP_POLL 6         // idle connection waiting to be readable
+    #define URING_OP_MASK 7
+
+    // io_uring progress of a connection, nothing is in flight when it is decided
+    typedef struct {
+        response_part parts[3];
+        int parts_count;
+        struct iovec vectors[3];
+        struct msghdr message;
+        char *chunk;                // file bytes being sent
+        int32_t chunk_index;        // registered buffer, -1 when malloc'd
+        size_t chunk_length;
+        size_t chunk_sent;
+        int32_t read_result;
+        int32_t send_result;
+        int8_t read_pending;        // the chunk read result is not applied yet
+        int8_t inflight;            // submitted operations not completed yet
+    } uring_connection;
+
+    typedef struct {
+        int fd;
+        uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+        uint32_t *cq_head, *cq_tail, *cq_mask;
+        uint32_t sq_entries;
+        uint32_t sq_local_tail;     // prepared entries, published on submit
+        uint32_t sq_submitted;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        char *buffers;              // URING_BUFFERS registered chunks, NULL if not registered
+        int32_t free_buffers[URING_BUFFERS];
+        int32_t free_buffers_count;
+        SocketType listener;
+        int8_t fixed_listener;      // the listener is registered file 0
+        int8_t multishot_accept;
+        struct __kernel_timespec tick; // timeout of the pending URING_OP_TIMEOUT
+        int8_t tick_pending;
+    } uring_ring;
+
+    uring_ring uring;
+    int8_t use_io_uring = FALSE;
+#endif
+
+// Timer wheel entry, embedded in its connection
+typedef struct timer_entry {
+    struct timer_entry *prev;
+    struct timer_entry *next;
+    uint64_t expires;           // tick
+    int8_t kind;                // DEADLINE_*, DEADLINE_NONE when not linked
+} timer_entry;
+
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// Hierarchical timer wheel: a level n slot spans 64^n ticks and is cascaded to
+// the levels below when the wheel reaches it, so arming and canceling are O(1)
+typedef struct {
+    timer_entry slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // list heads
+    uint64_t now;               // last tick processed
+    uint64_t started_at;        // usec of tick 0
+    size_t count;               // armed entries
+    timer_entry *resumed;       // throttle entries expired by the last advance, linked through next
+    mutex_type lock;            // the pool threads arm, the timer thread expires
+} timer_wheel;
+
+timer_wheel connection_timers;
+
+// Pool of BUFFER_SIZE request buffers, a connection only holds one while it
+// reads or serves a request, never while it idles between requests
+typedef struct {
+    char *free_list;            // free buffers, linked through their first bytes
+    size_t free_count;
+    size_t in_use;
+    mutex_type lock;
+} buffer_pool;
+
+buffer_pool io_buffers;
+
+// Blocking writes restart the send deadline on every progress, the event loops
+// restart it when a write would block
+#ifdef EPOLL_ON
+    #define send_progressed(conn) ((void)(conn))
+#else
+    #define send_progressed(conn) watch_connection(conn, DEADLINE_SEND)
+#endif
+#ifdef IDLE_POLLER_ON
+    int idle_epoll_fd = -1;
+#endif
+
+typedef struct connection_params {
     SocketType socket;
     char *default_route;
     char *folder_to_serve;
     int8_t show_explorer;
+    connection_state state;
+    uint64_t queued_at;         // usec timestamp when queued for a worker
+    #ifdef MULTITHREAD_ON
+        struct connection_params *backlog_next; // in a connection_backlog while the queue is full
+    #endif
+    char *buffer;               // request buffer (BUFFER_SIZE) from io_buffers, NULL while idle
+    size_t buffer_used;
+    size_t buffer_scanned;      // bytes already searched for the end of the header
+    int8_t header_parsed;       // request header parsed, waiting for its body
+    http_request request;
+    http_response response;
+    uint64_t request_started_at; // usec, when the request was complete
+    timer_entry timer;          // deadline of the current state
+    int32_t admission_slot;     // per address counter of the connection, -1 if none
+    token_bucket bandwidth;     // --connection-bandwidth
+    size_t send_progress;       // response bytes sent when the send deadline was armed
+    #ifdef IDLE_POLLER_ON
+        int8_t parked;          // registered in the idle poller
+    #endif
+    #ifdef IO_URING_ON
+        uring_connection *uring;    // io_uring backend state
+    #endif
 } connection_params;
 
 #ifdef MULTITHREAD_ON
-    void *handle_connection_thread(void *thread_args);
+    // Bounded lock-free MPMC queue (Vyukov), semaphores only park idle threads
+    typedef struct {
+        size_t sequence;
+        connection_params *conn;
+    } work_queue_cell;
+
+    typedef struct {
+        work_queue_cell *cells;
+        size_t mask;
+        size_t enqueue_pos;
+        size_t dequeue_pos;
+        sem_t items;            // queued connections
+        sem_t spaces;           // free cells
+    } work_queue;
+
+    // Worker pool statistics, updated atomically
+    typedef struct {
+        uint64_t queue_depth;
+        uint64_t max_queue_depth;
+        uint64_t dequeued;
+        uint64_t total_wait_usec;
+        uint64_t max_wait_usec;
+    } thread_pool_stats;
+
+    // Connections the timer thread or the idle poller could not queue, retried
+    // on their next turn: these threads never wait for room in the queue
+    typedef struct {
+        connection_params *head;
+        connection_params *tail;
+    } connection_backlog;
+
+    work_queue connection_queue;
+    thread_pool_stats pool_stats;
+
+    void init_work_queue(work_queue *queue, size_t size);
+    int work_queue_push(work_queue *queue, connection_params *conn);
+    connection_params *work_queue_pop(work_queue *queue);
+    int enqueue_connection(connection_params *conn);
+    void backlog_connection(connection_backlog *backlog, connection_params *conn);
+    int flush_backlog(connection_backlog *backlog);
+    void start_thread_pool(int16_t threads);
+    void *connection_worker_thread(void *thread_args);
+    #ifndef EPOLL_ON
+        connection_backlog resumed_backlog; // throttled connections, only used by the timer thread
+        void start_timer_thread();
+        void *timer_thread(void *args);
+    #endif
+#endif
+
+#ifdef IDLE_POLLER_ON
+    void start_idle_poller();
+    void *idle_poller_thread(void *args);
+    int park_connection(connection_params *conn);
+#endif
+
+#ifdef EPOLL_ON
+    void set_socket_nonblocking(SocketType socket);
+    void run_event_loop(SocketType server_socket, connection_params *server_conf);
+#endif
+
+#ifdef IO_URING_ON
+    int uring_setup(SocketType server_socket);
+    struct io_uring_sqe *uring_get_sqe(uint64_t user_data);
+    int uring_enter(uint32_t wait_completions);
+    void uring_accept();
+    void uring_poll(connection_params *conn);
+    void uring_tick();
+    void uring_recv(connection_params *conn);
+    void uring_send_parts(connection_params *conn);
+    int uring_send_file(connection_params *conn);
+    void uring_send_chunk(connection_params *conn);
+    void uring_release_chunk(uring_connection *state);
+    void uring_advance(connection_params *conn);
+    void uring_complete(connection_params *conn, int op, int32_t result);
+    void uring_close(connection_params *conn);
+    void run_uring_loop(connection_params *server_conf);
+#endif
+
+#ifdef __linux__
+    void run_workers(int16_t workers);
+    pid_t spawn_worker(int16_t index);
+    void pin_to_cpu(int16_t index);
+    void master_signal_handler(int signal_number);
+    void log_workers_stats(int16_t workers);
 #endif
 
 // Utils functions
 void write_log(const char* type, const char* msg, ...);
-char* get_current_datetime();
+void get_current_datetime(char *output);
+void refresh_clock();
+void get_http_date(char *output);
 const char *get_filename_extension(const char* file_path);
-const char *get_filename_mimetype(const char *path);
+const MimeType *get_filename_mime(const char *path);
+int8_t get_filename_compressible(const char *path);
+const char *get_filename_cache_control(const char *path);
+MimeType *find_mime_type(const char *path);
+MimeType *find_mime_extension(const char *extension);
+uint32_t mime_hash(const char *key, uint32_t seed);
+int8_t mime_is_text(const char *mime_type);
+int add_mime_type(const char *extension, const char *mime_type);
+int load_mime_file(const char *file_path);
+void init_mime_types();
+void render_mime_type_fields(MimeType *mime);
+void build_mime_index();
+int set_cache_control_policy(char *rules);
+void format_http_date(time_t time, char *output);
+time_t parse_http_date(const char *date);
 void remove_slash_from_start(char* str);
 int starts_with(const char *str, const char *word);
 size_t get_file_length(const char* filename);
 char *get_arg_value(int argc, char **argv, char *target_arg);
-int extract_URI_from_header(char *header_content, char *output_buffer, size_t buffer_size) ;
+int equals_ignore_case(const char *str, const char *other);
 void *safe_malloc(size_t size);
 char *cstrdup(char *string);
-char **get_dir_content(const char* path, size_t *file_amount);
+int render_dir_listing(const char *dir_path, const char *title, string_builder *html);
+void send_dir_listing(connection_params *conn, const char *dir_path, const char *title);
 void decode_url(char* url);
-void concat_str(char** str, const char* new_str);
+void string_builder_reserve(string_builder *builder, size_t extra);
+void string_builder_append(string_builder *builder, const char *text, size_t length);
+void string_builder_printf(string_builder *builder, const char *format, ...);
+size_t escape_html(const char *text, char *output, size_t size);
 void set_shell_text_color(const char* color);
 void socket_error_msg();
+void set_socket_cork(SocketType socket, int8_t enabled);
+int socket_would_block();
+uint64_t get_time_usec();
+void atomic_max_u64(uint64_t *target, uint64_t value);
 void init_log_file();
 void close_log_file();
+void output_log_record(log_record *record);
+void sleep_ms(int32_t milliseconds);
+#ifdef MULTITHREAD_ON
+    int create_thread(void *(*routine)(void *));
+    void push_log_record(log_record *record);
+    void start_log_writer();
+    void *log_writer_thread(void *args);
+#endif
+
+// Path index functions
+int normalize_path(char *path);
+int path_in_folder(const char *path, const char *folder);
+int path_index_lookup(const char *path, path_entry *output);
+#ifdef __linux__
+    void init_path_index(const char *root);
+    int path_index_build();
+    int path_index_walk(const char *dir_path, int depth);
+    int path_index_put(const char *path, const struct stat *info);
+    void path_index_remove(const char *path, int8_t is_dir);
+    void path_index_forget_watches(const char *dir_path);
+    void path_index_clear();
+    void path_index_disable(const char *reason);
+    void path_index_apply(struct inotify_event *event);
+    void path_index_sync();
+    #ifdef MULTITHREAD_ON
+        void *path_index_watcher(void *args);
+    #endif
+#endif
+
+// Bandwidth shaping functions
+void init_token_bucket(token_bucket *bucket, uint64_t rate);
+size_t token_bucket_take(token_bucket *bucket, size_t wanted, uint64_t now);
+void token_bucket_give(token_bucket *bucket, size_t unused);
+void init_shaping(uint64_t connection_rate, uint64_t total_rate);
+size_t shaping_take(connection_params *conn, size_t wanted);
+void shaping_return(connection_params *conn, size_t unused);
+
+// Admission control functions
+void init_admission();
+int admit_connection(uint32_t address, int32_t *slot);
+void release_admission(int32_t slot);
+void reject_connection(SocketType socket, int reason);
+
+// Buffer pool functions
+void init_buffer_pool(buffer_pool *pool);
+char *buffer_pool_get(buffer_pool *pool);
+void buffer_pool_put(buffer_pool *pool, char *buffer);
+void release_connection_buffer(connection_params *conn);
+
+// Timer wheel functions
+void init_timer_wheel(timer_wheel *wheel);
+uint64_t timer_wheel_clock(timer_wheel *wheel);
+void timer_wheel_insert(timer_wheel *wheel, timer_entry *entry);
+void timer_wheel_unlink(timer_entry *entry);
+void timer_wheel_advance(timer_wheel *wheel, uint64_t tick);
+void expire_connection_timers();
+void expire_connection(timer_entry *entry);
+void watch_connection(connection_params *conn, int8_t kind);
+void throttle_connection(connection_params *conn);
+void set_connection_timer(connection_params *conn, int8_t kind, uint64_t ticks);
+void resume_connection(connection_params *conn);
+int connection_expired(connection_params *conn);
+size_t response_progress(http_response *response);
 
-// Response functions
-void send_response(SocketType socket, const char *response_content);
-void send_404_response(SocketType  socket); //  not found
-void send_500_response(SocketType  socket); // internal error
-void send_302_response(SocketType  socket, char *uri) ; // redirection
-void send_content(SocketType  socket, FILE *file, const char *content_type, size_t content_length);
-void send_partial_content(SocketType  socket, FILE *file, const char *content_type, size_t file_size, size_t start, size_t end);
-void send_file_content(SocketType  socket, FILE *file);
+// Metrics functions
+thread_metrics *get_thread_metrics();
+void collect_metrics(thread_metrics *total);
+void record_response_metrics(connection_params *conn);
+void send_metrics_response(connection_params *conn);
+#ifdef __linux__
+    void publish_worker_stats();
+#endif
+
+// File cache functions
+void init_file_cache();
+open_file *file_cache_open(const char *path);
+void file_cache_release(open_file *file);
+const char *map_open_file(open_file *file);
+void advise_file_read(connection_params *conn, open_file *file, size_t offset, size_t length);
+void prefetch_response(http_response *response);
+int read_open_file(open_file *file, char *output, size_t offset, size_t length);
+
+// Content cache functions
+uint32_t hash_string(const char *str);
+void init_memory_cache(memory_cache *cache, const char *name, size_t budget, size_t max_entry_size);
+int content_cache_fits(memory_cache *cache, size_t size);
+cache_entry *content_cache_get(memory_cache *cache, const char *path, int8_t encoding);
+cache_entry *content_cache_insert(memory_cache *cache, const char *path, int8_t encoding, char *data, size_t size, const struct stat *source, const char *header, size_t header_length, const content_validators *validators);
+cache_entry *content_cache_put(memory_cache *cache, const char *path, int8_t variant, open_file *file, const MimeType *mime, const char *encoding, const content_validators *validators);
+void content_cache_release(cache_entry *entry);
+
+// Compression functions
+int8_t get_accepted_encodings(const char *accept_encoding);
+int send_encoded_content(connection_params *conn, const char *path, int8_t encodings);
+#ifdef ZLIB_ON
+    char *gzip_compress(const char *data, size_t size, size_t *compressed_size);
+#endif
+
+// Response functions (queue the response into the connection, sent by write_response)
+void send_response(connection_params *conn, const char *response_content, size_t length);
+void send_200_response(connection_params *conn); // health check
+void send_404_response(connection_params *conn); //  not found
+void send_400_response(connection_params *conn); // malformed request
+void send_414_response(connection_params *conn); // uri too long
+void send_500_response(connection_params *conn); // internal error
+void send_302_response(connection_params *conn, char *uri) ; // redirection
+size_t render_status_line(char *header, const char *status);
+size_t render_content_header(char *header, const MimeType *mime, size_t content_length, const char *encoding, const content_validators *validators);
+size_t render_validators(char *header, size_t size, const content_validators *validators);
+void send_content(connection_params *conn, open_file *file, const MimeType *mime, size_t content_length, const char *encoding, const content_validators *validators);
+void send_cached_content(connection_params *conn, cache_entry *entry);
+void send_partial_content(connection_params *conn, open_file *file, const MimeType *mime, size_t file_size, byte_range *ranges, int ranges_count);
+void send_multipart_content(connection_params *conn, open_file *file, const MimeType *mime, size_t file_size, byte_range *ranges, int ranges_count);
+int next_range_part(http_response *response);
+void omit_response_body(http_response *response);
+size_t find_header_end(const char *data, size_t length);
+void send_416_response(connection_params *conn, size_t file_size); // range not satisfiable
+void send_304_response(connection_params *conn, const content_validators *validators); // not modified
+
+// Conditional request functions
+void get_file_validators(content_validators *validators, open_file *file);
+int request_not_modified(http_request *request, const content_validators *validators);
+int etag_matches(const char *etag_list, const char *etag);
+int if_range_matches(http_request *request, const content_validators *validators);
+
+// Range functions
+int parse_range_header(const char *value, size_t file_size, byte_range *ranges);
+int coalesce_ranges(byte_range *ranges, int count);
+void send_file_content(connection_params *conn, open_file *file, size_t offset, size_t length);
+int write_response(connection_params *conn);
+int collect_response_parts(http_response *response, response_part *parts);
+void advance_response_parts(response_part *parts, int parts_count, size_t sent);
+int throttle_response(connection_params *conn);
+void release_response(http_response *response);
 void close_socket(SocketType socket);
+
+// Request parsing functions
+int parse_request(connection_params *conn);
+const char *get_request_header(http_request *request, const char *name);
+void finish_request(connection_params *conn);
+
+// Connection functions
+connection_params *new_connection(SocketType socket, connection_params *server_conf, int32_t admission_slot);
+void close_connection(connection_params *conn);
+void handle_request(connection_params *conn);
+int prepare_response(connection_params *conn);
+int drive_connection(connection_params *conn);
 void handle_connection(connection_params *params);
 
 // All supported mimetypes
-MimeType mime_types[MAX_MIME_TYPES] = {
-    { ".html", "text/html" },
-    { ".htm", "text/html" },
-    { ".srt", "application/x-subrip" },
-    { ".vtt", "text/vtt" },
-    { ".txt", "text/plain" },
-    { ".css", "text/css" },
-    { ".js", "application/javascript" },
-    { ".json", "application/json" },
-    { ".xml", "application/xml" },
-    { ".gif", "image/gif" },
-    { ".jpeg", "image/jpeg" },
-    { ".mkv",  "video/x-matroska"},
-    { ".flac",  "audio/flac"},
-    { ".mp3",  "audio/mp3"},
-    { ".jpg", "image/jpeg" },
-    { ".png", "image/png" },
-    { ".svg", "image/svg+xml" },
-    { ".mp4", "video/mp4" },
-    { ".ico", "image/x-icon" },
-    { ".pdf", "application/pdf" }
+// Built-in types, --mime-file adds to them and --cache-control tunes their policy
+MimeType mime_types[] = {
+    // documents and text
+    { ".html", "text/html", TRUE, "no-cache" },
+    { ".htm", "text/html", TRUE, "no-cache" },
+    { ".xhtml", "application/xhtml+xml", TRUE, "no-cache" },
+    { ".txt", "text/plain", TRUE, "no-cache" },
+    { ".text", "text/plain", TRUE, "no-cache" },
+    { ".log", "text/plain", TRUE, "no-cache" },
+    { ".md", "text/markdown", TRUE, "no-cache" },
+    { ".markdown", "text/markdown", TRUE, "no-cache" },
+    { ".csv", "text/csv", TRUE, "no-cache" },
+    { ".tsv", "text/tab-separated-values", TRUE, "no-cache" },
+    { ".ics", "text/calendar", TRUE, "no-cache" },
+    { ".vcf", "text/vcard", TRUE, "no-cache" },
+    { ".rtf", "application/rtf", TRUE, "no-cache" },
+    { ".json", "application/json", TRUE, "no-cache" },
+    { ".jsonld", "application/ld+json", TRUE, "no-cache" },
+    { ".geojson", "application/geo+json", TRUE, "no-cache" },
+    { ".webmanifest", "application/manifest+json", TRUE, "no-cache" },
+    { ".xml", "application/xml", TRUE, "no-cache" },
+    { ".xsl", "application/xml", TRUE, "no-cache" },
+    { ".rss", "application/rss+xml", TRUE, "no-cache" },
+    { ".atom", "application/atom+xml", TRUE, "no-cache" },
+    { ".yaml", "application/yaml", TRUE, "no-cache" },
+    { ".yml", "application/yaml", TRUE, "no-cache" },
+    { ".toml", "application/toml", TRUE, "no-cache" },
+    { ".srt", "application/x-subrip", TRUE, "max-age=3600" },
+    { ".vtt", "text/vtt", TRUE, "max-age=3600" },
+    { ".m3u8", "application/vnd.apple.mpegurl", TRUE, "no-cache" },
+    { ".mpd", "application/dash+xml", TRUE, "no-cache" },
+    { ".pdf", "application/pdf", FALSE, "max-age=86400" },
+    { ".epub", "application/epub+zip", FALSE, "max-age=86400" },
+    { ".doc", "application/msword", FALSE, "max-age=86400" },
+    { ".docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document", FALSE, "max-age=86400" },
+    { ".xls", "application/vnd.ms-excel", FALSE, "max-age=86400" },
+    { ".xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet", FALSE, "max-age=86400" },
+    { ".ppt", "application/vnd.ms-powerpoint", FALSE, "max-age=86400" },
+    { ".pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation", FALSE, "max-age=86400" },
+    { ".odt", "application/vnd.oasis.opendocument.text", FALSE, "max-age=86400" },
+    { ".ods", "application/vnd.oasis.opendocument.spreadsheet", FALSE, "max-age=86400" },
+    { ".odp", "application/vnd.oasis.opendocument.presentation", FALSE, "max-age=86400" },
+    // code and web assets
+    { ".css", "text/css", TRUE, "max-age=3600" },
+    { ".js", "application/javascript", TRUE, "max-age=3600" },
+    { ".mjs", "application/javascript", TRUE, "max-age=3600" },
+    { ".map", "application/json", TRUE, "max-age=3600" },
+    { ".wasm", "application/wasm", FALSE, "max-age=3600" },
+    { ".ts", "video/mp2t", FALSE, "max-age=86400" },
+    { ".c", "text/x-c", TRUE, "no-cache" },
+    { ".h", "text/x-c", TRUE, "no-cache" },
+    { ".cpp", "text/x-c", TRUE, "no-cache" },
+    { ".py", "text/x-python", TRUE, "no-cache" },
+    { ".sh", "application/x-sh", TRUE, "no-cache" },
+    // fonts
+    { ".woff", "font/woff", FALSE, "max-age=86400" },
+    { ".woff2", "font/woff2", FALSE, "max-age=86400" },
+    { ".ttf", "font/ttf", TRUE, "max-age=86400" },
+    { ".otf", "font/otf", TRUE, "max-age=86400" },
+    { ".eot", "application/vnd.ms-fontobject", TRUE, "max-age=86400" },
+    // images
+    { ".gif", "image/gif", FALSE, "max-age=86400" },
+    { ".jpeg", "image/jpeg", FALSE, "max-age=86400" },
+    { ".jpg", "image/jpeg", FALSE, "max-age=86400" },
+    { ".jpe", "image/jpeg", FALSE, "max-age=86400" },
+    { ".png", "image/png", FALSE, "max-age=86400" },
+    { ".apng", "image/apng", FALSE, "max-age=86400" },
+    { ".webp", "image/webp", FALSE, "max-age=86400" },
+    { ".avif", "image/avif", FALSE, "max-age=86400" },
+    { ".heic", "image/heic", FALSE, "max-age=86400" },
+    { ".heif", "image/heif", FALSE, "max-age=86400" },
+    { ".jxl", "image/jxl", FALSE, "max-age=86400" },
+    { ".bmp", "image/bmp", TRUE, "max-age=86400" },
+    { ".tif", "image/tiff", FALSE, "max-age=86400" },
+    { ".tiff", "image/tiff", FALSE, "max-age=86400" },
+    { ".svg", "image/svg+xml", TRUE, "max-age=86400" },
+    { ".svgz", "image/svg+xml", FALSE, "max-age=86400" },
+    { ".ico", "image/x-icon", FALSE, "max-age=86400" },
+    { ".cur", "image/x-icon", FALSE, "max-age=86400" },
+    { ".psd", "image/vnd.adobe.photoshop", FALSE, "max-age=86400" },
+    // audio
+    { ".mp3", "audio/mp3", FALSE, "max-age=86400" },
+    { ".flac", "audio/flac", FALSE, "max-age=86400" },
+    { ".wav", "audio/wav", TRUE, "max-age=86400" },
+    { ".ogg", "audio/ogg", FALSE, "max-age=86400" },
+    { ".oga", "audio/ogg", FALSE, "max-age=86400" },
+    { ".opus", "audio/opus", FALSE, "max-age=86400" },
+    { ".m4a", "audio/mp4", FALSE, "max-age=86400" },
+    { ".aac", "audio/aac", FALSE, "max-age=86400" },
+    { ".weba", "audio/webm", FALSE, "max-age=86400" },
+    { ".mid", "audio/midi", FALSE, "max-age=86400" },
+    { ".midi", "audio/midi", FALSE, "max-age=86400" },
+    { ".aif", "audio/aiff", FALSE, "max-age=86400" },
+    { ".aiff", "audio/aiff", FALSE, "max-age=86400" },
+    { ".m3u", "audio/x-mpegurl", TRUE, "no-cache" },
+    { ".pls", "audio/x-scpls", TRUE, "no-cache" },
+    // video
+    { ".mp4", "video/mp4", FALSE, "max-age=86400" },
+    { ".m4v", "video/mp4", FALSE, "max-age=86400" },
+    { ".mkv", "video/x-matroska", FALSE, "max-age=86400" },
+    { ".mka", "audio/x-matroska", FALSE, "max-age=86400" },
+    { ".webm", "video/webm", FALSE, "max-age=86400" },
+    { ".ogv", "video/ogg", FALSE, "max-age=86400" },
+    { ".mov", "video/quicktime", FALSE, "max-age=86400" },
+    { ".avi", "video/x-msvideo", FALSE, "max-age=86400" },
+    { ".wmv", "video/x-ms-wmv", FALSE, "max-age=86400" },
+    { ".flv", "video/x-flv", FALSE, "max-age=86400" },
+    { ".mpeg", "video/mpeg", FALSE, "max-age=86400" },
+    { ".mpg", "video/mpeg", FALSE, "max-age=86400" },
+    { ".3gp", "video/3gpp", FALSE, "max-age=86400" },
+    { ".m2ts", "video/mp2t", FALSE, "max-age=86400" },
+    { ".ass", "text/x-ssa", TRUE, "max-age=3600" },
+    { ".ssa", "text/x-ssa", TRUE, "max-age=3600" },
+    // archives and binaries
+    { ".zip", "application/zip", FALSE, "max-age=86400" },
+    { ".gz", "application/gzip", FALSE, "max-age=86400" },
+    { ".tgz", "application/gzip", FALSE, "max-age=86400" },
+    { ".bz2", "application/x-bzip2", FALSE, "max-age=86400" },
+    { ".xz", "application/x-xz", FALSE, "max-age=86400" },
+    { ".zst", "application/zstd", FALSE, "max-age=86400" },
+    { ".br", "application/x-brotli", FALSE, "max-age=86400" },
+    { ".tar", "application/x-tar", TRUE, "max-age=86400" },
+    { ".7z", "application/x-7z-compressed", FALSE, "max-age=86400" },
+    { ".rar", "application/vnd.rar", FALSE, "max-age=86400" },
+    { ".iso", "application/x-iso9660-image", FALSE, "max-age=86400" },
+    { ".apk", "application/vnd.android.package-archive", FALSE, "max-age=86400" },
+    { ".deb", "application/vnd.debian.binary-package", FALSE, "max-age=86400" },
+    { ".rpm", "application/x-rpm", FALSE, "max-age=86400" },
+    { ".exe", "application/vnd.microsoft.portable-executable", FALSE, "max-age=86400" },
+    { ".msi", "application/x-msdownload", FALSE, "max-age=86400" },
+    { ".dmg", "application/x-apple-diskimage", FALSE, "max-age=86400" },
+    { ".jar", "application/java-archive", FALSE, "max-age=86400" },
+    { ".bin", "application/octet-stream", FALSE, "max-age=86400" },
+    { ".torrent", "application/x-bittorrent", FALSE, "max-age=86400" }
 };
 
 // File explorer
-const char *FILE_EXPLORER_HEADER = "HTTP/1.1\r\n"
-    "Content-Type: text/html\r\n"
-    "Connection: keep-alive\r\n"
-    "Keep-Alive: timeout=5\r\n\r\n"
-    "<!DOCTYPE html>"
+const char *FILE_EXPLORER_HEADER = "<!DOCTYPE html>"
     "<html>"
     "<head><title>TinyC</title><meta charset='UTF-8'></head>"
     "<body>"
     "<h1>Content into: %s</h1>"
-    "(%d elements found)"
+    "(" SIZE_T_FORMAT " elements found)"
     "<hr>"
     "<ul style='padding-left:3em'>";
 
@@ -153,43 +1167,62 @@ const char *FILE_EXPLORER_FOOTER = "</ul>"
     "</body>"
     "</html>";
 
-// HTTP common responses
-const char *HTTP_404_NOT_FOUND =
+// HTTP common responses (arrays, so their length is known at compile time,
+// keep each Content-Length in sync with its body)
+const char CONTENT_HEADER_FIELDS[] = // after the status line of a 200
+    "Connection: keep-alive\r\n"
+    "Keep-Alive: timeout=5\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "Accept-Ranges: bytes\r\n";
+
+const char HTTP_404_NOT_FOUND[] =
     "HTTP/1.1 404 Not Found\r\n"
     "Content-Type: text/html\r\n"
-    "Content-Length: %d\r\n\r\n<html>"
+    "Content-Length: 159\r\n"
+    "Connection: keep-alive\r\n"
+    "Keep-Alive: timeout=5\r\n\r\n<html>"
     "<head><title> Oops! 404 Not Found</title></head>"
     "<body><h1>404 Not Found! :(</h1>"
     "<p>The requested resource was not found on this server.</p>"
     "</body></html>";
 
-const char *HTTP_500_INTERNAL_ERROR =
+const char HTTP_500_INTERNAL_ERROR[] =
     "HTTP/1.1 500 Internal Server Error\r\n"
     "Content-Type: text/html\r\n"
-    "Content-Length: %d\r\n\r\n<html>"
+    "Content-Length: 113\r\n"
+    "Connection: close\r\n\r\n<html>"
     "<head><title>500 Internal Error</title></head>"
     "<body><h1>500</h1><p>Internal server error.</p>"
     "</body></html>";
 
-const char *HTTP_302_REDIRECTION = 
-    "HTTP/1.1 302 Found\r\n"
+const char *HTTP_302_REDIRECTION = // after the status line
     "Location: %s\r\n"
     "Connection: close\r\n"
     "\r\n";
 
-const char *HTTP_414_URL_TOO_LONG = 
+const char HTTP_400_BAD_REQUEST[] =
+    "HTTP/1.1 400 Bad Request\r\n"
+    "Content-Type: text/html\r\n"
+    "Connection: close\r\n\r\n<html>"
+    "<head><title>400 Bad Request</title></head>"
+    "<body><h1>400</h1><p>Malformed request.</p>"
+    "</body></html>";
+
+const char HTTP_414_URL_TOO_LONG[] = 
     "HTTP/1.1 414 Found\r\n"
     "Content-Type: text/html\r\n"
-    "Content-Length: %d\r\n\r\n<html>"
+    "Content-Length: 103\r\n"
+    "Connection: close\r\n\r\n<html>"
     "<head><title>414 URL Too Long</title></head>"
     "<body><h1>414</h1><p> URL too long!</p>"
     "</body></html>";
 
 
-const char *HTTP_200_OK = 
+const char HTTP_200_OK[] = 
     "HTTP/1.1 200 Found\r\n"
     "Content-Type: text/html\r\n"
-    "Content-Length: %d\r\n\r\n<html>"
+    "Content-Length: 73\r\n"
+    "Connection: close\r\n\r\n<html>"
     "<head><title>OKi doki</title></head>"
     "<body><h1>OK</h1>"
     "</body></html>";
@@ -0,0 +1,708 @@
+/* TinyC load generator (Linux).
+   Generates a corpus, optionally starts a server build on it, then runs closed
+   loop scenarios and reports requests/sec, throughput and latency percentiles.
+
+   make bench
+   ./utils/bench --server ./tinyc_epoll --duration 10 --output results.json -- --io-uring
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define TRUE  1
+#define FALSE 0
+
+#define DEFAULT_PORT 18081
+#define DEFAULT_DURATION 5          // seconds per scenario
+#define DEFAULT_CONNECTIONS 32
+#define DEFAULT_SLOW_CLIENTS 64
+#define DEFAULT_MEDIA_SIZE_MB 64
+#define MAX_CONNECTIONS 1024
+#define CORPUS_ASSETS 256           // small compressible files, 512b..32kb
+#define CORPUS_LISTING_FILES 4000   // entries of the big directory
+#define RANGE_READ_SIZE 65536       // bytes per random range read
+#define SLOW_CLIENT_INTERVAL_MS 200 // a slow client sends one header byte per interval
+#define SERVER_START_TIMEOUT_MS 5000
+#define IO_BUFFER_SIZE 65536
+#define HISTOGRAM_SIZE 1024         // 16 sub-buckets per power of 2 of microseconds
+
+typedef enum {
+    SCENARIO_SMALL,                 // random small assets
+    SCENARIO_RANGE,                 // random ranges of the media file
+    SCENARIO_EXPLORER,              // listing of the big directory
+} request_kind;
+
+typedef struct {
+    const char *name;
+    const char *description;
+    request_kind kind;
+    int8_t keep_alive;
+    int8_t slow_clients;            // slow connections are held open meanwhile
+} bench_scenario;
+
+const bench_scenario scenarios[] = {
+    { "keepalive_small", "small assets over keep-alive connections", SCENARIO_SMALL, TRUE, FALSE },
+    { "range_reads", "random 64kb ranges of the media file", SCENARIO_RANGE, TRUE, FALSE },
+    { "explorer", "listing of a big directory", SCENARIO_EXPLORER, TRUE, FALSE },
+    { "churn", "one connection per small asset", SCENARIO_SMALL, FALSE, FALSE },
+    { "slow_clients", "small assets while slow clients trickle their headers", SCENARIO_SMALL, TRUE, TRUE },
+};
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_SIZE];
+    uint64_t total;
+    uint64_t max;
+} histogram;
+
+typedef struct {
+    const bench_scenario *scenario;
+    pthread_t thread;
+    uint32_t random_state;
+    histogram latencies;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t connections;
+    uint64_t slow_closed;           // slow clients dropped by the server
+} bench_worker;
+
+typedef struct {
+    const char *name;
+    double seconds;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t connections;
+    uint64_t slow_closed;
+    double p50_us, p99_us, p999_us, max_us;
+} bench_result;
+
+// Settings
+char host[64] = "127.0.0.1";
+int port = DEFAULT_PORT;
+int duration = DEFAULT_DURATION;
+int connections_count = DEFAULT_CONNECTIONS;
+int slow_clients_count = DEFAULT_SLOW_CLIENTS;
+int media_size_mb = DEFAULT_MEDIA_SIZE_MB;
+const char *corpus_dir = "bench_corpus";
+const char *only_scenario = NULL;
+const char *output_path = NULL;
+size_t media_size = 0;
+struct sockaddr_in server_address;
+
+volatile int running = FALSE;
+
+/* ====================================================================== */
+/* =======  Utils  ======================================================= */
+/* ====================================================================== */
+
+uint64_t now_usec(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* xorshift32, one state per thread */
+uint32_t next_random(uint32_t *state){
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+char *get_arg_value(int argc, char **argv, const char *target_arg){
+    for (int i = 1; i < argc && strcmp(argv[i], "--") != 0; i++) {
+        if (strcmp(argv[i], target_arg) == 0)
+            return i + 1 < argc ? argv[i + 1] : "";
+    }
+    return NULL;
+}
+
+void histogram_record(histogram *hist, uint64_t value){
+    int index = (int)value;
+    if (value >= 16) {
+        int msb = 63 - __builtin_clzll(value);
+        index = (msb - 3) * 16 + (int)((value >> (msb - 4)) & 15);
+    }
+    hist->counts[index]++;
+    hist->total++;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+/* Lower bound of a bucket, values are within 1/16 of it */
+uint64_t histogram_bucket_value(int index){
+    if (index < 16)
+        return index;
+    int msb = index / 16 + 3;
+    return (uint64_t)(16 + index % 16) << (msb - 4);
+}
+
+double histogram_percentile(const histogram *hist, double percentile){
+    uint64_t target = (uint64_t)(hist->total * percentile / 100.0 + 0.5), seen = 0;
+    if (hist->total == 0)
+        return 0;
+    if (target == 0)
+        target = 1;
+    for (int i = 0; i < HISTOGRAM_SIZE; i++) {
+        seen += hist->counts[i];
+        if (seen >= target)
+            return (double)histogram_bucket_value(i);
+    }
+    return (double)hist->max;
+}
+
+void histogram_merge(histogram *target, const histogram *source){
+    for (int i = 0; i < HISTOGRAM_SIZE; i++)
+        target->counts[i] += source->counts[i];
+    target->total += source->total;
+    if (source->max > target->max)
+        target->max = source->max;
+}
+
+/* ====================================================================== */
+/* =======  Corpus  ====================================================== */
+/* ====================================================================== */
+
+int write_file(const char *path, const char *data, size_t size){
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return FALSE;
+    size_t written = fwrite(data, 1, size, file);
+    fclose(file);
+    return written == size;
+}
+
+/* Small assets, a big media file and a big directory, reused if complete */
+int generate_corpus(){
+    char path[512], marker[512];
+    struct stat info;
+    uint32_t random_state = 2463534242u;
+    const char *extensions[] = { "html", "css", "js", "json", "svg" };
+
+    snprintf(marker, sizeof(marker), "%s/.bench_corpus_%d", corpus_dir, media_size_mb);
+    snprintf(path, sizeof(path), "%s/media/movie.mp4", corpus_dir);
+    if (stat(marker, &info) == 0 && stat(path, &info) == 0) {
+        media_size = info.st_size;
+        return TRUE;
+    }
+    printf("Generating the corpus in '%s'...\n", corpus_dir);
+
+    const char *dirs[] = { "", "/assets", "/media", "/listing" };
+    for (int i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s%s", corpus_dir, dirs[i]);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            perror(path);
+            return FALSE;
+        }
+    }
+
+    // Text like content so the compressing builds have work to do
+    char *text = malloc(32768);
+    const char *words[] = { "tiny ", "server ", "static ", "content ", "{ color: red; } ", "<div>", "</div>\n", "var x = 1;\n" };
+    for (int i = 0; i < CORPUS_ASSETS; i++) {
+        size_t size = 512 + next_random(&random_state) % (32768 - 512), length = 0;
+        while (length < size) {
+            const char *word = words[next_random(&random_state) % 8];
+            size_t word_length = strlen(word);
+            if (length + word_length > size)
+                word_length = size - length;
+            memcpy(text + length, word, word_length);
+            length += word_length;
+        }
+        snprintf(path, sizeof(path), "%s/assets/asset_%03d.%s", corpus_dir, i, extensions[i % 5]);
+        if (!write_file(path, text, size)) {
+            perror(path);
+            free(text);
+            return FALSE;
+        }
+    }
+    free(text);
+
+    for (int i = 0; i < CORPUS_LISTING_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/listing/file_%04d.txt", corpus_dir, i);
+        if (!write_file(path, "x\n", 2)) {
+            perror(path);
+            return FALSE;
+        }
+    }
+
+    // Incompressible media file
+    snprintf(path, sizeof(path), "%s/media/movie.mp4", corpus_dir);
+    FILE *file = fopen(path, "wb");
+    uint32_t *chunk = malloc(1 << 20);
+    if (file == NULL || chunk == NULL) {
+        perror(path);
+        return FALSE;
+    }
+    for (int i = 0; i < media_size_mb; i++) {
+        for (size_t j = 0; j < (1 << 20) / sizeof(uint32_t); j++)
+            chunk[j] = next_random(&random_state);
+        fwrite(chunk, 1, 1 << 20, file);
+    }
+    fclose(file);
+    free(chunk);
+    media_size = (size_t)media_size_mb << 20;
+
+    return write_file(marker, "", 0);
+}
+
+/* ====================================================================== */
+/* =======  Client  ====================================================== */
+/* ====================================================================== */
+
+int open_connection(){
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval timeout = { .tv_sec = 10, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, (struct sockaddr *)&server_address, sizeof(server_address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int send_all(int fd, const char *data, size_t length){
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return FALSE;
+        data += sent;
+        length -= sent;
+    }
+    return TRUE;
+}
+
+/* Read one response, body included. Returns its status (0 on error) and the
+   bytes received; *closing is set when the server will close the connection. */
+int read_response(int fd, char *buffer, uint64_t *received, int8_t *closing){
+    size_t used = 0;
+    char *header_end = NULL;
+    *closing = FALSE;
+
+    while (header_end == NULL) {
+        if (used == IO_BUFFER_SIZE - 1)
+            return 0;
+        ssize_t length = recv(fd, buffer + used, IO_BUFFER_SIZE - 1 - used, 0);
+        if (length <= 0)
+            return 0;
+        used += length;
+        buffer[used] = '\0';
+        header_end = strstr(buffer, "\r\n\r\n");
+    }
+    *header_end = '\0';
+
+    int status = 0;
+    if (sscanf(buffer, "HTTP/1.%*d %d", &status) != 1)
+        return 0;
+    long long content_length = -1;
+    for (char *line = strstr(buffer, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0)
+            content_length = atoll(line + 17);
+        else if (strncasecmp(line + 2, "Connection: close", 17) == 0)
+            *closing = TRUE;
+    }
+
+    size_t header_length = header_end + 4 - buffer;
+    uint64_t body = used - header_length;
+    *received += used;
+    if (content_length < 0 || status == 304) {
+        // no length: the body ends with the connection
+        *closing = TRUE;
+        if (status == 304)
+            return status;
+    }
+    while (content_length < 0 || body < (uint64_t)content_length) {
+        ssize_t length = recv(fd, buffer, IO_BUFFER_SIZE, 0);
+        if (length <= 0)
+            return content_length < 0 ? status : 0;
+        body += length;
+        *received += length;
+    }
+    return status;
+}
+
+void build_request(bench_worker *worker, char *request, size_t size){
+    const bench_scenario *scenario = worker->scenario;
+    const char *extensions[] = { "html", "css", "js", "json", "svg" };
+    const char *connection = scenario->keep_alive ? "" : "Connection: close\r\n";
+    uint32_t random = next_random(&worker->random_state);
+
+    if (scenario->kind == SCENARIO_RANGE) {
+        size_t start = media_size > RANGE_READ_SIZE ? (size_t)random * 4096 % (media_size - RANGE_READ_SIZE) : 0;
+        snprintf(request, size, "GET /media/movie.mp4 HTTP/1.1\r\nHost: %s\r\nRange: bytes=%zu-%zu\r\n%s\r\n",
+                 host, start, start + RANGE_READ_SIZE - 1, connection);
+    } else if (scenario->kind == SCENARIO_EXPLORER) {
+        snprintf(request, size, "GET /listing/ HTTP/1.1\r\nHost: %s\r\n%s\r\n", host, connection);
+    } else {
+        int asset = random % CORPUS_ASSETS;
+        snprintf(request, size, "GET /assets/asset_%03d.%s HTTP/1.1\r\nHost: %s\r\nAccept-Encoding: gzip\r\n%s\r\n",
+                 asset, extensions[asset % 5], host, connection);
+    }
+}
+
+/* Closed loop client: one request at a time, reconnecting when needed */
+void *bench_worker_thread(void *args){
+    bench_worker *worker = args;
+    char request[512];
+    char *buffer = malloc(IO_BUFFER_SIZE);
+    int fd = -1;
+    int8_t closing;
+
+    while (running) {
+        if (fd < 0) {
+            if ((fd = open_connection()) < 0) {
+                worker->errors++;
+                usleep(10000);
+                continue;
+            }
+            worker->connections++;
+        }
+        build_request(worker, request, sizeof(request));
+        uint64_t started_at = now_usec();
+        int status = 0;
+        if (send_all(fd, request, strlen(request)))
+            status = read_response(fd, buffer, &worker->bytes, &closing);
+        if (status < 200 || status >= 400) {
+            if (running)
+                worker->errors++;
+            closing = TRUE;
+        } else {
+            histogram_record(&worker->latencies, now_usec() - started_at);
+            worker->requests++;
+        }
+        if (closing || !worker->scenario->keep_alive) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    free(buffer);
+    return NULL;
+}
+
+/* Slowloris like client: trickles a header one byte at a time, reconnecting
+   (and counting it) whenever the server gives up on it */
+void *slow_client_thread(void *args){
+    bench_worker *worker = args;
+    const char *request = "GET /assets/asset_000.html HTTP/1.1\r\nHost: bench\r\nX-Slow: ";
+    size_t length = strlen(request), sent = 0;
+    int fd = -1;
+
+    while (running) {
+        if (fd < 0) {
+            if ((fd = open_connection()) < 0) {
+                usleep(SLOW_CLIENT_INTERVAL_MS * 1000);
+                continue;
+            }
+            worker->connections++;
+            sent = 0;
+        }
+        // the header never ends, the padding repeats after the request line
+        char byte = sent < length ? request[sent] : 'a';
+        if (send(fd, &byte, 1, MSG_NOSIGNAL) != 1) {
+            worker->slow_closed++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        sent++;
+        for (int waited = 0; waited < SLOW_CLIENT_INTERVAL_MS && running; waited += 10)
+            usleep(10000);
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+bench_result run_scenario(const bench_scenario *scenario){
+    bench_result result = { .name = scenario->name };
+    int slow_count = scenario->slow_clients ? slow_clients_count : 0;
+    bench_worker *workers = calloc(connections_count + slow_count, sizeof(bench_worker));
+    histogram *latencies = calloc(1, sizeof(histogram));
+
+    printf("%-16s %s (%d connections%s)\n", scenario->name, scenario->description, connections_count,
+           slow_count ? ", slow clients" : "");
+    running = TRUE;
+    for (int i = 0; i < slow_count; i++) {
+        bench_worker *worker = &workers[connections_count + i];
+        worker->scenario = scenario;
+        pthread_create(&worker->thread, NULL, slow_client_thread, worker);
+    }
+    if (slow_count > 0)
+        sleep(1); // let the slow clients settle in
+    uint64_t started_at = now_usec();
+    for (int i = 0; i < connections_count; i++) {
+        workers[i].scenario = scenario;
+        workers[i].random_state = 0x9e3779b9u * (i + 1);
+        pthread_create(&workers[i].thread, NULL, bench_worker_thread, &workers[i]);
+    }
+    sleep(duration);
+    running = FALSE;
+    for (int i = 0; i < connections_count + slow_count; i++)
+        pthread_join(workers[i].thread, NULL);
+    result.seconds = (now_usec() - started_at) / 1e6;
+
+    for (int i = 0; i < connections_count + slow_count; i++) {
+        result.requests += workers[i].requests;
+        result.errors += workers[i].errors;
+        result.bytes += workers[i].bytes;
+        result.connections += workers[i].connections;
+        result.slow_closed += workers[i].slow_closed;
+        histogram_merge(latencies, &workers[i].latencies);
+    }
+    result.p50_us = histogram_percentile(latencies, 50);
+    result.p99_us = histogram_percentile(latencies, 99);
+    result.p999_us = histogram_percentile(latencies, 99.9);
+    result.max_us = (double)latencies->max;
+    free(latencies);
+    free(workers);
+    return result;
+}
+
+/* ====================================================================== */
+/* =======  Server  ====================================================== */
+/* ====================================================================== */
+
+int server_answers(){
+    char buffer[512];
+    int fd = open_connection();
+    if (fd < 0)
+        return FALSE;
+    const char *request = "GET /test HTTP/1.1\r\nHost: bench\r\n\r\n";
+    int ok = send_all(fd, request, strlen(request)) && recv(fd, buffer, sizeof(buffer), 0) > 0;
+    close(fd);
+    return ok;
+}
+
+/* A HEAD answer carries the Content-Length of the GET but no body, so the
+   response to a GET pipelined behind it must start right after its header */
+int head_keeps_pipelining(){
+    char request[512], path[512], buffer[IO_BUFFER_SIZE];
+    const char *asset = "/assets/asset_000.html";
+    struct stat info;
+    size_t used = 0;
+    char *header_end = NULL, *length_field;
+
+    snprintf(path, sizeof(path), "%s%s", corpus_dir, asset);
+    if (stat(path, &info) != 0)
+        return FALSE;
+    int fd = open_connection();
+    if (fd < 0)
+        return FALSE;
+    snprintf(request, sizeof(request), "HEAD %s HTTP/1.1\r\nHost: %s\r\n\r\nGET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+             asset, host, asset, host);
+    int ok = send_all(fd, request, strlen(request));
+    while (ok && (header_end == NULL || used < (size_t)(header_end + 4 - buffer) + 7)) {
+        ssize_t length = recv(fd, buffer + used, IO_BUFFER_SIZE - 1 - used, 0);
+        if (length <= 0 || (used += length) == IO_BUFFER_SIZE - 1)
+            ok = FALSE;
+        buffer[used] = '\0';
+        header_end = strstr(buffer, "\r\n\r\n");
+    }
+    close(fd);
+    if (!ok)
+        return FALSE;
+    *header_end = '\0';
+    length_field = strcasestr(buffer, "\r\nContent-Length:");
+    return strncmp(buffer, "HTTP/1.1 200", 12) == 0 && length_field != NULL &&
+           atoll(length_field + 17) == (long long)info.st_size && strncmp(header_end + 4, "HTTP/1.", 7) == 0;
+}
+
+/* Start the server build in the corpus directory, everything after "--" is
+   passed to it */
+pid_t start_server(const char *server, int argc, char **argv){
+    char server_path[4096], port_arg[16];
+    if (realpath(server, server_path) == NULL) {
+        perror(server);
+        return -1;
+    }
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+
+    char **server_argv = calloc(argc + 5, sizeof(char *));
+    int server_argc = 0;
+    server_argv[server_argc++] = server_path;
+    server_argv[server_argc++] = "--port";
+    server_argv[server_argc++] = port_arg;
+    server_argv[server_argc++] = "--no-logs";
+    for (int i = 1, extra = FALSE; i < argc; i++) {
+        if (extra)
+            server_argv[server_argc++] = argv[i];
+        else if (strcmp(argv[i], "--") == 0)
+            extra = TRUE;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (chdir(corpus_dir) != 0)
+            _exit(1);
+        execv(server_path, server_argv);
+        _exit(1);
+    }
+    free(server_argv);
+    for (int waited = 0; pid > 0 && waited < SERVER_START_TIMEOUT_MS; waited += 50) {
+        usleep(50000);
+        if (server_answers())
+            return pid;
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            break;
+    }
+    fprintf(stderr, "The server '%s' did not start on port %d.\n", server, port);
+    if (pid > 0)
+        kill(pid, SIGKILL);
+    return -1;
+}
+
+/* ====================================================================== */
+/* =======  Report  ====================================================== */
+/* ====================================================================== */
+
+void print_result(const bench_result *result){
+    printf("%-16s %10.0f req/s %9.1f MB/s   p50 %8.0f us   p99 %8.0f us   p999 %8.0f us   max %8.0f us   errors %llu",
+           "", result->requests / result->seconds, result->bytes / result->seconds / 1048576.0,
+           result->p50_us, result->p99_us, result->p999_us, result->max_us, (unsigned long long)result->errors);
+    if (result->slow_closed > 0)
+        printf("   slow closed %llu", (unsigned long long)result->slow_closed);
+    printf("\n");
+}
+
+int write_results(const char *path, const char *server, const bench_result *results, int count){
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return FALSE;
+    fprintf(file, "{\n  \"server\": \"%s\",\n  \"connections\": %d,\n  \"duration\": %d,\n  \"timestamp\": %lld,\n  \"scenarios\": [\n",
+            server != NULL ? server : "external", connections_count, duration, (long long)time(NULL));
+    for (int i = 0; i < count; i++) {
+        const bench_result *result = &results[i];
+        fprintf(file, "    { \"name\": \"%s\", \"requests\": %llu, \"errors\": %llu, \"connections\": %llu, "
+                "\"requests_per_second\": %.1f, \"bytes_per_second\": %.0f, "
+                "\"p50_us\": %.0f, \"p99_us\": %.0f, \"p999_us\": %.0f, \"max_us\": %.0f, \"slow_closed\": %llu }%s\n",
+                result->name, (unsigned long long)result->requests, (unsigned long long)result->errors,
+                (unsigned long long)result->connections, result->requests / result->seconds, result->bytes / result->seconds,
+                result->p50_us, result->p99_us, result->p999_us, result->max_us,
+                (unsigned long long)result->slow_closed, i + 1 < count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    return TRUE;
+}
+
+int main(int argc, char **argv){
+    char *input_arg;
+    const char *server = NULL;
+    int scenarios_count = sizeof(scenarios) / sizeof(scenarios[0]);
+    bench_result results[sizeof(scenarios) / sizeof(scenarios[0])];
+    int results_count = 0;
+    pid_t server_pid = -1;
+
+    if (get_arg_value(argc, argv, "--help") != NULL) {
+        printf(
+            "::: TinyC load generator :::\n"
+            "\nUsage: %s [options] [-- server options]\n"
+            "\nOptions:\n"
+            "\t--server <binary>: Server build to start on the corpus, else an already running server is used.\n"
+            "\t--host <ip>: Server IP. Default is 127.0.0.1\n"
+            "\t--port <number>: Server port. Default is %d\n"
+            "\t--corpus <folder>: Generated corpus, served as the working directory. Default is bench_corpus\n"
+            "\t--media-size <megabytes>: Size of the media file. Default is %d\n"
+            "\t--duration <seconds>: Length of each scenario. Default is %d\n"
+            "\t--connections <number>: Concurrent clients. Default is %d\n"
+            "\t--slow-clients <number>: Slow clients of the slow_clients scenario. Default is %d\n"
+            "\t--scenario <name>: Only run this scenario.\n"
+            "\t--output <file>: Write the results as JSON.\n"
+            "\nScenarios:\n",
+            argv[0], DEFAULT_PORT, DEFAULT_MEDIA_SIZE_MB, DEFAULT_DURATION, DEFAULT_CONNECTIONS, DEFAULT_SLOW_CLIENTS);
+        for (int i = 0; i < scenarios_count; i++)
+            printf("\t%-16s %s\n", scenarios[i].name, scenarios[i].description);
+        return 0;
+    }
+
+    server = get_arg_value(argc, argv, "--server");
+    if ((input_arg = get_arg_value(argc, argv, "--host")) != NULL)
+        snprintf(host, sizeof(host), "%s", input_arg);
+    if ((input_arg = get_arg_value(argc, argv, "--port")) != NULL)
+        port = atoi(input_arg);
+    if ((input_arg = get_arg_value(argc, argv, "--corpus")) != NULL)
+        corpus_dir = input_arg;
+    if ((input_arg = get_arg_value(argc, argv, "--media-size")) != NULL && atoi(input_arg) > 0)
+        media_size_mb = atoi(input_arg);
+    if ((input_arg = get_arg_value(argc, argv, "--duration")) != NULL && atoi(input_arg) > 0)
+        duration = atoi(input_arg);
+    if ((input_arg = get_arg_value(argc, argv, "--connections")) != NULL && atoi(input_arg) > 0)
+        connections_count = atoi(input_arg) < MAX_CONNECTIONS ? atoi(input_arg) : MAX_CONNECTIONS;
+    if ((input_arg = get_arg_value(argc, argv, "--slow-clients")) != NULL && atoi(input_arg) >= 0)
+        slow_clients_count = atoi(input_arg) < MAX_CONNECTIONS ? atoi(input_arg) : MAX_CONNECTIONS;
+    only_scenario = get_arg_value(argc, argv, "--scenario");
+    output_path = get_arg_value(argc, argv, "--output");
+
+    signal(SIGPIPE, SIG_IGN);
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_address.sin_addr) != 1) {
+        fprintf(stderr, "Invalid host '%s'.\n", host);
+        return 1;
+    }
+    if (!generate_corpus()) {
+        fprintf(stderr, "The corpus could not be generated.\n");
+        return 1;
+    }
+    if (server != NULL && (server_pid = start_server(server, argc, argv)) < 0)
+        return 1;
+    if (server == NULL && !server_answers()) {
+        fprintf(stderr, "No server answers on %s:%d.\n", host, port);
+        return 1;
+    }
+
+    if (!head_keeps_pipelining()) {
+        fprintf(stderr, "The GET pipelined behind a HEAD is not answered right after its header.\n");
+        if (server_pid > 0) {
+            kill(server_pid, SIGTERM);
+            waitpid(server_pid, NULL, 0);
+        }
+        return 1;
+    }
+
+    for (int i = 0; i < scenarios_count; i++) {
+        if (only_scenario != NULL && strcmp(only_scenario, scenarios[i].name) != 0)
+            continue;
+        results[results_count] = run_scenario(&scenarios[i]);
+        print_result(&results[results_count++]);
+    }
+
+    if (server_pid > 0) {
+        kill(server_pid, SIGTERM);
+        waitpid(server_pid, NULL, 0);
+    }
+    if (output_path != NULL) {
+        if (!write_results(output_path, server, results, results_count)) {
+            perror(output_path);
+            return 1;
+        }
+        printf("Results written to '%s'.\n", output_path);
+    }
+    return results_count > 0 ? 0 : 1;
+}